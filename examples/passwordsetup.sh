@@ -5,7 +5,7 @@ set -e
 echo 'SiS PM Control - Password Setup'
 echo
 FILE=/etc/sispmctl/password
-which base64 > /dev/null || (echo base64 is missing; false)
+which openssl > /dev/null || (echo openssl is missing; false)
 id | grep '^uid=0(' > /dev/null || \
 (echo This scripts must be run as root; false)
 echo -n 'User name: '
@@ -24,10 +24,10 @@ do
   echo
   echo The password inputs did not match.
 done
-SECRET=$(echo -n "$UNAME:$PASSWD" | base64)
+SECRET="$UNAME:$(echo -n "$PASSWD" | openssl passwd -6 -stdin)"
 mkdir -p /etc/sispmctl
 rm -f $FILE
-echo $SECRET > $FILE
+echo "$SECRET" > $FILE
 chmod 400 $FILE
 chown sispmctl $FILE
 echo
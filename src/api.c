@@ -0,0 +1,526 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * JSON interface of the web server
+ *
+ * GET  /api/v1/devices                         list devices with status
+ * GET  /api/v1/devices/{device}/outlets        status of all outlets
+ * GET  /api/v1/devices/{device}/outlets/{n}    status of outlet n
+ * PUT  /api/v1/devices/{device}/outlets/{n}    switch outlet n
+ * PUT  /api/v1/devices/{device}/outlets        switch several outlets
+ * GET  /api/v1/groups/{group}                  status of the outlets of a group
+ * PUT  /api/v1/groups/{group}                  switch the outlets of a group
+ *
+ * A device is addressed by its serial number, its alias or as Bus:Device.
+ *
+ * Switching a single outlet or a group expects one of the bodies
+ *	{"state":"on"}, {"state":"off"}, {"state":"toggle"}
+ * Switching several outlets expects the states keyed by outlet number
+ *	{"1":"on","3":"off","4":"toggle"}
+ *
+ * The answer lists the resulting state of each outlet addressed, e.g.
+ *	[{"outlet":1,"on":true,"power":true}]
+ * For groups each entry also names the device, e.g.
+ *	[{"device":"rack1","serial":"01:02:03:04:05","outlet":1,"on":true,
+ *	  "power":true}]
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "config.h"
+#include "sispm_ctl.h"
+#include "gembird.h"
+#include "group.h"
+#include "arena.h"
+#include "http.h"
+#include "nethelp.h"
+#include "api.h"
+
+#ifndef WEBLESS
+
+#define API_PREFIX "/api/v1/devices"
+#define API_GROUPS "/api/v1/groups"
+/* Initial size of the JSON answer */
+#define API_BUFSIZE 1024
+
+/**
+ * struct json - buffer for building the answer
+ *
+ * The buffer is allocated from the arena of the connection and grows
+ * as needed.
+ *
+ * @arena:	arena of the connection
+ * @buf:	text
+ * @len:	length of the text
+ * @size:	size of @buf
+ * @overflow:	the arena is exhausted
+ */
+struct json {
+	struct arena *arena;
+	char *buf;
+	size_t len;
+	size_t size;
+	bool overflow;
+};
+
+static void json_printf(struct json *json, const char *fmt, ...)
+{
+	va_list args;
+	size_t size;
+	char *buf;
+	int len;
+
+	if (json->overflow)
+		return;
+	if (!json->buf) {
+		json->buf = arena_alloc(json->arena, API_BUFSIZE);
+		json->size = API_BUFSIZE;
+		if (!json->buf) {
+			json->overflow = true;
+			return;
+		}
+	}
+	for (;;) {
+		va_start(args, fmt);
+		len = vsnprintf(json->buf + json->len, json->size - json->len,
+				fmt, args);
+		va_end(args);
+		if (len < 0)
+			return;
+		if (json->len + len < json->size) {
+			json->len += len;
+			return;
+		}
+		for (size = json->size; size <= json->len + len; size *= 2)
+			;
+		buf = arena_grow(json->arena, json->buf, json->size, size);
+		if (!buf) {
+			/* near the cap only grow as far as needed */
+			size = json->len + len + 1;
+			buf = arena_grow(json->arena, json->buf, json->size,
+					 size);
+		}
+		if (!buf) {
+			json->overflow = true;
+			return;
+		}
+		json->buf = buf;
+		json->size = size;
+	}
+}
+
+static void api_send(struct http_conn *conn, int status, const char *reason,
+		     struct json *json)
+{
+	static const char overflow[] = "{\"error\":\"out of memory\"}";
+	const char *body = json->buf;
+	size_t len = json->len;
+
+	if (json->overflow) {
+		status = 503;
+		reason = "Service not available";
+		body = overflow;
+		len = sizeof(overflow) - 1;
+	}
+	conn->status = status;
+	output_printf(conn->out,
+		      "HTTP/1.1 %d %s\r\n"
+		      "Server: SisPM\r\n"
+		      "Content-Type: application/json\r\n"
+		      "Cache-Control: no-store\r\n",
+		      status, reason);
+	http_header_end(conn->out, conn, true, len);
+	output_add(conn->out, body, len);
+	output_finish(conn->out);
+}
+
+/* the message is inserted verbatim, it must not need JSON escaping */
+static void api_error(struct http_conn *conn, int status, const char *reason,
+		      const char *message)
+{
+	struct json json = {.arena = &conn->arena};
+
+	json_printf(&json, "{\"error\":\"%s\"}", message);
+	api_send(conn, status, reason, &json);
+}
+
+/**
+ * json_outlet() - append the state of an outlet
+ *
+ * @json:	answer
+ * @gb:		device
+ * @outlet:	outlet number
+ * Return:	0 on success, -1 on USB error
+ */
+static int json_outlet(struct json *json, struct gembird *gb, int outlet)
+{
+	int on, power;
+
+	on = gembird_command(gb, GEMBIRD_STATUS, outlet);
+	power = gembird_command(gb, GEMBIRD_POWER, outlet);
+	if (on < 0 || power < 0)
+		return -1;
+	json_printf(json, "{\"outlet\":%d,\"on\":%s,\"power\":%s}", outlet,
+		    on ? "true" : "false", power ? "true" : "false");
+	return 0;
+}
+
+/**
+ * json_device() - append the description and status of a device
+ *
+ * The status is taken from the snapshot of gembird_poll(). A device that
+ * could not be read is listed with a null status.
+ *
+ * @json:	answer
+ * @gb:		device
+ */
+static void json_device(struct json *json, struct gembird *gb)
+{
+	int status[MAXOUTLET + 1];
+	int outlet;
+
+	json_printf(json, "{\"serial\":\"%s\",\"usb\":\"%s:%s\",\"index\":%d,"
+		    "\"outlets\":%d,\"status\":", gembird_serial(gb),
+		    gb->dev->bus, gb->dev->filename, gb->devnum,
+		    gembird_outlets(gb));
+	if (gembird_snapshot(gb, status)) {
+		json_printf(json, "null}");
+		return;
+	}
+	json_printf(json, "[");
+	for (outlet = 1; outlet <= gembird_outlets(gb); ++outlet)
+		json_printf(json, "%s{\"outlet\":%d,\"on\":%s,\"power\":%s}",
+			    outlet > 1 ? "," : "", outlet,
+			    status[outlet] & 1 ? "true" : "false",
+			    status[outlet] & 2 ? "true" : "false");
+	json_printf(json, "]}");
+}
+
+/**
+ * api_parse_state() - convert a JSON string value to a command
+ *
+ * @value:	pointer to the opening quote of the value
+ * @cmd:	command
+ * Return:	0 on success, -1 if the value is not on, off, or toggle
+ */
+static int api_parse_state(const char *value, enum gembird_cmd *cmd)
+{
+	if (!strncasecmp(value, "\"on\"", 4))
+		*cmd = GEMBIRD_ON;
+	else if (!strncasecmp(value, "\"off\"", 5))
+		*cmd = GEMBIRD_OFF;
+	else if (!strncasecmp(value, "\"toggle\"", 8))
+		*cmd = GEMBIRD_TOGGLE;
+	else
+		return -1;
+	return 0;
+}
+
+/**
+ * api_next_pair() - find next "key":"value" pair of a flat JSON object
+ *
+ * @ptr:	current position
+ * @key:	set to the first character of the key
+ * @value:	set to the opening quote of the value
+ * Return:	position after the value, NULL if there is no further pair
+ */
+static const char *api_next_pair(const char *ptr, const char **key,
+				 const char **value)
+{
+	ptr = strchr(ptr, '"');
+	if (!ptr)
+		return NULL;
+	*key = ++ptr;
+	ptr = strchr(ptr, '"');
+	if (!ptr)
+		return NULL;
+	for (++ptr; *ptr == ' ' || *ptr == '\t' || *ptr == '\r' ||
+	     *ptr == '\n'; ++ptr)
+		;
+	if (*ptr++ != ':')
+		return NULL;
+	for (; *ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n';
+	     ++ptr)
+		;
+	if (*ptr != '"')
+		return NULL;
+	*value = ptr;
+	ptr = strchr(ptr + 1, '"');
+	return ptr ? ptr + 1 : NULL;
+}
+
+static void api_outlets(struct http_conn *conn, const char *method, const char *body,
+			struct gembird *gb)
+{
+	struct json json = {.arena = &conn->arena};
+	enum gembird_cmd cmd[MAXOUTLET + 1];
+	bool selected[MAXOUTLET + 1] = {false};
+	const char *key, *value;
+	int outlet, count = 0;
+
+	if (!strcmp(method, "GET")) {
+		for (outlet = 1; outlet <= gembird_outlets(gb); ++outlet)
+			selected[outlet] = true;
+	} else {
+		/* validate all pairs before switching anything */
+		while (body && (body = api_next_pair(body, &key, &value))) {
+			outlet = atoi(key);
+			if (outlet < 1 || outlet > gembird_outlets(gb)) {
+				api_error(conn, 404, "Not found",
+					  "no such outlet");
+				return;
+			}
+			if (api_parse_state(value, &cmd[outlet])) {
+				api_error(conn, 400, "Bad request",
+					  "state must be on, off, or toggle");
+				return;
+			}
+			selected[outlet] = true;
+			++count;
+		}
+		if (!count) {
+			api_error(conn, 400, "Bad request", "no outlet given");
+			return;
+		}
+		for (outlet = 1; outlet <= gembird_outlets(gb); ++outlet) {
+			if (selected[outlet] &&
+			    gembird_command(gb, cmd[outlet], outlet) < 0) {
+				api_error(conn, 503, "Service not available",
+					  "device not accessible");
+				return;
+			}
+		}
+	}
+
+	json_printf(&json, "[");
+	for (outlet = 1, count = 0; outlet <= gembird_outlets(gb); ++outlet) {
+		if (!selected[outlet])
+			continue;
+		if (count++)
+			json_printf(&json, ",");
+		if (json_outlet(&json, gb, outlet)) {
+			api_error(conn, 503, "Service not available",
+				  "device not accessible");
+			return;
+		}
+	}
+	json_printf(&json, "]");
+	api_send(conn, 200, "OK", &json);
+}
+
+static void api_outlet(struct http_conn *conn, const char *method, const char *body,
+		       struct gembird *gb, int outlet)
+{
+	struct json json = {.arena = &conn->arena};
+	const char *key, *value;
+	enum gembird_cmd cmd;
+
+	if (outlet < 1 || outlet > gembird_outlets(gb)) {
+		api_error(conn, 404, "Not found", "no such outlet");
+		return;
+	}
+	if (strcmp(method, "GET")) {
+		if (!body || !api_next_pair(body, &key, &value) ||
+		    strncmp(key, "state\"", 6) ||
+		    api_parse_state(value, &cmd)) {
+			api_error(conn, 400, "Bad request",
+				  "state must be on, off or toggle");
+			return;
+		}
+		if (gembird_command(gb, cmd, outlet) < 0) {
+			api_error(conn, 503, "Service not available",
+				  "device not accessible");
+			return;
+		}
+	}
+	json_printf(&json, "[");
+	if (json_outlet(&json, gb, outlet)) {
+		api_error(conn, 503, "Service not available",
+			  "device not accessible");
+		return;
+	}
+	json_printf(&json, "]");
+	api_send(conn, 200, "OK", &json);
+}
+
+/**
+ * api_group() - switch or query the outlets of a group
+ *
+ * The devices of the group are accessed concurrently, see gembird_apply().
+ *
+ * @conn:	connection
+ * @method:	HTTP method
+ * @name:	group name
+ * @body:	request body, NULL if there is none
+ */
+static void api_group(struct http_conn *conn, const char *method,
+		      const char *name, const char *body)
+{
+	struct json json = {.arena = &conn->arena};
+	struct gembird_target *targets, *t;
+	const struct group *group;
+	const char *key, *value, *missing;
+	enum gembird_cmd cmd;
+	int count, outlet, state;
+	bool first = true;
+
+	group = group_find(name, strlen(name));
+	if (!group) {
+		api_error(conn, 404, "Not found", "no such group");
+		return;
+	}
+	if (strcmp(method, "GET") &&
+	    (!body || !api_next_pair(body, &key, &value) ||
+	     strncmp(key, "state\"", 6) || api_parse_state(value, &cmd))) {
+		api_error(conn, 400, "Bad request",
+			  "state must be on, off or toggle");
+		return;
+	}
+	count = group_resolve(group, &targets, &missing);
+	if (count < 0) {
+		if (missing)
+			api_error(conn, 404, "Not found", "no such device");
+		else
+			api_error(conn, 503, "Service not available",
+				  "out of memory");
+		return;
+	}
+	/* report the status read after switching */
+	if ((strcmp(method, "GET") && gembird_apply(targets, count, cmd)) ||
+	    gembird_apply(targets, count, GEMBIRD_STATUS)) {
+		free(targets);
+		api_error(conn, 503, "Service not available",
+			  "device not accessible");
+		return;
+	}
+	json_printf(&json, "[");
+	for (t = targets; t < targets + count; ++t) {
+		for (outlet = 1; outlet <= MAXOUTLET; ++outlet) {
+			if (!(t->outlets & (1U << outlet)))
+				continue;
+			state = t->state[outlet];
+			json_printf(&json, "%s{\"device\":\"%s\",\"serial\":\"%s\","
+				    "\"outlet\":%d,\"on\":%s,\"power\":%s}",
+				    first ? "" : ",", t->name, gembird_serial(t->gb),
+				    outlet, state & 1 ? "true" : "false",
+				    state & 2 ? "true" : "false");
+			first = false;
+		}
+	}
+	json_printf(&json, "]");
+	free(targets);
+	api_send(conn, 200, "OK", &json);
+}
+
+/**
+ * api_process() - answer a request for the JSON interface
+ *
+ * @conn:	connection
+ * @method:	HTTP method
+ * @path:	requested path
+ * @body:	request body, NULL if there is none
+ */
+void api_process(struct http_conn *conn, const char *method, const char *path,
+		 const char *body)
+{
+	struct json json = {.arena = &conn->arena};
+	struct gembird *gb;
+	const char *name, *ptr;
+	size_t len;
+	char *end;
+	int i, outlet;
+	bool first;
+
+	/* the body of the response is dropped by http_header_end() */
+	if (conn->head)
+		method = "GET";
+	if (strcmp(method, "GET") && strcmp(method, "PUT") &&
+	    strcmp(method, "POST")) {
+		api_error(conn, 405, "Method not allowed", "method not allowed");
+		return;
+	}
+
+	if (!strncmp(path, API_GROUPS, strlen(API_GROUPS))) {
+		path += strlen(API_GROUPS);
+		if (*path != '/' || !path[1] || strchr(path + 1, '/')) {
+			api_error(conn, 404, "Not found", "no such resource");
+			return;
+		}
+		api_group(conn, method, path + 1, body);
+		return;
+	}
+	path += strlen(API_PREFIX);
+	if (!*path || !strcmp(path, "/")) {
+		if (strcmp(method, "GET")) {
+			api_error(conn, 405, "Method not allowed",
+				  "method not allowed");
+			return;
+		}
+		/* read all devices concurrently */
+		gembird_poll();
+		json_printf(&json, "[");
+		for (i = 0, first = true; i < gembird_count; ++i) {
+			/* unplugged devices keep their place for a replug */
+			gb = gembird_get(i);
+			if (!__atomic_load_n(&gb->present, __ATOMIC_ACQUIRE))
+				continue;
+			if (!first)
+				json_printf(&json, ",");
+			json_device(&json, gb);
+			first = false;
+		}
+		json_printf(&json, "]");
+		api_send(conn, 200, "OK", &json);
+		return;
+	}
+	if (*path != '/') {
+		api_error(conn, 404, "Not found", "no such resource");
+		return;
+	}
+
+	name = ++path;
+	ptr = strchr(name, '/');
+	len = ptr ? (size_t)(ptr - name) : strlen(name);
+	gb = gembird_find(name, len);
+	if (!gb) {
+		api_error(conn, 404, "Not found", "no such device");
+		return;
+	}
+	if (!ptr || strncmp(ptr, "/outlets", 8)) {
+		api_error(conn, 404, "Not found", "no such resource");
+		return;
+	}
+	ptr += 8;
+	if (!*ptr || !strcmp(ptr, "/")) {
+		api_outlets(conn, method, body, gb);
+		return;
+	}
+	outlet = strtol(ptr + 1, &end, 10);
+	if (*ptr != '/' || end == ptr + 1 || (*end && strcmp(end, "/"))) {
+		api_error(conn, 404, "Not found", "no such resource");
+		return;
+	}
+	api_outlet(conn, method, body, gb, outlet);
+}
+
+/**
+ * api_request() - check if a path belongs to the JSON interface
+ *
+ * @path:	requested path
+ * Return:	true for paths of the JSON interface
+ */
+bool api_request(const char *path)
+{
+	size_t len = strlen(API_PREFIX);
+
+	if (!strncmp(path, API_GROUPS, strlen(API_GROUPS)) &&
+	    path[strlen(API_GROUPS)] == '/')
+		return true;
+	return !strncmp(path, API_PREFIX, len) &&
+	       (path[len] == '\0' || path[len] == '/');
+}
+
+#endif /* !WEBLESS */
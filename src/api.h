@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * JSON interface of the web server
+ */
+
+#ifndef API_H
+#define API_H
+
+#include <stdbool.h>
+
+struct http_conn;
+
+bool api_request(const char *path);
+void api_process(struct http_conn *conn, const char *method,
+		 const char *path, const char *body);
+
+#endif /* API_H */
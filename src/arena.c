@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Bounded bump allocator
+ *
+ * Each connection owns one block of a fixed size. Allocations are carved
+ * from the block and never freed individually. Requests that would exceed
+ * the block fail, so the memory of a connection never exceeds its cap.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+/* Alignment of allocations */
+#define ARENA_ALIGN 16
+
+static size_t arena_align(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/**
+ * arena_init() - initialize an arena without allocating memory
+ *
+ * @arena:	arena
+ * @size:	maximum number of bytes
+ */
+void arena_init(struct arena *arena, size_t size)
+{
+	arena->base = NULL;
+	arena->size = size;
+	arena->used = 0;
+}
+
+/**
+ * arena_alloc() - allocate memory
+ *
+ * @arena:	arena
+ * @size:	number of bytes
+ * Return:	memory or NULL with errno = ENOMEM if the cap is reached
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	void *ptr;
+
+	if (!arena->base) {
+		arena->base = malloc(arena->size);
+		if (!arena->base) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	size = arena_align(size);
+	if (size > arena->size - arena->used) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	ptr = arena->base + arena->used;
+	arena->used += size;
+	return ptr;
+}
+
+/**
+ * arena_grow() - enlarge an allocation
+ *
+ * The last allocation grows in place. Other allocations are copied.
+ *
+ * @arena:	arena
+ * @ptr:	allocation or NULL
+ * @old:	current size of the allocation
+ * @size:	new size, larger than @old
+ * Return:	memory or NULL with errno = ENOMEM if the cap is reached, the
+ *		old allocation stays valid
+ */
+void *arena_grow(struct arena *arena, void *ptr, size_t old, size_t size)
+{
+	char *new;
+
+	old = arena_align(old);
+	if (ptr && (char *)ptr + old == arena->base + arena->used) {
+		size = arena_align(size);
+		if (size - old > arena->size - arena->used) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		arena->used += size - old;
+		return ptr;
+	}
+	new = arena_alloc(arena, size);
+	if (new && ptr)
+		memcpy(new, ptr, old);
+	return new;
+}
+
+/**
+ * arena_reset() - release all allocations made after a mark
+ *
+ * @arena:	arena
+ * @mark:	value of @arena->used when the mark was taken
+ */
+void arena_reset(struct arena *arena, size_t mark)
+{
+	arena->used = mark;
+}
+
+/**
+ * arena_free() - release the block
+ *
+ * @arena:	arena
+ */
+void arena_free(struct arena *arena)
+{
+	free(arena->base);
+	arena->base = NULL;
+	arena->used = 0;
+}
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Bounded bump allocator
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ * struct arena - memory of one connection
+ *
+ * The block is allocated on first use. Allocations are released together
+ * by resetting the arena to a mark.
+ *
+ * @base:	block, NULL while unused
+ * @size:	size of the block, the hard cap
+ * @used:	number of bytes allocated
+ */
+struct arena {
+	char *base;
+	size_t size;
+	size_t used;
+};
+
+void arena_init(struct arena *arena, size_t size);
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_grow(struct arena *arena, void *ptr, size_t old, size_t size);
+void arena_reset(struct arena *arena, size_t mark);
+void arena_free(struct arena *arena);
+
+#endif /* ARENA_H */
@@ -0,0 +1,381 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Authentication of web clients
+ *
+ * The password file contains one credential per line. A line "user:hash"
+ * holds a password hash created by crypt(3), e.g. with "openssl passwd -6".
+ * A line without colon holds the base64 encoded "user:password" as used by
+ * earlier versions.
+ *
+ * Hashing is slow by design. Verified Authorization headers are kept in a
+ * small cache so that polling clients pay the cost only once.
+ *
+ * Wrong credentials are answered with a delay that doubles with each
+ * failure of the client address. While the delay of an address runs, its
+ * credentials are not checked at all. The caller postpones the answer
+ * without blocking other clients.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+#include "config.h"
+#ifdef HAVE_CRYPT_H
+#include <crypt.h>
+#endif
+#include "http.h"
+#include "auth.h"
+#include "metrics.h"
+
+#ifndef WEBLESS
+
+/* Maximum length of an Authorization token */
+#define AUTH_TOKEN_MAX 256
+/* Number of cached tokens */
+#define AUTH_CACHE 16
+/* Milliseconds a verified token is cached */
+#define AUTH_CACHE_TIME 300000
+/* Number of client addresses tracked for throttling */
+#define AUTH_CLIENTS 64
+/* Milliseconds of delay after the first failure */
+#define AUTH_DELAY 2000
+/* Maximum delay in milliseconds */
+#define AUTH_DELAY_MAX 60000
+/* Milliseconds after which the failures of a client are forgotten */
+#define AUTH_FORGET 900000
+
+/**
+ * struct auth_user - credential
+ *
+ * @name:	user name, for base64 encoded credentials the token
+ * @hash:	crypt(3) hash, NULL for base64 encoded credentials
+ * @next:	next credential
+ */
+struct auth_user {
+	char *name;
+	char *hash;
+	struct auth_user *next;
+};
+
+/**
+ * struct auth_token - verified Authorization token
+ *
+ * @token:	base64 encoded credentials
+ * @len:	length of @token, 0 if the entry is unused
+ * @expires:	time in milliseconds when the entry expires
+ */
+struct auth_token {
+	char token[AUTH_TOKEN_MAX];
+	size_t len;
+	long long expires;
+};
+
+/**
+ * struct auth_client - failures of a client address
+ *
+ * @addr:	address
+ * @failures:	number of failures
+ * @until:	time in milliseconds until which the client is rejected
+ * @last:	time in milliseconds of the last failure
+ */
+struct auth_client {
+	struct in_addr addr;
+	unsigned int failures;
+	long long until;
+	long long last;
+};
+
+static struct auth_user *auth_users;
+static struct auth_token auth_cache[AUTH_CACHE];
+static unsigned int auth_cache_next;
+static struct auth_client auth_clients[AUTH_CLIENTS];
+static pthread_mutex_t auth_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * auth_equal() - compare in time independent of the position of differences
+ *
+ * @secret:	expected value
+ * @len:	length of @secret
+ * @value:	value to check
+ * @vlen:	length of @value
+ * Return:	true if equal
+ */
+static bool auth_equal(const char *secret, size_t len, const char *value,
+		       size_t vlen)
+{
+	unsigned char diff = len != vlen;
+	size_t i;
+
+	for (i = 0; i < vlen; ++i)
+		diff |= (unsigned char)value[i] ^
+			(unsigned char)(len ? secret[i % len] : 0);
+	return !diff;
+}
+
+/**
+ * auth_decode() - decode base64
+ *
+ * @in:		base64 encoded text
+ * @out:	buffer of at least strlen(@in) bytes, NUL terminated
+ * Return:	0 on success, -1 if @in is not base64 encoded
+ */
+static int auth_decode(const char *in, char *out)
+{
+	static const char chars[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned int acc = 0, bits = 0;
+	const char *pos;
+
+	for (; *in && *in != '='; ++in) {
+		pos = strchr(chars, *in);
+		if (!pos)
+			return -1;
+		acc = (acc << 6) | (pos - chars);
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			*out++ = acc >> bits;
+		}
+	}
+	*out = '\0';
+	return 0;
+}
+
+/**
+ * auth_load() - read the credentials
+ *
+ * A missing file disables authentication.
+ *
+ * @path:	password file
+ * Return:	0 on success, -1 on error
+ */
+int auth_load(const char *path)
+{
+	struct auth_user *user;
+	char line[1024];
+	char *colon;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file) {
+		if (errno == ENOENT)
+			return 0;
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), file)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!*line || *line == '#')
+			continue;
+		colon = strchr(line, ':');
+#ifndef HAVE_CRYPT_R
+		if (colon) {
+			fprintf(stderr, "%s: password hashes are not supported\n",
+				path);
+			goto err;
+		}
+#endif
+		user = calloc(1, sizeof(struct auth_user));
+		if (!user)
+			goto oom;
+		if (colon) {
+			*colon = '\0';
+			user->hash = strdup(colon + 1);
+			if (!user->hash) {
+				free(user);
+				goto oom;
+			}
+		}
+		user->name = strdup(line);
+		if (!user->name) {
+			free(user->hash);
+			free(user);
+			goto oom;
+		}
+		user->next = auth_users;
+		auth_users = user;
+	}
+	memset(line, 0, sizeof(line));
+	fclose(file);
+	if (!auth_users) {
+		fprintf(stderr, "%s: no credentials found\n", path);
+		return -1;
+	}
+	return 0;
+oom:
+	fprintf(stderr, "Out of memory\n");
+#ifndef HAVE_CRYPT_R
+err:
+#endif
+	memset(line, 0, sizeof(line));
+	fclose(file);
+	return -1;
+}
+
+/**
+ * auth_required() - check if clients must authenticate
+ *
+ * Return:	true if credentials have been loaded
+ */
+bool auth_required(void)
+{
+	return auth_users != NULL;
+}
+
+/**
+ * auth_hash() - verify a password against a hash
+ *
+ * @password:	password
+ * @hash:	crypt(3) hash
+ * Return:	true if the password matches
+ */
+static bool auth_hash(const char *password, const char *hash)
+{
+#ifdef HAVE_CRYPT_R
+	struct crypt_data *data;
+	const char *result;
+	bool ret = false;
+
+	/* the data is too large for the stack of a worker */
+	data = calloc(1, sizeof(struct crypt_data));
+	if (!data) {
+		syslog(LOG_ERR, "Out of memory\n");
+		return false;
+	}
+	result = crypt_r(password, hash, data);
+	if (result && *result != '*')
+		ret = auth_equal(hash, strlen(hash), result, strlen(result));
+	free(data);
+	return ret;
+#else
+	return false;
+#endif
+}
+
+/**
+ * auth_verify() - verify an Authorization token
+ *
+ * @token:	base64 encoded "user:password"
+ * @len:	length of @token
+ * Return:	true if valid
+ */
+static bool auth_verify(const char *token, size_t len)
+{
+	struct auth_user *user;
+	char plain[AUTH_TOKEN_MAX];
+	bool ret = false;
+	char *password;
+
+	for (user = auth_users; user; user = user->next)
+		if (!user->hash)
+			ret |= auth_equal(user->name, strlen(user->name),
+					  token, len);
+	if (ret || auth_decode(token, plain))
+		return ret;
+	password = strchr(plain, ':');
+	if (!password)
+		return false;
+	*password++ = '\0';
+	for (user = auth_users; user; user = user->next) {
+		if (user->hash && !strcmp(user->name, plain)) {
+			ret = auth_hash(password, user->hash);
+			break;
+		}
+	}
+	memset(plain, 0, sizeof(plain));
+	return ret;
+}
+
+/* find the entry of a client, caller holds auth_mutex */
+static struct auth_client *auth_client(struct in_addr addr, long long now)
+{
+	struct auth_client *client, *oldest = auth_clients;
+
+	for (client = auth_clients; client < auth_clients + AUTH_CLIENTS;
+	     ++client) {
+		if (client->failures && client->addr.s_addr == addr.s_addr) {
+			if (now - client->last > AUTH_FORGET)
+				client->failures = 0;
+			return client;
+		}
+		if (client->last < oldest->last)
+			oldest = client;
+	}
+	return oldest;
+}
+
+/**
+ * auth_check() - check the credentials of a client
+ *
+ * @addr:	address of the client
+ * @token:	base64 encoded "user:password" from the Authorization header
+ * Return:	0 if the client is authorized, otherwise the number of
+ *		milliseconds by which the rejection shall be delayed
+ */
+long auth_check(struct in_addr addr, const char *token)
+{
+	long long now = http_now();
+	char ip[INET_ADDRSTRLEN];
+	struct auth_client *client;
+	struct auth_token *entry;
+	size_t len = strlen(token);
+	bool ok = false;
+	long delay;
+
+	pthread_mutex_lock(&auth_mutex);
+	client = auth_client(addr, now);
+	if (client->failures && client->addr.s_addr == addr.s_addr &&
+	    now < client->until) {
+		/* no guessing while the delay runs */
+	} else if (len < AUTH_TOKEN_MAX) {
+		for (entry = auth_cache; entry < auth_cache + AUTH_CACHE;
+		     ++entry)
+			ok |= entry->len && now < entry->expires &&
+			      auth_equal(entry->token, entry->len, token, len);
+		pthread_mutex_unlock(&auth_mutex);
+
+		metrics_cache(METRICS_CACHE_AUTH, ok);
+		if (!ok && auth_verify(token, len)) {
+			ok = true;
+			pthread_mutex_lock(&auth_mutex);
+			entry = &auth_cache[auth_cache_next++ % AUTH_CACHE];
+			memcpy(entry->token, token, len);
+			entry->len = len;
+			entry->expires = now + AUTH_CACHE_TIME;
+			pthread_mutex_unlock(&auth_mutex);
+		}
+
+		pthread_mutex_lock(&auth_mutex);
+		client = auth_client(addr, now);
+	}
+
+	if (ok) {
+		if (client->addr.s_addr == addr.s_addr)
+			client->failures = 0;
+		pthread_mutex_unlock(&auth_mutex);
+		return 0;
+	}
+
+	if (!client->failures || client->addr.s_addr != addr.s_addr) {
+		client->addr = addr;
+		client->failures = 0;
+		client->until = 0;
+	}
+	++client->failures;
+	delay = client->failures > 6 ? AUTH_DELAY_MAX :
+		AUTH_DELAY << (client->failures - 1);
+	if (delay > AUTH_DELAY_MAX)
+		delay = AUTH_DELAY_MAX;
+	client->last = now;
+	if (client->until < now + delay)
+		client->until = now + delay;
+	pthread_mutex_unlock(&auth_mutex);
+	inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+	syslog(LOG_WARNING, "Authentication of %s failed\n", ip);
+	return delay;
+}
+#endif
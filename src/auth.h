@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Authentication of web clients
+ */
+
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <stdbool.h>
+#include <netinet/in.h>
+
+/* File with the credentials */
+#define AUTH_FILE "/etc/sispmctl/password"
+
+int auth_load(const char *path);
+bool auth_required(void);
+long auth_check(struct in_addr addr, const char *token);
+
+#endif /* AUTH_H */
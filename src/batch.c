@@ -0,0 +1,597 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Batch processing of outlet commands
+ *
+ * Each line of the input consists of an optional device selection followed
+ * by one or more commands:
+ *
+ *	[d <index> | D <serial> | U <bus:dev>] <command> <arg> [<command> <arg>]
+ *
+ * with the commands
+ *
+ *	on <outlets>, off <outlets>, toggle <outlets>, status <outlets>,
+ *	power <outlets>, buzzer <on|off>, sequence <name>,
+ *	schedule <outlets>[=<schedule>], scan
+ *
+ * Outlets are given as a comma separated list, e.g. 1,3, as all, or as
+ * @<group> for a group defined in the group file. Empty lines and lines
+ * starting with # are ignored. A selected device stays selected for the
+ * following lines.
+ *
+ * The command schedule reads the schedules of outlets of the selected
+ * device, or writes the schedule given in the format of plannif_format()
+ * and reads it back. Either way the schedules are reported as
+ * <outlet>=<schedule>. The command scan reports the present devices as
+ * <index>=<bus>,<device>,<outlets>,<serial number>.
+ *
+ * A line consisting of fleet [<name>] starts the input of fleet_run()
+ * which ends at a line consisting of end. The states of its outlets are
+ * reported as <device>/<outlet>=unchanged|programmed|failed, errors in
+ * the input are reported with the name and the line number within the
+ * input.
+ *
+ * For each command line one result line is written:
+ *
+ *	<line number> ok [<outlet>=<state> ...]
+ *	<line number> error <message>
+ *
+ * Outlets of a group are reported as <device>/<outlet>. All outlets of a
+ * command are switched at once, see gembird_apply(). If only some of them
+ * fail, e.g. because one device of a group does not answer, the line is ok
+ * and the failed outlets are reported as <outlet>=error. A sequence defined in
+ * the sequence file is run to its end and reported as <step>=<state>.
+ *
+ * The devices are opened once and stay claimed for the whole batch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "sispm_ctl.h"
+#include "gembird.h"
+#include "group.h"
+#include "sequence.h"
+#include "fleet.h"
+#include "batch.h"
+
+/* Maximum length of an input line */
+#define BATCH_LINESIZE 1024
+/* Maximum length of a result line */
+#define BATCH_RESULTSIZE 4096
+/* Separators of the tokens of a line */
+#define BATCH_BLANKS " \t\r\n"
+
+/**
+ * batch_outlets() - parse an outlet list
+ *
+ * @gb:		device
+ * @arg:	comma separated list of outlet numbers or all
+ * @outlets:	bit n set for outlet n in the list
+ * Return:	0 on success, -1 for an invalid list
+ */
+static int batch_outlets(struct gembird *gb, char *arg, unsigned int *outlets)
+{
+	int outlet;
+	char *end;
+
+	*outlets = 0;
+	if (!strcasecmp(arg, "all")) {
+		for (outlet = 1; outlet <= gembird_outlets(gb); ++outlet)
+			*outlets |= 1U << outlet;
+		return 0;
+	}
+	for (;;) {
+		outlet = strtol(arg, &end, 10);
+		if (end == arg || outlet < 1 || outlet > gembird_outlets(gb))
+			return -1;
+		*outlets |= 1U << outlet;
+		if (!*end)
+			return 0;
+		if (*end != ',')
+			return -1;
+		arg = end + 1;
+	}
+}
+
+/**
+ * batch_select() - select device
+ *
+ * @sel:	selector d, D, or U
+ * @arg:	index, serial number, or Bus:Device
+ * Return:	device or NULL if not found
+ */
+static struct gembird *batch_select(const char *sel, const char *arg)
+{
+	char *end;
+	int i;
+
+	if (!strcmp(sel, "d")) {
+		i = strtol(arg, &end, 10);
+		if (end == arg || *end || i < 0 || i >= gembird_count)
+			return NULL;
+		return gembird_get(i);
+	}
+	return gembird_find(arg, strlen(arg));
+}
+
+/**
+ * batch_apply() - execute a command and append the states to the result
+ *
+ * @targets:	outlets
+ * @count:	number of targets
+ * @cmd:	command
+ * @group:	report outlets as <device>/<outlet>
+ * @numeric:	report states as 0 and 1 instead of off and on
+ * @result:	buffer for the result
+ * @size:	size of the result buffer
+ * Return:	0 on success, 1 if some outlets failed, -1 on error
+ */
+static int batch_apply(struct gembird_target *targets, int count,
+		       enum gembird_cmd cmd, bool group, int numeric,
+		       char *result, size_t size)
+{
+	const char *onoff[] = {"off", "on", "0", "1"};
+	struct gembird_target *t, *failed = NULL;
+	size_t len = strlen(result);
+	const char *text;
+	int outlet, state;
+	bool ok = false;
+
+	if (gembird_apply(targets, count, cmd) < 0) {
+		snprintf(result, size, "out of memory");
+		return -1;
+	}
+	for (t = targets; t < targets + count; ++t) {
+		for (outlet = 1; outlet <= MAXOUTLET; ++outlet) {
+			if (!(t->outlets & (1U << outlet)))
+				continue;
+			if (t->state[outlet] >= 0)
+				ok = true;
+			else if (!failed)
+				failed = t;
+		}
+	}
+	if (failed && !ok) {
+		if (group)
+			snprintf(result, size, "device %s not accessible",
+				 failed->name);
+		else
+			snprintf(result, size, "device not accessible");
+		return -1;
+	}
+	for (t = targets; t < targets + count; ++t) {
+		for (outlet = 1; outlet <= MAXOUTLET; ++outlet) {
+			if (!(t->outlets & (1U << outlet)))
+				continue;
+			state = t->state[outlet];
+			if (cmd == GEMBIRD_STATUS)
+				state &= 1;
+			else if (cmd == GEMBIRD_POWER)
+				state = (state >> 1) & 1;
+			text = t->state[outlet] < 0 ? "error" :
+						      onoff[state + numeric];
+			if (len >= size)
+				continue;
+			if (group)
+				len += snprintf(result + len, size - len,
+						"%s%s/%d=%s", len ? " " : "",
+						t->name, outlet, text);
+			else
+				len += snprintf(result + len, size - len,
+						"%s%d=%s", len ? " " : "",
+						outlet, text);
+		}
+	}
+	return failed ? 1 : 0;
+}
+
+/**
+ * batch_group() - execute a command on the outlets of a group
+ *
+ * @name:	group name
+ * @cmd:	command
+ * @numeric:	report states as 0 and 1 instead of off and on
+ * @result:	buffer for the result
+ * @size:	size of the result buffer
+ * Return:	0 on success, 1 if some outlets failed, -1 on error
+ */
+static int batch_group(const char *name, enum gembird_cmd cmd, int numeric,
+		       char *result, size_t size)
+{
+	struct gembird_target *targets;
+	const struct group *group;
+	const char *missing;
+	int count, ret;
+
+	group = group_find(name, strlen(name));
+	if (!group) {
+		snprintf(result, size, "no group %s", name);
+		return -1;
+	}
+	count = group_resolve(group, &targets, &missing);
+	if (count < 0) {
+		if (missing)
+			snprintf(result, size, "no device %s", missing);
+		else
+			snprintf(result, size, "out of memory");
+		return -1;
+	}
+	ret = batch_apply(targets, count, cmd, true, numeric, result, size);
+	free(targets);
+	return ret;
+}
+
+/**
+ * batch_sequence() - run a sequence
+ *
+ * @name:	sequence name
+ * @result:	buffer for the result, the states of the steps are appended
+ * @size:	size of the result buffer
+ * Return:	0 on success, -1 on error
+ */
+static int batch_sequence(const char *name, char *result, size_t size)
+{
+	size_t len = strlen(result);
+	char steps[BATCH_RESULTSIZE];
+	int ret;
+
+	ret = sequence_run(name, steps, sizeof(steps));
+	if (ret < 0) {
+		snprintf(result, size, "%s", steps);
+		return -1;
+	}
+	if (ret) {
+		snprintf(result, size, "sequence %s failed: %s", name, steps);
+		return -1;
+	}
+	if (len < size)
+		snprintf(result + len, size - len, "%s%s", len ? " " : "",
+			 steps);
+	return 0;
+}
+
+/**
+ * batch_scan() - report the present devices
+ *
+ * @result:	buffer for the result
+ * @size:	size of the result buffer
+ */
+static void batch_scan(char *result, size_t size)
+{
+	size_t len = strlen(result);
+	struct transport_dev dev;
+	struct gembird *gb;
+	int i;
+
+	for (i = 0; i < gembird_count && len < size; ++i) {
+		gb = gembird_get(i);
+		if (!__atomic_load_n(&gb->present, __ATOMIC_ACQUIRE))
+			continue;
+		/* the device is replaced when it is plugged in again */
+		gembird_lock(gb);
+		dev = *gb->dev;
+		gembird_unlock(gb);
+		len += snprintf(result + len, size - len, "%s%d=%s,%s,%d,%s",
+				len ? " " : "", i, dev.bus, dev.filename,
+				gembird_outlets(gb), gembird_serial(gb));
+	}
+}
+
+/**
+ * batch_schedule() - read or write schedules of outlets of a device
+ *
+ * A schedule that is written is read back.
+ *
+ * @gb:		device
+ * @arg:	outlets, followed by =<schedule> for writing
+ * @result:	buffer for the result
+ * @size:	size of the result buffer
+ * Return:	0 on success, -1 on error
+ */
+static int batch_schedule(struct gembird *gb, char *arg, char *result,
+			  size_t size)
+{
+	struct plannif plans[1][MAXOUTLET + 1];
+	unsigned char buffer[0x28];
+	struct gembird_target target;
+	size_t len = strlen(result);
+	struct plannif plan;
+	char *text;
+	int outlet;
+
+	memset(&target, 0, sizeof(target));
+	target.gb = gb;
+	text = strchr(arg, '=');
+	if (text)
+		*text++ = '\0';
+	if (batch_outlets(gb, arg, &target.outlets)) {
+		snprintf(result, size, "invalid outlets %s", arg);
+		return -1;
+	}
+	if (text) {
+		if (plannif_parse(text, &plan)) {
+			snprintf(result, size, "invalid schedule %s", text);
+			return -1;
+		}
+		for (outlet = 1; outlet <= MAXOUTLET; ++outlet)
+			plans[0][outlet] = plan;
+		if (plannif_encode(gb->id, &plan, buffer)) {
+			snprintf(result, size, "schedule too large for device");
+			return -1;
+		}
+		if (gembird_schedules(&target, 1, plans, true) < 0) {
+			snprintf(result, size, "out of memory");
+			return -1;
+		}
+		for (outlet = 1; outlet <= MAXOUTLET; ++outlet) {
+			if ((target.outlets & (1U << outlet)) &&
+			    target.state[outlet] < 0) {
+				snprintf(result, size, "device not accessible");
+				return -1;
+			}
+		}
+	}
+	if (gembird_schedules(&target, 1, plans, false) < 0) {
+		snprintf(result, size, "out of memory");
+		return -1;
+	}
+	for (outlet = 1; outlet <= MAXOUTLET; ++outlet) {
+		if (!(target.outlets & (1U << outlet)))
+			continue;
+		if (target.state[outlet] < 0) {
+			snprintf(result, size, "device not accessible");
+			return -1;
+		}
+		if (len < size)
+			len += snprintf(result + len, size - len, "%s%d=",
+					len ? " " : "", outlet);
+		if (len < size && !plannif_format(&plans[0][outlet],
+						  result + len, size - len))
+			len += strlen(result + len);
+	}
+	return 0;
+}
+
+/**
+ * batch_line() - execute the commands of a single line
+ *
+ * @line:	line of input, modified by tokenizing
+ * @gb:		selected device, updated by device selections
+ * @numeric:	report states as 0 and 1 instead of off and on
+ * @result:	buffer for the result
+ * @size:	size of the result buffer
+ * Return:	0 on success, 1 if the line is empty, 2 if some outlets failed,
+ *		-1 on error
+ */
+int batch_line(char *line, struct gembird **gb, int numeric, char *result,
+	       size_t size)
+{
+	struct gembird_target target;
+	enum gembird_cmd cmd;
+	char *token, *arg, *save;
+	bool empty = true;
+	int ret, partial = 0;
+
+	*result = '\0';
+	for (token = strtok_r(line, BATCH_BLANKS, &save); token;
+	     token = strtok_r(NULL, BATCH_BLANKS, &save)) {
+		if (empty && *token == '#')
+			break;
+		empty = false;
+		if (!strcasecmp(token, "scan")) {
+			batch_scan(result, size);
+			continue;
+		}
+		arg = strtok_r(NULL, BATCH_BLANKS, &save);
+		if (!arg) {
+			snprintf(result, size, "missing argument for %s",
+				 token);
+			return -1;
+		}
+		if (!strcmp(token, "d") || !strcmp(token, "D") ||
+		    !strcmp(token, "U")) {
+			*gb = batch_select(token, arg);
+			if (!*gb) {
+				snprintf(result, size, "no device %s", arg);
+				return -1;
+			}
+			continue;
+		}
+		if (!strcasecmp(token, "sequence")) {
+			if (batch_sequence(arg, result, size))
+				return -1;
+			continue;
+		}
+		if (!*gb && *arg != '@') {
+			snprintf(result, size, "no device selected");
+			return -1;
+		}
+		if (!strcasecmp(token, "buzzer")) {
+			if (!strcasecmp(arg, "on")) {
+				cmd = GEMBIRD_BUZZER_ON;
+			} else if (!strcasecmp(arg, "off")) {
+				cmd = GEMBIRD_BUZZER_OFF;
+			} else {
+				snprintf(result, size, "invalid buzzer state %s",
+					 arg);
+				return -1;
+			}
+			if (gembird_command(*gb, cmd, 0) < 0) {
+				snprintf(result, size, "device not accessible");
+				return -1;
+			}
+			continue;
+		}
+		if (!strcasecmp(token, "schedule")) {
+			if (batch_schedule(*gb, arg, result, size))
+				return -1;
+			continue;
+		}
+		if (!strcasecmp(token, "on")) {
+			cmd = GEMBIRD_ON;
+		} else if (!strcasecmp(token, "off")) {
+			cmd = GEMBIRD_OFF;
+		} else if (!strcasecmp(token, "toggle")) {
+			cmd = GEMBIRD_TOGGLE;
+		} else if (!strcasecmp(token, "status")) {
+			cmd = GEMBIRD_STATUS;
+		} else if (!strcasecmp(token, "power")) {
+			cmd = GEMBIRD_POWER;
+		} else {
+			snprintf(result, size, "unknown command %s", token);
+			return -1;
+		}
+		if (*arg == '@') {
+			ret = batch_group(arg + 1, cmd, numeric, result, size);
+			if (ret < 0)
+				return -1;
+			partial |= ret;
+			continue;
+		}
+		memset(&target, 0, sizeof(target));
+		target.gb = *gb;
+		if (batch_outlets(*gb, arg, &target.outlets)) {
+			snprintf(result, size, "invalid outlets %s", arg);
+			return -1;
+		}
+		ret = batch_apply(&target, 1, cmd, false, numeric, result, size);
+		if (ret < 0)
+			return -1;
+		partial |= ret;
+	}
+	if (empty)
+		return 1;
+	return partial ? 2 : 0;
+}
+
+/**
+ * batch_fleet() - program schedules given by the following lines
+ *
+ * @in:		input, read up to the line consisting of end
+ * @name:	name of the input for error messages
+ * @lineno:	number of the current line, updated for the lines read
+ * @out:	output for the result line
+ * Return:	0 if all outlets have the desired schedule, -1 otherwise
+ */
+static int batch_fleet(FILE *in, const char *name, unsigned long *lineno,
+		       FILE *out)
+{
+	unsigned long first = *lineno;
+	char line[BATCH_LINESIZE];
+	char *input = NULL, *output = NULL, *error = NULL, *ptr;
+	size_t input_size = 0, output_size = 0, error_size = 0;
+	FILE *fin, *fout, *ferr;
+	bool end = false;
+	int ret = -1;
+
+	fin = open_memstream(&input, &input_size);
+	fout = open_memstream(&output, &output_size);
+	ferr = open_memstream(&error, &error_size);
+	while (fgets(line, sizeof(line), in)) {
+		++*lineno;
+		/* lines of the block may be indented, the end is not */
+		if (!strncasecmp(line, "end", 3) &&
+		    !line[3 + strspn(line + 3, BATCH_BLANKS)]) {
+			end = true;
+			break;
+		}
+		if (fin)
+			fputs(line, fin);
+	}
+	if (!fin || !fout || !ferr || fclose(fin)) {
+		fin = NULL;
+		fprintf(out, "%lu error out of memory\n", first);
+		goto out;
+	}
+	fin = NULL;
+	if (!end) {
+		fprintf(out, "%lu error missing end of fleet\n", first);
+		goto out;
+	}
+	/* an empty buffer cannot be opened */
+	fin = input_size ? fmemopen(input, input_size, "r") : NULL;
+	if (input_size && !fin) {
+		fprintf(out, "%lu error out of memory\n", first);
+		goto out;
+	}
+	ret = fin ? fleet_run(fin, fout, ferr, name) : 0;
+	if (fflush(fout) || fflush(ferr)) {
+		fprintf(out, "%lu error out of memory\n", first);
+		ret = -1;
+		goto out;
+	}
+	if (error_size) {
+		error[strcspn(error, "\n")] = '\0';
+		fprintf(out, "%lu error %s\n", first, error);
+		goto out;
+	}
+	/* <device>/<outlet> <state> lines become <device>/<outlet>=<state> */
+	for (ptr = output; *ptr; ++ptr) {
+		if (*ptr == ' ')
+			*ptr = '=';
+		else if (*ptr == '\n')
+			*ptr = ptr[1] ? ' ' : '\0';
+	}
+	fprintf(out, *output ? "%lu ok %s\n" : "%lu ok\n", first, output);
+out:
+	if (fin)
+		fclose(fin);
+	if (fout)
+		fclose(fout);
+	if (ferr)
+		fclose(ferr);
+	free(input);
+	free(output);
+	free(error);
+	return ret;
+}
+
+/**
+ * batch_run() - execute a batch of commands
+ *
+ * @in:		input
+ * @out:	output for the results
+ * @gb:		initially selected device, may be NULL
+ * @numeric:	report states as 0 and 1 instead of off and on
+ * Return:	0 if all lines succeeded, -1 otherwise
+ */
+int batch_run(FILE *in, FILE *out, struct gembird *gb, int numeric)
+{
+	char line[BATCH_LINESIZE];
+	char result[BATCH_RESULTSIZE];
+	unsigned long lineno = 0;
+	int ret, status = 0;
+	char *ptr;
+
+	while (fgets(line, sizeof(line), in)) {
+		++lineno;
+		ptr = line + strspn(line, BATCH_BLANKS);
+		if (!strncasecmp(ptr, "fleet", 5) &&
+		    (!ptr[5] || strchr(BATCH_BLANKS, ptr[5]))) {
+			ptr += 5;
+			ptr += strspn(ptr, BATCH_BLANKS);
+			ptr[strcspn(ptr, "\r\n")] = '\0';
+			if (batch_fleet(in, *ptr ? ptr : "fleet", &lineno, out))
+				status = -1;
+			fflush(out);
+			continue;
+		}
+		ret = batch_line(line, &gb, numeric, result, sizeof(result));
+		if (ret == 1)
+			continue;
+		/* outlets that failed are reported in an ok line */
+		if (ret == 2)
+			status = -1;
+		if (ret < 0) {
+			fprintf(out, "%lu error %s\n", lineno, result);
+			status = -1;
+		} else if (*result) {
+			fprintf(out, "%lu ok %s\n", lineno, result);
+		} else {
+			fprintf(out, "%lu ok\n", lineno);
+		}
+		fflush(out);
+	}
+	return status;
+}
@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Batch processing of outlet commands
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+
+struct gembird;
+
+int batch_line(char *line, struct gembird **gb, int numeric, char *result,
+	       size_t size);
+int batch_run(FILE *in, FILE *out, struct gembird *gb, int numeric);
+
+#endif /* BATCH_H */
@@ -0,0 +1,276 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Local control socket
+ *
+ * The listener owns all devices. Command line invocations pass their
+ * commands over a Unix domain socket instead of claiming the devices
+ * themselves. The protocol is the line oriented language of the batch
+ * mode: the client writes a line and the daemon answers with one result
+ * line. The lines of a fleet block are answered once at its end.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include "config.h"
+#include "sispm_ctl.h"
+#include "gembird.h"
+#include "batch.h"
+#include "control.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * control_path() - get path of the control socket
+ *
+ * Return:	path from $SISPMCTL_SOCKET or the default path
+ */
+const char *control_path(void)
+{
+	const char *path = getenv("SISPMCTL_SOCKET");
+
+	return path && *path ? path : CONTROL_SOCKET;
+}
+
+static int control_address(struct sockaddr_un *addr)
+{
+	const char *path = control_path();
+
+	if (strlen(path) >= sizeof(addr->sun_path))
+		return -1;
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/**
+ * control_connect() - connect to a running daemon
+ *
+ * Return:	socket or -1 if no daemon is running
+ */
+int control_connect(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (control_address(&addr))
+		return -1;
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * control_send() - send a line without waiting for a result
+ *
+ * @fd:		socket
+ * @line:	line without line feed
+ * Return:	0 on success, -1 if the connection failed
+ */
+int control_send(int fd, const char *line)
+{
+	char buf[CONTROL_LINESIZE];
+	ssize_t n;
+
+	n = snprintf(buf, sizeof(buf), "%s\n", line);
+	if (n < 0 || (size_t)n >= sizeof(buf) ||
+	    send(fd, buf, n, MSG_NOSIGNAL) != n)
+		return -1;
+	return 0;
+}
+
+/**
+ * control_receive() - wait for a result line
+ *
+ * @fd:		socket
+ * @result:	buffer for the result line without line number
+ * @size:	size of the result buffer
+ * Return:	0 for ok, 1 for error, -1 if the connection failed
+ */
+int control_receive(int fd, char *result, size_t size)
+{
+	char buf[CONTROL_LINESIZE];
+	size_t len = 0;
+	ssize_t n;
+	char *ptr;
+
+	/* read the answer byte by byte, it is a single short line */
+	for (;;) {
+		n = recv(fd, buf + len, 1, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		if (buf[len] == '\n')
+			break;
+		if (++len == sizeof(buf) - 1)
+			return -1;
+	}
+	buf[len] = '\0';
+
+	/* <line number> ok|error [text] */
+	ptr = strchr(buf, ' ');
+	if (!ptr)
+		return -1;
+	++ptr;
+	if (!strncmp(ptr, "ok", 2)) {
+		ptr += 2;
+		n = 0;
+	} else if (!strncmp(ptr, "error", 5)) {
+		ptr += 5;
+		n = 1;
+	} else {
+		return -1;
+	}
+	if (*ptr == ' ')
+		++ptr;
+	snprintf(result, size, "%s", ptr);
+	return n;
+}
+
+/**
+ * control_request() - send a command line and wait for the result
+ *
+ * @fd:		socket
+ * @line:	command line without line feed
+ * @result:	buffer for the result line without line number
+ * @size:	size of the result buffer
+ * Return:	0 for ok, 1 for error, -1 if the connection failed
+ */
+int control_request(int fd, const char *line, char *result, size_t size)
+{
+	if (control_send(fd, line))
+		return -1;
+	return control_receive(fd, result, size);
+}
+
+#ifndef WEBLESS
+
+static void *control_serve(void *arg)
+{
+	int fd = (int)(long)arg;
+	FILE *in, *out;
+	int fd2;
+
+	fd2 = dup(fd);
+	in = fdopen(fd, "r");
+	out = fd2 < 0 ? NULL : fdopen(fd2, "w");
+	if (!in || !out) {
+		syslog(LOG_ERR, "Out of memory\n");
+		if (in)
+			fclose(in);
+		else
+			close(fd);
+		if (out)
+			fclose(out);
+		else if (fd2 >= 0)
+			close(fd2);
+		return NULL;
+	}
+	/* results use off and on, the client converts them if needed */
+	batch_run(in, out, gembird_count ? gembird_get(0) : NULL, 0);
+	fclose(in);
+	fclose(out);
+	return NULL;
+}
+
+static void *control_accept(void *arg)
+{
+	int sock = (int)(long)arg;
+	pthread_t thread;
+	int fd;
+
+	for (;;) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR) {
+				syslog(LOG_ERR, "Accepting control connection "
+				       "failed: %s\n", strerror(errno));
+				sleep(1);
+			}
+			continue;
+		}
+		if (pthread_create(&thread, NULL, control_serve,
+				   (void *)(long)fd)) {
+			syslog(LOG_ERR, "Creating control thread failed\n");
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+/**
+ * control_listen() - start serving the control socket
+ *
+ * The socket is accessible for the owner and the group of the daemon.
+ *
+ * Return:	0 on success, -1 on error
+ */
+int control_listen(void)
+{
+	struct sockaddr_un addr;
+	pthread_t thread;
+	int sock, fd, ret;
+	mode_t mask;
+
+	if (control_address(&addr)) {
+		fprintf(stderr, "Control socket path too long\n");
+		return -1;
+	}
+
+	/* refuse to replace the socket of a running daemon */
+	fd = control_connect();
+	if (fd >= 0) {
+		close(fd);
+		fprintf(stderr, "Daemon already listening on %s\n",
+			addr.sun_path);
+		return -1;
+	}
+	unlink(addr.sun_path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	ret = -1;
+	if (sock >= 0) {
+		/* the socket must never be reachable by others, not even briefly */
+		mask = umask(0117);
+		ret = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+		umask(mask);
+	}
+	if (ret || chmod(addr.sun_path, 0660) || listen(sock, 8)) {
+		perror(addr.sun_path);
+		syslog(LOG_ERR, "Control socket %s cannot be opened: %s\n",
+		       addr.sun_path, strerror(errno));
+		if (sock >= 0)
+			close(sock);
+		return -1;
+	}
+	if (pthread_create(&thread, NULL, control_accept,
+			   (void *)(long)sock)) {
+		syslog(LOG_ERR, "Creating control thread failed\n");
+		close(sock);
+		return -1;
+	}
+	pthread_detach(thread);
+	syslog(LOG_INFO, "Control socket %s\n", addr.sun_path);
+	return 0;
+}
+
+#endif /* !WEBLESS */
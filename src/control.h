@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Local control socket
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stddef.h>
+
+/* Default path of the control socket */
+#define CONTROL_SOCKET "/run/sispmctl/control"
+/* Maximum length of a command or result line */
+#define CONTROL_LINESIZE 8192
+
+const char *control_path(void);
+int control_connect(void);
+int control_send(int fd, const char *line);
+int control_receive(int fd, char *result, size_t size);
+int control_request(int fd, const char *line, char *result, size_t size);
+int control_listen(void);
+
+#endif /* CONTROL_H */
@@ -0,0 +1,244 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Server-Sent Events stream of outlet changes
+ *
+ * A client of the stream first receives the last observed state of every
+ * outlet, then one event per change. Changes are detected where the status
+ * is read or switched anyway, so any number of clients adds no USB traffic.
+ *
+ * The connection is taken over from the web server. Events are written
+ * without blocking. A client that does not keep up or went away is dropped
+ * and reconnects on its own. A comment sent periodically detects clients
+ * that vanished silently.
+ *
+ * Per device, events are published while the device lock is held, so they
+ * leave in the order in which they were observed. A new client is added to
+ * the list under the same mutex under which its initial state is written,
+ * so it misses no change.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "config.h"
+#include "gembird.h"
+#include "http.h"
+#include "nethelp.h"
+#include "events.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Maximum number of clients */
+#define EVENTS_MAX 256
+/* Seconds between keep-alive comments */
+#define EVENTS_PING 15
+/* Milliseconds a browser waits before reconnecting */
+#define EVENTS_RETRY 2000
+/* Maximum length of an event */
+#define EVENTS_SIZE 256
+
+/**
+ * struct events_client - client of the event stream
+ *
+ * @fd:		socket
+ * @next:	next client
+ */
+struct events_client {
+	int fd;
+	struct events_client *next;
+};
+
+static struct events_client *events_clients;
+static int events_count;
+static pthread_mutex_t events_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * events_format() - describe the state of an outlet
+ *
+ * @buf:	buffer of EVENTS_SIZE bytes
+ * @gb:		device
+ * @outlet:	outlet number
+ * @status:	bit 0: relay status, bit 1: power supply status
+ * Return:	length of the event
+ */
+static int events_format(char *buf, struct gembird *gb, int outlet, int status)
+{
+	int len;
+
+	len = snprintf(buf, EVENTS_SIZE, "event: outlet\n"
+		       "data: {\"serial\":\"%s\",\"usb\":\"%s:%s\",\"index\":%d,"
+		       "\"outlet\":%d,\"on\":%s,\"power\":%s}\n\n",
+		       gb->serial, gb->dev->bus, gb->dev->filename, gb->devnum,
+		       outlet, status & 1 ? "true" : "false",
+		       status & 2 ? "true" : "false");
+	return len < EVENTS_SIZE ? len : EVENTS_SIZE - 1;
+}
+
+/**
+ * events_send() - write to all clients
+ *
+ * Clients whose socket buffer is full or whose connection failed are
+ * dropped.
+ *
+ * @buf:	data
+ * @len:	number of bytes
+ */
+static void events_send(const char *buf, size_t len)
+{
+	struct events_client **pos, *client;
+
+	pthread_mutex_lock(&events_mutex);
+	for (pos = &events_clients; *pos;) {
+		client = *pos;
+		if (send(client->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) ==
+		    (ssize_t)len) {
+			pos = &client->next;
+			continue;
+		}
+		*pos = client->next;
+		close(client->fd);
+		free(client);
+		__atomic_sub_fetch(&events_count, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&events_mutex);
+}
+
+/**
+ * events_outlet() - publish the state of an outlet
+ *
+ * The caller must hold the device lock.
+ *
+ * @gb:		device
+ * @outlet:	outlet number
+ * @status:	bit 0: relay status, bit 1: power supply status
+ */
+void events_outlet(struct gembird *gb, int outlet, int status)
+{
+	char buf[EVENTS_SIZE];
+
+	if (!__atomic_load_n(&events_count, __ATOMIC_RELAXED))
+		return;
+	events_send(buf, events_format(buf, gb, outlet, status));
+}
+
+/**
+ * events_device() - publish that a device was plugged in or unplugged
+ *
+ * The caller must hold the device lock or be the only user of the device.
+ *
+ * @gb:		device
+ */
+void events_device(struct gembird *gb)
+{
+	char buf[EVENTS_SIZE];
+	int len;
+
+	if (!__atomic_load_n(&events_count, __ATOMIC_RELAXED))
+		return;
+	len = snprintf(buf, sizeof(buf), "event: device\n"
+		       "data: {\"serial\":\"%s\",\"usb\":\"%s:%s\",\"index\":%d,"
+		       "\"present\":%s}\n\n",
+		       gb->serial, gb->dev->bus, gb->dev->filename, gb->devnum,
+		       gb->present ? "true" : "false");
+	events_send(buf, len < sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+#ifndef WEBLESS
+
+static void *events_ping(void *arg)
+{
+	static const char ping[] = ": ping\n\n";
+
+	for (;;) {
+		sleep(EVENTS_PING);
+		events_send(ping, sizeof(ping) - 1);
+	}
+	return NULL;
+}
+
+static void events_start(void)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, events_ping, NULL)) {
+		syslog(LOG_ERR, "Cannot start the event thread\n");
+		return;
+	}
+	pthread_detach(thread);
+}
+
+/**
+ * events_subscribe() - turn a request into a client of the event stream
+ *
+ * On success the socket is taken over and the file descriptor of @conn is
+ * set to -1.
+ *
+ * @conn:	connection
+ * Return:	0 on success or if the connection failed, -1 if there are too
+ *		many clients
+ */
+int events_subscribe(struct http_conn *conn)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	struct events_client *client;
+	struct output *out = conn->out;
+	char buf[EVENTS_SIZE];
+	struct gembird *gb;
+	int i, outlet, status;
+
+	/* read the hardware only if no client did so recently */
+	gembird_poll();
+	for (i = 0; i < gembird_count; ++i)
+		gembird_serial(gembird_get(i));
+
+	client = malloc(sizeof(struct events_client));
+	if (!client)
+		return -1;
+	client->fd = conn->fd;
+
+	pthread_mutex_lock(&events_mutex);
+	if (events_count >= EVENTS_MAX) {
+		pthread_mutex_unlock(&events_mutex);
+		free(client);
+		return -1;
+	}
+	conn->status = 200;
+	conn->keep_alive = false;
+	output_printf(out, "HTTP/1.1 200 OK\r\n"
+		      "Server: SisPM\r\n"
+		      "Content-Type: text/event-stream\r\n"
+		      "Cache-Control: no-store\r\n");
+	http_header_end(out, conn, true, HTTP_NO_BODY);
+	output_printf(out, "retry: %d\n\n", EVENTS_RETRY);
+	for (i = 0; i < gembird_count; ++i) {
+		gb = gembird_get(i);
+		for (outlet = 1; outlet <= gembird_outlets(gb); ++outlet) {
+			status = __atomic_load_n(&gb->seen[outlet],
+						 __ATOMIC_RELAXED);
+			if (status >= 0)
+				output_copy(out, buf, events_format(buf, gb,
+								    outlet,
+								    status));
+		}
+	}
+	/* a client asking for the header only gets no events */
+	if (output_finish(out) || conn->head) {
+		pthread_mutex_unlock(&events_mutex);
+		free(client);
+		return 0;
+	}
+	client->next = events_clients;
+	events_clients = client;
+	__atomic_add_fetch(&events_count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&events_mutex);
+
+	conn->fd = -1;
+	pthread_once(&once, events_start);
+	return 0;
+}
+#endif /* !WEBLESS */
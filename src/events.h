@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Server-Sent Events stream of outlet changes
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+/* Path of the event stream on the web server */
+#define EVENTS_PATH "/events"
+
+struct gembird;
+struct http_conn;
+
+int events_subscribe(struct http_conn *conn);
+void events_outlet(struct gembird *gb, int outlet, int status);
+void events_device(struct gembird *gb);
+
+#endif /* EVENTS_H */
@@ -0,0 +1,400 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Programming the schedules of many outlets
+ *
+ * Each line of the input gives the desired schedule of outlets:
+ *
+ *	<target> clear
+ *	<target> <event> [<event> ...] [loop <minutes>]
+ *
+ * with the events
+ *
+ *	at <YYYY-MM-DD> <HH:MM> <on|off>, after <minutes> <on|off>
+ *
+ * The target is @<group> or <device>/<outlets> as in the group file. An
+ * event given by after follows the previous event, the first one follows
+ * the current time. A looping schedule may start in the past, it is then
+ * programmed to start at its next repetition. Lines starting with # are
+ * comments. A later line for an outlet replaces an earlier one. Each
+ * schedule is encoded for the devices it is meant for while parsing, so a
+ * schedule too large for a device rejects the input before any write.
+ *
+ * The current schedules of all outlets are read concurrently and compared
+ * with the desired ones, see plannif_equal(). Only the schedules that
+ * differ are written and then read back for verification. For each outlet
+ * one line is written:
+ *
+ *	<device>/<outlet> unchanged|programmed|failed
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sispm_ctl.h"
+#include "gembird.h"
+#include "group.h"
+#include "fleet.h"
+
+/* Maximum length of an input line */
+#define FLEET_LINESIZE 1024
+/* Separators of the tokens of a line */
+#define FLEET_BLANKS " \t\r\n"
+/* Number of rows of a schedule including the initial wait */
+#define FLEET_ROWS (sizeof(((struct plannif *)0)->actions) / \
+		    sizeof(struct plannifAction))
+
+/**
+ * struct fleet - desired schedules
+ *
+ * @targets:	outlets, each device once
+ * @want:	desired schedules indexed like @targets and by outlet
+ * @count:	number of targets
+ * @groups:	groups of the targets, they hold the device names
+ * @ngroups:	number of groups
+ */
+struct fleet {
+	struct gembird_target *targets;
+	struct plannif (*want)[MAXOUTLET + 1];
+	int count;
+	const struct group **groups;
+	int ngroups;
+};
+
+/**
+ * fleet_add() - set the desired schedule of an outlet
+ *
+ * @fleet:	desired schedules
+ * @target:	device and its name
+ * @outlet:	outlet number as counted by gembird_outlets()
+ * @plan:	schedule
+ * Return:	0 on success, -ENOMEM if out of memory
+ */
+static int fleet_add(struct fleet *fleet, const struct gembird_target *target,
+		     int outlet, const struct plannif *plan)
+{
+	struct plannif (*want)[MAXOUTLET + 1];
+	struct gembird_target *targets;
+	int i;
+
+	for (i = 0; i < fleet->count && fleet->targets[i].gb != target->gb;
+	     ++i)
+		;
+	if (i == fleet->count) {
+		targets = realloc(fleet->targets, (i + 1) * sizeof(*targets));
+		if (!targets)
+			return -ENOMEM;
+		fleet->targets = targets;
+		want = realloc(fleet->want, (i + 1) * sizeof(*want));
+		if (!want)
+			return -ENOMEM;
+		fleet->want = want;
+		memset(&targets[i], 0, sizeof(*targets));
+		targets[i].gb = target->gb;
+		targets[i].name = target->name;
+		++fleet->count;
+	}
+	fleet->targets[i].outlets |= 1U << outlet;
+	fleet->want[i][outlet] = *plan;
+	return 0;
+}
+
+/* next token of the line or NULL */
+static char *fleet_token(char **save)
+{
+	return strtok_r(NULL, FLEET_BLANKS, save);
+}
+
+/* parse a positive number of minutes, 0 if invalid */
+static ulong fleet_minutes(const char *arg)
+{
+	char *end;
+	ulong minutes;
+
+	if (!arg || *arg == '-')
+		return 0;
+	minutes = strtoul(arg, &end, 10);
+	return *end ? 0 : minutes;
+}
+
+/**
+ * fleet_schedule() - parse the schedule of a line
+ *
+ * @save:	tokenizer state after the target
+ * @now:	current time
+ * @plan:	receives the schedule
+ * Return:	NULL on success, an error message otherwise
+ */
+static const char *fleet_schedule(char **save, time_t now,
+				  struct plannif *plan)
+{
+	time_t base = (now / 60) * 60, first = 0, last = base, date;
+	char *token, *day, *clock, buf[32];
+	ulong minutes = 0, loop = 0;
+	int n = 0;
+
+	plannif_reset(plan);
+	plan->timeStamp = now;
+	plan->actions[0].switchOn = 0;
+
+	token = fleet_token(save);
+	if (!token)
+		return "missing schedule";
+	if (!strcmp(token, "clear"))
+		return fleet_token(save) ? "unexpected argument of clear" :
+					   NULL;
+	for (; token; token = fleet_token(save)) {
+		if (!strcmp(token, "loop")) {
+			loop = fleet_minutes(fleet_token(save));
+			if (!loop)
+				return "invalid loop";
+			if (fleet_token(save))
+				return "loop must be last";
+			break;
+		}
+		/* the last row holds the loop time */
+		if (n + 1 >= FLEET_ROWS)
+			return "too many events";
+		if (!strcmp(token, "at")) {
+			day = fleet_token(save);
+			clock = fleet_token(save);
+			if (!clock)
+				return "invalid date";
+			snprintf(buf, sizeof(buf), "%s %s", day, clock);
+			date = plannif_date(buf, now);
+			if (date < 0)
+				return "invalid date";
+			if (n && date <= last)
+				return "date not after the previous event";
+			minutes = (date - last) / 60;
+		} else if (!strcmp(token, "after")) {
+			minutes = fleet_minutes(fleet_token(save));
+			if (!minutes)
+				return "invalid number of minutes";
+			date = last + 60 * minutes;
+		} else {
+			return "expected at, after or loop";
+		}
+		token = fleet_token(save);
+		if (!token || (strcmp(token, "on") && strcmp(token, "off")))
+			return "expected on or off";
+		if (n)
+			plan->actions[n].timeForNext = minutes;
+		else
+			first = date;
+		plan->actions[n + 1].switchOn = !strcmp(token, "on");
+		last = date;
+		++n;
+	}
+	if (!n)
+		return "missing event";
+
+	/* move a loop started in the past to its next repetition */
+	if (first <= base) {
+		if (!loop)
+			return "date in the past";
+		first += ((base - first) / (60 * loop) + 1) * 60 * loop;
+	}
+	plan->actions[0].timeForNext = (first - base) / 60;
+	if (plannif_loop(plan, loop))
+		return "the loop period is too short";
+	return NULL;
+}
+
+/**
+ * fleet_line() - parse a line of the input
+ *
+ * @fleet:	desired schedules
+ * @line:	line, modified by tokenizing
+ * @now:	current time
+ * @error:	buffer for the error message
+ * @size:	size of the error buffer
+ * Return:	0 on success, -1 on error
+ */
+static int fleet_line(struct fleet *fleet, char *line, time_t now,
+		      char *error, size_t size)
+{
+	const struct group **groups;
+	struct gembird_target *targets;
+	const struct group *group;
+	struct plannif plan;
+	unsigned char buffer[0x28];
+	const char *missing, *msg;
+	char *token, *save;
+	int i, outlet, count;
+
+	token = strtok_r(line, FLEET_BLANKS, &save);
+	if (!token || *token == '#')
+		return 0;
+	msg = fleet_schedule(&save, now, &plan);
+	if (msg) {
+		snprintf(error, size, "%s", msg);
+		return -1;
+	}
+	group = group_target(token);
+	if (!group) {
+		snprintf(error, size, "unknown group or invalid outlets %s",
+			 token);
+		return -1;
+	}
+	groups = realloc(fleet->groups,
+			 (fleet->ngroups + 1) * sizeof(*groups));
+	if (!groups) {
+		group_put(group);
+		goto oom;
+	}
+	fleet->groups = groups;
+	groups[fleet->ngroups++] = group;
+
+	count = group_resolve(group, &targets, &missing);
+	if (count < 0) {
+		if (!missing)
+			goto oom;
+		snprintf(error, size, "no device %s", missing);
+		return -1;
+	}
+	for (i = 0; i < count; ++i) {
+		/* like the poller, single outlet devices have no schedules */
+		if (gembird_outlets(targets[i].gb) == 1) {
+			snprintf(error, size, "device %s has no schedules",
+				 targets[i].name);
+			free(targets);
+			return -1;
+		}
+		if (plannif_encode(targets[i].gb->id, &plan, buffer)) {
+			snprintf(error, size, "schedule too large for device %s",
+				 targets[i].name);
+			free(targets);
+			return -1;
+		}
+		for (outlet = 1; outlet <= MAXOUTLET; ++outlet) {
+			if (!(targets[i].outlets & (1U << outlet)))
+				continue;
+			if (fleet_add(fleet, &targets[i], outlet, &plan)) {
+				free(targets);
+				goto oom;
+			}
+		}
+	}
+	free(targets);
+	return 0;
+oom:
+	snprintf(error, size, "out of memory");
+	return -1;
+}
+
+/**
+ * fleet_run() - program the schedules given by the input
+ *
+ * No schedule is written if the input contains an error.
+ *
+ * @in:		input
+ * @out:	output for the results
+ * @err:	output for error messages
+ * @path:	name of the input for error messages
+ * Return:	0 if all outlets have the desired schedule, -1 otherwise
+ */
+int fleet_run(FILE *in, FILE *out, FILE *err, const char *path)
+{
+	struct plannif (*have)[MAXOUTLET + 1] = NULL;
+	struct gembird_target *check = NULL;
+	struct fleet fleet = {0};
+	char line[FLEET_LINESIZE];
+	char error[FLEET_LINESIZE];
+	unsigned int bit, differ = 0;
+	int lineno = 0, i, outlet, ret = -1;
+	time_t now = time(NULL);
+	struct gembird_target *t;
+
+	while (fgets(line, sizeof(line), in)) {
+		++lineno;
+		if (fleet_line(&fleet, line, now, error, sizeof(error))) {
+			fprintf(err, "%s:%d: %s\n", path, lineno, error);
+			goto out;
+		}
+	}
+	if (!fleet.count) {
+		ret = 0;
+		goto out;
+	}
+	have = calloc(fleet.count, sizeof(*have));
+	check = calloc(fleet.count, sizeof(*check));
+	if (!have || !check) {
+		fprintf(err, "Out of memory\n");
+		goto out;
+	}
+
+	/*
+	 * Read the current schedules. The state of an outlet becomes 0 if
+	 * its schedule is as desired, 1 if it differs and -1 on error.
+	 */
+	memcpy(check, fleet.targets, fleet.count * sizeof(*check));
+	if (gembird_schedules(check, fleet.count, have, false) < 0) {
+		fprintf(err, "Out of memory\n");
+		goto out;
+	}
+	for (i = 0; i < fleet.count; ++i) {
+		t = &fleet.targets[i];
+		for (outlet = 1; outlet <= MAXOUTLET; ++outlet) {
+			bit = 1U << outlet;
+			if (check[i].state[outlet] < 0)
+				t->state[outlet] = -1;
+			else
+				t->state[outlet] = !plannif_equal(
+					&fleet.want[i][outlet],
+					&have[i][outlet], now);
+			if (t->state[outlet] <= 0)
+				check[i].outlets &= ~bit;
+		}
+		differ |= check[i].outlets;
+	}
+
+	/* write the schedules that differ and read them back */
+	if (differ && gembird_schedules(check, fleet.count, fleet.want,
+					true) >= 0) {
+		for (i = 0; i < fleet.count; ++i)
+			for (outlet = 1; outlet <= MAXOUTLET; ++outlet)
+				if (check[i].state[outlet] < 0)
+					check[i].outlets &= ~(1U << outlet);
+		if (gembird_schedules(check, fleet.count, have, false) < 0)
+			memset(check, 0, fleet.count * sizeof(*check));
+	} else {
+		memset(check, 0, fleet.count * sizeof(*check));
+	}
+	for (i = 0; i < fleet.count; ++i) {
+		t = &fleet.targets[i];
+		for (outlet = 1; outlet <= MAXOUTLET; ++outlet) {
+			bit = 1U << outlet;
+			if (t->state[outlet] <= 0)
+				continue;
+			if (!(check[i].outlets & bit) ||
+			    check[i].state[outlet] < 0 ||
+			    !plannif_equal(&fleet.want[i][outlet],
+					   &have[i][outlet], now))
+				t->state[outlet] = -1;
+		}
+	}
+
+	ret = 0;
+	for (i = 0; i < fleet.count; ++i) {
+		t = &fleet.targets[i];
+		for (outlet = 1; outlet <= MAXOUTLET; ++outlet) {
+			if (!(t->outlets & (1U << outlet)))
+				continue;
+			if (t->state[outlet] < 0)
+				ret = -1;
+			fprintf(out, "%s/%d %s\n", t->name, outlet,
+				t->state[outlet] < 0 ? "failed" :
+				t->state[outlet] ? "programmed" : "unchanged");
+		}
+	}
+out:
+	free(check);
+	free(have);
+	free(fleet.targets);
+	free(fleet.want);
+	for (i = 0; i < fleet.ngroups; ++i)
+		group_put(fleet.groups[i]);
+	free(fleet.groups);
+	return ret;
+}
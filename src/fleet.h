@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Programming the schedules of many outlets
+ */
+
+#ifndef FLEET_H
+#define FLEET_H
+
+#include <stdio.h>
+
+int fleet_run(FILE *in, FILE *out, FILE *err, const char *path);
+
+#endif /* FLEET_H */
@@ -0,0 +1,1211 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Persistent handles for Gembird devices
+ *
+ * Opening a device requires setting the configuration and claiming the
+ * interface. A long running process keeps the handle open and only reopens
+ * it after a USB error, e.g. when the device was unplugged.
+ *
+ * The registry numbers the devices in the order they were found and indexes
+ * them by USB location, serial number and user defined alias. Lookups take
+ * constant time however many devices are connected.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include "sispm_ctl.h"
+#include "gembird.h"
+#include "events.h"
+#include "metrics.h"
+#include "poller.h"
+#include "serial.h"
+
+/* Size of an index key, Bus:Device or serial number */
+#define GEMBIRD_KEYSIZE 32
+
+/**
+ * struct gembird_entry - key of an index
+ *
+ * @next:	next entry of the bucket
+ * @hash:	hash of the key
+ * @value:	device or, for aliases, serial number
+ * @key:	key
+ */
+struct gembird_entry {
+	struct gembird_entry *next;
+	unsigned long hash;
+	void *value;
+	char key[];
+};
+
+/**
+ * struct gembird_index - hash table with case insensitive keys
+ *
+ * @buckets:	chains of entries
+ * @size:	number of buckets, a power of two
+ * @count:	number of entries
+ */
+struct gembird_index {
+	struct gembird_entry **buckets;
+	size_t size;
+	size_t count;
+};
+
+int status_cache_ms = STATUSCACHE;
+/* Number of devices in the registry */
+int gembird_count;
+/* Devices in the order of their indexes, only one thread appends */
+static struct gembird **registry;
+static int registry_size;
+/* Protects the indexes and registry_unknown */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Bus:Device to device last seen there */
+static struct gembird_index location_index;
+/* Serial number to device */
+static struct gembird_index serial_index;
+/* Alias to serial number */
+static struct gembird_index alias_index;
+/* Number of devices with unknown serial number */
+static int registry_unknown;
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * gembird_init() - initialize device without opening it
+ *
+ * @gb:		device
+ * @dev:	device as found on the bus
+ * @devnum:	index of the device in the list of detected devices
+ * @serial:	serial number if already known, NULL otherwise
+ */
+void gembird_init(struct gembird *gb, struct transport_dev *dev, int devnum,
+		  const char *serial)
+{
+	int i;
+
+	gb->dev = dev;
+	gb->udev = NULL;
+	gb->present = true;
+	gb->devnum = devnum;
+	gb->id = get_id(dev);
+	gb->serial[0] = '\0';
+	if (serial)
+		snprintf(gb->serial, sizeof(gb->serial), "%s", serial);
+	pthread_mutex_init(&gb->mutex, NULL);
+	pthread_cond_init(&gb->cond, NULL);
+	gb->ticket = 0;
+	gb->serving = 0;
+	gb->status_valid = false;
+	for (i = 0; i <= MAXOUTLET; ++i)
+		gb->seen[i] = -1;
+}
+
+/**
+ * gembird_lock() - wait in line for exclusive access to the device
+ *
+ * @gb:		device
+ */
+void gembird_lock(struct gembird *gb)
+{
+	unsigned long ticket;
+
+	pthread_mutex_lock(&gb->mutex);
+	ticket = gb->ticket++;
+	while (ticket != gb->serving)
+		pthread_cond_wait(&gb->cond, &gb->mutex);
+	pthread_mutex_unlock(&gb->mutex);
+}
+
+/**
+ * gembird_unlock() - pass the device to the next thread in line
+ *
+ * @gb:		device
+ */
+void gembird_unlock(struct gembird *gb)
+{
+	pthread_mutex_lock(&gb->mutex);
+	++gb->serving;
+	pthread_cond_broadcast(&gb->cond);
+	pthread_mutex_unlock(&gb->mutex);
+}
+
+/**
+ * gembird_hash() - hash a key ignoring case
+ *
+ * @key:	key, need not be terminated
+ * @len:	length of the key
+ * Return:	FNV-1a hash
+ */
+static unsigned long gembird_hash(const char *key, size_t len)
+{
+	unsigned long hash = 2166136261UL;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		hash ^= (unsigned char)tolower((unsigned char)key[i]);
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+/**
+ * gembird_index_get() - look up a key
+ *
+ * The caller must hold registry_mutex.
+ *
+ * @index:	index
+ * @key:	key, need not be terminated
+ * @len:	length of the key
+ * Return:	value or NULL if not found
+ */
+static void *gembird_index_get(struct gembird_index *index, const char *key,
+			       size_t len)
+{
+	struct gembird_entry *entry;
+
+	if (!index->size)
+		return NULL;
+	entry = index->buckets[gembird_hash(key, len) & (index->size - 1)];
+	for (; entry; entry = entry->next)
+		if (strlen(entry->key) == len &&
+		    !strncasecmp(entry->key, key, len))
+			return entry->value;
+	return NULL;
+}
+
+/**
+ * gembird_index_put() - add a key or replace its value
+ *
+ * The number of buckets doubles when it falls below the number of keys. The
+ * caller must hold registry_mutex.
+ *
+ * @index:	index
+ * @key:	key
+ * @value:	value
+ * Return:	0 on success, -1 if out of memory
+ */
+static int gembird_index_put(struct gembird_index *index, const char *key,
+			     void *value)
+{
+	struct gembird_entry **buckets, *entry, *next;
+	size_t size, i, len = strlen(key);
+	unsigned long hash = gembird_hash(key, len);
+
+	for (entry = index->size ?
+		     index->buckets[hash & (index->size - 1)] : NULL;
+	     entry; entry = entry->next) {
+		if (!strcasecmp(entry->key, key)) {
+			entry->value = value;
+			return 0;
+		}
+	}
+	if (index->count >= index->size) {
+		size = index->size ? 2 * index->size : 16;
+		buckets = calloc(size, sizeof(struct gembird_entry *));
+		if (!buckets)
+			return -1;
+		for (i = 0; i < index->size; ++i) {
+			for (entry = index->buckets[i]; entry; entry = next) {
+				next = entry->next;
+				entry->next = buckets[entry->hash & (size - 1)];
+				buckets[entry->hash & (size - 1)] = entry;
+			}
+		}
+		free(index->buckets);
+		index->buckets = buckets;
+		index->size = size;
+	}
+	entry = malloc(sizeof(struct gembird_entry) + len + 1);
+	if (!entry)
+		return -1;
+	memcpy(entry->key, key, len + 1);
+	entry->hash = hash;
+	entry->value = value;
+	entry->next = index->buckets[hash & (index->size - 1)];
+	index->buckets[hash & (index->size - 1)] = entry;
+	++index->count;
+	return 0;
+}
+
+/**
+ * gembird_index_del() - remove a key if it has the given value
+ *
+ * The caller must hold registry_mutex.
+ *
+ * @index:	index
+ * @key:	key
+ * @value:	value
+ */
+static void gembird_index_del(struct gembird_index *index, const char *key,
+			      const void *value)
+{
+	struct gembird_entry **link, *entry;
+
+	if (!index->size)
+		return;
+	link = &index->buckets[gembird_hash(key, strlen(key)) &
+			       (index->size - 1)];
+	for (entry = *link; entry; link = &entry->next, entry = *link) {
+		if (!strcasecmp(entry->key, key)) {
+			if (entry->value == value) {
+				*link = entry->next;
+				free(entry);
+				--index->count;
+			}
+			return;
+		}
+	}
+}
+
+/* index key of the USB location of a device */
+static void gembird_location_key(const struct transport_dev *dev, char *key,
+				 size_t size)
+{
+	snprintf(key, size, "%s:%s", dev->bus, dev->filename);
+}
+
+/**
+ * gembird_register() - index the location and serial number of a device
+ *
+ * Failures to index are logged, the device can then be selected by its
+ * index only.
+ *
+ * @gb:		device
+ */
+static void gembird_register(struct gembird *gb)
+{
+	char key[GEMBIRD_KEYSIZE];
+	int ret;
+
+	gembird_location_key(gb->dev, key, sizeof(key));
+	pthread_mutex_lock(&registry_mutex);
+	ret = gembird_index_put(&location_index, key, gb);
+	if (*gb->serial)
+		ret |= gembird_index_put(&serial_index, gb->serial, gb);
+	else
+		++registry_unknown;
+	pthread_mutex_unlock(&registry_mutex);
+	if (ret) {
+		fprintf(stderr, "Out of memory\n");
+		syslog(LOG_ERR, "Out of memory\n");
+	}
+}
+
+/**
+ * gembird_aliases() - read the user defined device names
+ *
+ * Each line of the file holds a name and a serial number separated by
+ * white space. Lines starting with # are comments. A missing file defines
+ * no names.
+ *
+ * @path:	alias file
+ * Return:	0 on success, -1 on error
+ */
+static int gembird_aliases(const char *path)
+{
+	char line[256], *alias, *serial, *copy, *save;
+	int lineno = 0, ret = 0;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file) {
+		if (errno == ENOENT)
+			return 0;
+		perror(path);
+		return -1;
+	}
+	while (!ret && fgets(line, sizeof(line), file)) {
+		++lineno;
+		alias = strtok_r(line, " \t\r\n", &save);
+		if (!alias || *alias == '#')
+			continue;
+		serial = strtok_r(NULL, " \t\r\n", &save);
+		if (!serial || strlen(serial) != SERIALSIZE - 1 ||
+		    strtok_r(NULL, " \t\r\n", &save)) {
+			fprintf(stderr, "%s:%d: expected name and serial "
+				"number\n", path, lineno);
+			ret = -1;
+			break;
+		}
+		copy = strdup(serial);
+		if (!copy || gembird_index_put(&alias_index, alias, copy)) {
+			free(copy);
+			fprintf(stderr, "Out of memory\n");
+			ret = -1;
+		}
+	}
+	fclose(file);
+	return ret;
+}
+
+/* order devices by device number like the kernel enumerates them */
+static int gembird_order(const void *a, const void *b)
+{
+	const struct transport_dev *da = *(struct transport_dev * const *)a;
+	const struct transport_dev *db = *(struct transport_dev * const *)b;
+	int ret;
+
+	if (da->devnum != db->devnum)
+		return da->devnum < db->devnum ? -1 : 1;
+	ret = strcmp(da->bus, db->bus);
+	return ret ? ret : strcmp(da->filename, db->filename);
+}
+
+/**
+ * gembird_add() - append a device to the registry
+ *
+ * The table of devices doubles when it is full. Threads may still read the
+ * previous table, so it is not freed. Only one thread may add devices.
+ *
+ * @dev:	device as found on the bus
+ * @serial:	serial number if already known, NULL otherwise
+ * Return:	device or NULL if out of memory
+ */
+static struct gembird *gembird_add(struct transport_dev *dev,
+				   const char *serial)
+{
+	struct gembird **table;
+	struct gembird *gb;
+	int size;
+
+	gb = calloc(1, sizeof(struct gembird));
+	if (!gb)
+		return NULL;
+	if (gembird_count == registry_size) {
+		size = registry_size ? 2 * registry_size : 16;
+		table = calloc(size, sizeof(struct gembird *));
+		if (!table) {
+			free(gb);
+			return NULL;
+		}
+		if (registry_size)
+			memcpy(table, registry, registry_size * sizeof(*table));
+		__atomic_store_n(&registry, table, __ATOMIC_RELEASE);
+		registry_size = size;
+	}
+	gembird_init(gb, dev, gembird_count, serial);
+	gembird_register(gb);
+	registry[gembird_count] = gb;
+	__atomic_store_n(&gembird_count, gembird_count + 1, __ATOMIC_RELEASE);
+	return gb;
+}
+
+/**
+ * gembird_setup() - set up the registry with the detected devices
+ *
+ * The devices are numbered in the order of their USB device numbers.
+ * Devices plugged in later are appended, so the numbers stay stable while
+ * the process runs.
+ *
+ * @dev:	devices as found on the bus, sorted in place
+ * @count:	number of devices
+ * Return:	0 on success, -1 on error
+ */
+int gembird_setup(struct transport_dev *dev[], int count)
+{
+	int i;
+
+	if (count > 1)
+		qsort(dev, count, sizeof(struct transport_dev *),
+		      gembird_order);
+	for (i = 0; i < count; ++i) {
+		if (!gembird_add(dev[i], NULL)) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+	}
+	return gembird_aliases(GEMBIRD_ALIASES);
+}
+
+/**
+ * gembird_get() - get a device by its index
+ *
+ * @index:	index, less than gembird_count
+ * Return:	device
+ */
+struct gembird *gembird_get(int index)
+{
+	return __atomic_load_n(&registry, __ATOMIC_ACQUIRE)[index];
+}
+
+/**
+ * gembird_find_location() - find the device last seen at a USB location
+ *
+ * @name:	Bus:Device, need not be terminated
+ * @len:	length of name
+ * Return:	device or NULL if not found, the device may be unplugged
+ */
+struct gembird *gembird_find_location(const char *name, size_t len)
+{
+	struct gembird *gb;
+
+	pthread_mutex_lock(&registry_mutex);
+	gb = gembird_index_get(&location_index, name, len);
+	pthread_mutex_unlock(&registry_mutex);
+	return gb;
+}
+
+/* look up an alias or serial number in the index */
+static struct gembird *gembird_lookup(const char *name, size_t len)
+{
+	struct gembird *gb;
+	const char *serial;
+
+	pthread_mutex_lock(&registry_mutex);
+	serial = gembird_index_get(&alias_index, name, len);
+	if (serial)
+		gb = gembird_index_get(&serial_index, serial, strlen(serial));
+	else
+		gb = gembird_index_get(&serial_index, name, len);
+	pthread_mutex_unlock(&registry_mutex);
+	return gb;
+}
+
+/**
+ * gembird_find_serial() - find a device by serial number or alias
+ *
+ * Serial numbers not yet known are read once a name is not found.
+ *
+ * @name:	serial number or alias, need not be terminated
+ * @len:	length of name
+ * Return:	device or NULL if not found, the device may be unplugged
+ */
+struct gembird *gembird_find_serial(const char *name, size_t len)
+{
+	struct gembird *gb;
+	int i, count;
+
+	gb = gembird_lookup(name, len);
+	if (gb || !__atomic_load_n(&registry_unknown, __ATOMIC_RELAXED))
+		return gb;
+	count = __atomic_load_n(&gembird_count, __ATOMIC_ACQUIRE);
+	for (i = 0; i < count; ++i) {
+		gb = gembird_get(i);
+		if (!gb->serial[0] &&
+		    __atomic_load_n(&gb->present, __ATOMIC_ACQUIRE))
+			gembird_serial(gb);
+	}
+	return gembird_lookup(name, len);
+}
+
+/**
+ * gembird_at() - find a present device by its USB location
+ *
+ * @dev:	device as found on the bus
+ * Return:	device or NULL if not found
+ */
+static struct gembird *gembird_at(const struct transport_dev *dev)
+{
+	char key[GEMBIRD_KEYSIZE];
+	struct gembird *gb;
+
+	gembird_location_key(dev, key, sizeof(key));
+	gb = gembird_find_location(key, strlen(key));
+	if (gb && __atomic_load_n(&gb->present, __ATOMIC_ACQUIRE))
+		return gb;
+	return NULL;
+}
+
+/**
+ * gembird_attach() - add a device that was plugged in
+ *
+ * A device known before by its serial number takes its previous place, so
+ * its index and pointers to it stay valid. Only one thread may add and
+ * remove devices.
+ *
+ * @dev:	device as found on the bus
+ * Return:	device or NULL if the device is already present or out of
+ *		memory
+ */
+struct gembird *gembird_attach(struct transport_dev *dev)
+{
+	char serial[SERIALSIZE];
+	char key[GEMBIRD_KEYSIZE];
+	struct gembird *gb;
+
+	if (gembird_at(dev))
+		return NULL;
+	serial_get(dev, serial);
+	gb = *serial ? gembird_lookup(serial, strlen(serial)) : NULL;
+	if (gb && !__atomic_load_n(&gb->present, __ATOMIC_ACQUIRE)) {
+		gembird_lock(gb);
+		gembird_location_key(gb->dev, key, sizeof(key));
+		pthread_mutex_lock(&registry_mutex);
+		gembird_index_del(&location_index, key, gb);
+		pthread_mutex_unlock(&registry_mutex);
+		gb->dev = dev;
+		gb->id = get_id(dev);
+		gb->status_valid = false;
+		gembird_location_key(dev, key, sizeof(key));
+		pthread_mutex_lock(&registry_mutex);
+		gembird_index_put(&location_index, key, gb);
+		pthread_mutex_unlock(&registry_mutex);
+		__atomic_store_n(&gb->present, true, __ATOMIC_RELEASE);
+		events_device(gb);
+		gembird_unlock(gb);
+		return gb;
+	}
+	gb = gembird_add(dev, serial);
+	if (!gb) {
+		syslog(LOG_ERR, "Out of memory\n");
+		return NULL;
+	}
+	events_device(gb);
+	return gb;
+}
+
+/**
+ * gembird_detach() - mark a device as unplugged
+ *
+ * Commands waiting for the device fail. Its entry is kept for the case that
+ * the device is plugged in again.
+ *
+ * @dev:	device as found on the bus
+ * Return:	device or NULL if the device was not present
+ */
+struct gembird *gembird_detach(const struct transport_dev *dev)
+{
+	struct gembird *gb;
+	int outlet;
+
+	gb = gembird_at(dev);
+	if (!gb)
+		return NULL;
+	/* queued commands fail instead of trying to open the device */
+	__atomic_store_n(&gb->present, false, __ATOMIC_RELEASE);
+	gembird_lock(gb);
+	gembird_close(gb);
+	gb->status_valid = false;
+	for (outlet = 0; outlet <= MAXOUTLET; ++outlet)
+		__atomic_store_n(&gb->seen[outlet], -1, __ATOMIC_RELAXED);
+	events_device(gb);
+	gembird_unlock(gb);
+	return gb;
+}
+
+/**
+ * gembird_find() - find a present device by Bus:Device, serial number or
+ *		    alias
+ *
+ * @name:	Bus:Device, serial number or alias, need not be terminated
+ * @len:	length of name
+ * Return:	device or NULL if not found
+ */
+struct gembird *gembird_find(const char *name, size_t len)
+{
+	struct gembird *gb;
+
+	gb = gembird_find_location(name, len);
+	if (!gb || !__atomic_load_n(&gb->present, __ATOMIC_ACQUIRE))
+		gb = gembird_find_serial(name, len);
+	if (gb && __atomic_load_n(&gb->present, __ATOMIC_ACQUIRE))
+		return gb;
+	return NULL;
+}
+
+/**
+ * gembird_outlets() - get number of outlets
+ *
+ * @gb:		device
+ * Return:	number of outlets
+ */
+int gembird_outlets(struct gembird *gb)
+{
+	if (gb->id == PRODUCT_ID_MSISPM_OLD || gb->id == PRODUCT_ID_MSISPM_FLASH)
+		return 1;
+	return MAXOUTLET;
+}
+
+/**
+ * gembird_handle() - get claimed handle, open the device if needed
+ *
+ * The caller must hold the device lock.
+ *
+ * @gb:		device
+ * Return:	handle or NULL if the device cannot be accessed
+ */
+struct transport_handle *gembird_handle(struct gembird *gb)
+{
+	if (gb->udev)
+		return gb->udev;
+	if (!__atomic_load_n(&gb->present, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	gb->udev = get_handle(gb->dev);
+	if (!gb->udev) {
+		fprintf(stderr, "No access to Gembird #%d USB device %s\n",
+			gb->devnum, gb->dev->filename);
+		syslog(LOG_ERR, "No access to Gembird #%d USB device %s\n",
+		       gb->devnum, gb->dev->filename);
+		return NULL;
+	}
+	if (verbose)
+		fprintf(stderr, "Accessing Gembird #%d USB device %s\n",
+			gb->devnum, gb->dev->filename);
+	return gb->udev;
+}
+
+/**
+ * gembird_invalidate() - close handle after a USB error
+ *
+ * The next call to gembird_handle() reopens the device. The caller must hold
+ * the device lock.
+ *
+ * @gb:		device
+ */
+void gembird_invalidate(struct gembird *gb)
+{
+	if (!gb->udev)
+		return;
+	syslog(LOG_WARNING, "Reopening Gembird #%d USB device %s\n",
+	       gb->devnum, gb->dev->filename);
+	gembird_close(gb);
+}
+
+/**
+ * gembird_close() - release the interface and close the handle
+ *
+ * The caller must hold the device lock or be the only user of the device.
+ *
+ * @gb:		device
+ */
+void gembird_close(struct gembird *gb)
+{
+	if (!gb->udev)
+		return;
+	transport_close(gb->udev);
+	gb->udev = NULL;
+}
+
+/**
+ * gembird_serial() - get serial number, read it from the device if needed
+ *
+ * @gb:		device
+ * Return:	serial number, empty string if it cannot be read
+ */
+const char *gembird_serial(struct gembird *gb)
+{
+	char serial[SERIALSIZE] = "";
+
+	if (gb->serial[0])
+		return gb->serial;
+	gembird_lock(gb);
+	if (gb->serial[0] || !serial_lookup(gb->dev, serial)) {
+		/* known now */
+	} else if (gb->udev) {
+		if (!sispm_get_serial(gb->udev, serial))
+			serial_store(gb->dev, serial);
+		else
+			gembird_invalidate(gb);
+	} else if (__atomic_load_n(&gb->present, __ATOMIC_ACQUIRE)) {
+		/* do not keep the device claimed for a command line call */
+		serial_get(gb->dev, serial);
+	}
+	if (!gb->serial[0] && serial[0]) {
+		pthread_mutex_lock(&registry_mutex);
+		memcpy(gb->serial, serial, SERIALSIZE);
+		if (!gembird_index_put(&serial_index, serial, gb))
+			--registry_unknown;
+		pthread_mutex_unlock(&registry_mutex);
+	}
+	gembird_unlock(gb);
+	return gb->serial;
+}
+
+/**
+ * gembird_range() - get the outlets as numbered by check_outlet_number()
+ *
+ * @gb:		device
+ * @first:	first outlet
+ * @last:	last outlet
+ */
+static void gembird_range(struct gembird *gb, int *first, int *last)
+{
+	switch (gb->id) {
+	case PRODUCT_ID_MSISPM_OLD:
+		*first = *last = 0;
+		break;
+	case PRODUCT_ID_MSISPM_FLASH:
+		*first = *last = 1;
+		break;
+	default:
+		*first = 1;
+		*last = MAXOUTLET;
+	}
+}
+
+/**
+ * gembird_submit() - start reading the status of all outlets
+ *
+ * The caller must hold the device lock.
+ *
+ * @gb:		device
+ * @udev:	claimed handle
+ * @query:	queries, one per outlet
+ * Return:	1 if the snapshot is up to date, 0 if the queries were
+ *		submitted
+ */
+static int gembird_submit(struct gembird *gb, struct transport_handle *udev,
+			  struct usb_query query[MAXOUTLET + 1])
+{
+	int outlet, first, last;
+
+	if (gb->status_valid && now_ms() - gb->status_time < status_cache_ms) {
+		metrics_cache(METRICS_CACHE_STATUS, true);
+		return 1;
+	}
+	metrics_cache(METRICS_CACHE_STATUS, false);
+
+	gembird_range(gb, &first, &last);
+	/* bit 0: relay status, bit 1: power supply status */
+	for (outlet = first; outlet <= last; ++outlet)
+		usb_query_submit(&query[outlet], udev, 3 * outlet);
+	return 0;
+}
+
+/**
+ * gembird_observe() - publish the status of an outlet if it changed
+ *
+ * The caller must hold the device lock.
+ *
+ * @gb:		device
+ * @outlet:	outlet number as counted by gembird_outlets()
+ * @status:	bit 0: relay status, bit 1: power supply status
+ */
+static void gembird_observe(struct gembird *gb, int outlet, int status)
+{
+	if (gb->seen[outlet] == status)
+		return;
+	__atomic_store_n(&gb->seen[outlet], status, __ATOMIC_RELAXED);
+	events_outlet(gb, outlet, status);
+	poller_changed();
+}
+
+/**
+ * gembird_collect() - store the results of gembird_submit() in the snapshot
+ *
+ * The caller must hold the device lock.
+ *
+ * @gb:		device
+ * @query:	submitted queries
+ * Return:	0 on success, -1 on error
+ */
+static int gembird_collect(struct gembird *gb,
+			   struct usb_query query[MAXOUTLET + 1])
+{
+	int outlet, first, last, ret, err = 0;
+
+	gembird_range(gb, &first, &last);
+	for (outlet = first; outlet <= last; ++outlet) {
+		ret = usb_query_result(&query[outlet]);
+		if (ret < 0)
+			err = -1;
+		else
+			gb->status[outlet] = ret;
+	}
+	gb->status_valid = !err;
+	gb->status_time = now_ms();
+	if (!err)
+		for (outlet = 1; outlet <= gembird_outlets(gb); ++outlet)
+			gembird_observe(gb, outlet, gb->status[
+				check_outlet_number(gb->id, outlet)]);
+	return err;
+}
+
+/**
+ * gembird_refresh() - read the status of all outlets into the snapshot
+ *
+ * The caller must hold the device lock. Threads that queued up behind the
+ * thread refreshing the snapshot find it up to date and need no USB access.
+ *
+ * @gb:		device
+ * @udev:	claimed handle
+ * Return:	0 on success, -1 on error
+ */
+static int gembird_refresh(struct gembird *gb, struct transport_handle *udev)
+{
+	struct usb_query query[MAXOUTLET + 1];
+
+	if (gembird_submit(gb, udev, query))
+		return 0;
+	return gembird_collect(gb, query);
+}
+
+/**
+ * gembird_poll() - refresh the snapshots of all devices
+ *
+ * The status queries of all devices are in flight at the same time, so
+ * polling many devices takes about as long as polling one.
+ *
+ * Return:	number of devices that could not be read
+ */
+int gembird_poll(void)
+{
+	struct usb_query (*query)[MAXOUTLET + 1];
+	struct transport_handle *udev;
+	int count = __atomic_load_n(&gembird_count, __ATOMIC_ACQUIRE);
+	struct gembird *gb;
+	int *state;
+	int i, failed = 0;
+
+	query = calloc(count, sizeof(*query));
+	state = calloc(count, sizeof(int));
+	if (!query || !state) {
+		free(query);
+		free(state);
+		return count;
+	}
+	/* always lock in the same order */
+	for (i = 0; i < count; ++i) {
+		gb = gembird_get(i);
+		gembird_lock(gb);
+		/* unplugged devices are not polled */
+		if (!__atomic_load_n(&gb->present, __ATOMIC_ACQUIRE)) {
+			state[i] = 1;
+			continue;
+		}
+		udev = gembird_handle(gb);
+		state[i] = udev ? gembird_submit(gb, udev, query[i]) : -1;
+	}
+	for (i = 0; i < count; ++i) {
+		gb = gembird_get(i);
+		if (!state[i] && gembird_collect(gb, query[i]))
+			state[i] = -1;
+		if (state[i] < 0) {
+			gembird_invalidate(gb);
+			++failed;
+		}
+		gembird_unlock(gb);
+	}
+	free(query);
+	free(state);
+	return failed;
+}
+
+/**
+ * gembird_snapshot() - copy the snapshot taken by gembird_poll()
+ *
+ * @gb:		device
+ * @status:	status bytes indexed by outlet number
+ * Return:	0 on success, -1 if there is no valid snapshot
+ */
+int gembird_snapshot(struct gembird *gb, int status[MAXOUTLET + 1])
+{
+	int outlet, ret = -1;
+
+	gembird_lock(gb);
+	if (gb->status_valid) {
+		for (outlet = 1; outlet <= gembird_outlets(gb); ++outlet)
+			status[outlet] = gb->status[check_outlet_number(gb->id,
+								       outlet)];
+		ret = 0;
+	}
+	gembird_unlock(gb);
+	return ret;
+}
+
+/**
+ * gembird_switched() - publish the relay status set by a command
+ *
+ * The power supply status is only known after the next read.
+ *
+ * @gb:		device
+ * @outlet:	outlet number as counted by gembird_outlets()
+ * @on:		new relay status
+ */
+static void gembird_switched(struct gembird *gb, int outlet, int on)
+{
+	/* single outlet devices accept any outlet number */
+	if (gembird_outlets(gb) == 1)
+		outlet = 1;
+	if (outlet < 1 || outlet > gembird_outlets(gb) || gb->seen[outlet] < 0)
+		return;
+	gembird_observe(gb, outlet, (gb->seen[outlet] & ~1) | on);
+}
+
+/**
+ * gembird_command() - switch or query an outlet
+ *
+ * The device is locked for the duration of the command. After a USB error
+ * the handle is invalidated. Status queries are answered from a snapshot
+ * that is at most status_cache_ms old. Switching an outlet invalidates the
+ * snapshot.
+ *
+ * @gb:		device
+ * @cmd:	command
+ * @outlet:	outlet number
+ * Return:	result of the sispm_*() function, -1 on error
+ */
+int gembird_command(struct gembird *gb, enum gembird_cmd cmd, int outlet)
+{
+	struct transport_handle *udev;
+	int ret = -1;
+
+	gembird_lock(gb);
+	udev = gembird_handle(gb);
+	if (!udev)
+		goto out;
+	switch (cmd) {
+	case GEMBIRD_ON:
+		gb->status_valid = false;
+		ret = sispm_switch_on(udev, gb->id, outlet);
+		if (ret >= 0)
+			gembird_switched(gb, outlet, 1);
+		break;
+	case GEMBIRD_OFF:
+		gb->status_valid = false;
+		ret = sispm_switch_off(udev, gb->id, outlet);
+		if (ret >= 0)
+			gembird_switched(gb, outlet, 0);
+		break;
+	case GEMBIRD_TOGGLE:
+		gb->status_valid = false;
+		ret = sispm_switch_toggle(udev, gb->id, outlet);
+		if (ret >= 0)
+			gembird_switched(gb, outlet, ret);
+		break;
+	case GEMBIRD_STATUS:
+		outlet = check_outlet_number(gb->id, outlet);
+		ret = gembird_refresh(gb, udev);
+		if (!ret)
+			ret = gb->status[outlet] & 1;
+		break;
+	case GEMBIRD_POWER:
+		outlet = check_outlet_number(gb->id, outlet);
+		ret = gembird_refresh(gb, udev);
+		if (!ret)
+			ret = (gb->status[outlet] >> 1) & 1;
+		break;
+	case GEMBIRD_BUZZER_ON:
+		ret = sispm_buzzer_on(udev);
+		break;
+	case GEMBIRD_BUZZER_OFF:
+		ret = sispm_buzzer_off(udev);
+		break;
+	}
+	if (ret < 0)
+		gembird_invalidate(gb);
+out:
+	gembird_unlock(gb);
+	return ret;
+}
+
+/* order targets like gembird_poll() locks devices */
+static int gembird_target_order(const void *a, const void *b)
+{
+	const struct gembird_target *ta = *(struct gembird_target * const *)a;
+	const struct gembird_target *tb = *(struct gembird_target * const *)b;
+
+	return ta->gb->devnum - tb->gb->devnum;
+}
+
+/**
+ * gembird_apply() - execute a command on outlets of several devices
+ *
+ * All devices are locked for the duration of the command. The requests of
+ * all devices are in flight at the same time, the requests to one device
+ * are sent back-to-back on its claimed handle. Toggling reads the status
+ * of all devices first, then switches. Toggling and queries use the
+ * snapshot if it is recent enough, like gembird_command().
+ *
+ * @targets:	outlets, each device at most once, the results are stored in
+ *		the state arrays
+ * @count:	number of targets
+ * @cmd:	GEMBIRD_ON, GEMBIRD_OFF, GEMBIRD_TOGGLE, GEMBIRD_STATUS or
+ *		GEMBIRD_POWER
+ * Return:	number of devices that could not be accessed, -1 if out of
+ *		memory
+ */
+int gembird_apply(struct gembird_target *targets, int count,
+		  enum gembird_cmd cmd)
+{
+	struct usb_query (*query)[MAXOUTLET + 1];
+	struct gembird_target **order;
+	struct gembird_target *t;
+	struct gembird *gb;
+	int *state;
+	int i, outlet, on, ret, failed = 0;
+	bool ok;
+
+	query = calloc(count + 1, sizeof(*query));
+	state = calloc(count + 1, sizeof(int));
+	order = calloc(count + 1, sizeof(*order));
+	if (!query || !state || !order) {
+		free(query);
+		free(state);
+		free(order);
+		return -1;
+	}
+	for (i = 0; i < count; ++i) {
+		order[i] = &targets[i];
+		for (outlet = 0; outlet <= MAXOUTLET; ++outlet)
+			targets[i].state[outlet] = -1;
+	}
+	/* always lock in the same order */
+	qsort(order, count, sizeof(*order), gembird_target_order);
+
+	/* read the status needed for toggling and queries */
+	for (i = 0; i < count; ++i) {
+		gb = order[i]->gb;
+		gembird_lock(gb);
+		state[i] = gembird_handle(gb) ? 0 : -1;
+		/* toggling relies on the current state, not a cached one */
+		if (cmd == GEMBIRD_TOGGLE)
+			gb->status_valid = false;
+		if (!state[i] && cmd != GEMBIRD_ON && cmd != GEMBIRD_OFF)
+			state[i] = gembird_submit(gb, gb->udev, query[i]);
+	}
+	for (i = 0; i < count; ++i) {
+		if (!state[i] && cmd != GEMBIRD_ON && cmd != GEMBIRD_OFF &&
+		    gembird_collect(order[i]->gb, query[i]))
+			state[i] = -1;
+	}
+
+	/* switch the outlets of all devices */
+	for (i = 0; i < count && cmd != GEMBIRD_STATUS &&
+	     cmd != GEMBIRD_POWER; ++i) {
+		t = order[i];
+		gb = t->gb;
+		if (state[i] < 0)
+			continue;
+		gb->status_valid = false;
+		for (outlet = 1; outlet <= gembird_outlets(gb); ++outlet) {
+			if (!(t->outlets & (1U << outlet)))
+				continue;
+			ret = check_outlet_number(gb->id, outlet);
+			on = cmd == GEMBIRD_ON ||
+			     (cmd == GEMBIRD_TOGGLE && !(gb->status[ret] & 1));
+			t->state[outlet] = on;
+			usb_switch_submit(&query[i][outlet], gb->udev, 3 * ret,
+					  on);
+		}
+	}
+	for (i = 0; i < count; ++i) {
+		t = order[i];
+		gb = t->gb;
+		ok = state[i] >= 0;
+		for (outlet = 1; outlet <= gembird_outlets(gb); ++outlet) {
+			if (!ok || !(t->outlets & (1U << outlet))) {
+				t->state[outlet] = -1;
+				continue;
+			}
+			if (cmd == GEMBIRD_STATUS || cmd == GEMBIRD_POWER) {
+				t->state[outlet] = gb->status[
+					check_outlet_number(gb->id, outlet)];
+				continue;
+			}
+			if (usb_query_result(&query[i][outlet]) < 0) {
+				t->state[outlet] = -1;
+				state[i] = -1;
+				continue;
+			}
+			gembird_switched(gb, outlet, t->state[outlet]);
+		}
+		if (state[i] < 0) {
+			gembird_invalidate(gb);
+			++failed;
+		}
+		gembird_unlock(gb);
+	}
+	free(query);
+	free(state);
+	free(order);
+	return failed;
+}
+
+/**
+ * gembird_schedules() - read or write schedules of outlets of several devices
+ *
+ * All devices are locked for the duration of the transfers. The transfers
+ * to all devices are in flight at the same time, the transfers to one
+ * device are sent back-to-back on its claimed handle.
+ *
+ * @targets:	outlets, each device at most once, the state arrays are set
+ *		to 0 for the outlets transferred and to -1 otherwise
+ * @count:	number of targets
+ * @plans:	schedules indexed like @targets and by outlet, read into or
+ *		written from
+ * @write:	write the schedules instead of reading them
+ * Return:	number of devices that could not be accessed, -1 if out of
+ *		memory
+ */
+int gembird_schedules(struct gembird_target *targets, int count,
+		      struct plannif (*plans)[MAXOUTLET + 1], bool write)
+{
+	struct usb_query (*query)[MAXOUTLET + 1];
+	struct gembird_target **order;
+	struct gembird_target *t;
+	struct gembird *gb;
+	int *state;
+	int i, outlet, socket, failed = 0;
+
+	query = calloc(count + 1, sizeof(*query));
+	state = calloc(count + 1, sizeof(int));
+	order = calloc(count + 1, sizeof(*order));
+	if (!query || !state || !order) {
+		free(query);
+		free(state);
+		free(order);
+		return -1;
+	}
+	for (i = 0; i < count; ++i) {
+		order[i] = &targets[i];
+		for (outlet = 0; outlet <= MAXOUTLET; ++outlet)
+			targets[i].state[outlet] = -1;
+	}
+	/* always lock in the same order */
+	qsort(order, count, sizeof(*order), gembird_target_order);
+
+	for (i = 0; i < count; ++i) {
+		t = order[i];
+		gb = t->gb;
+		gembird_lock(gb);
+		state[i] = gembird_handle(gb) ? 0 : -1;
+		for (outlet = 1; !state[i] && outlet <= gembird_outlets(gb);
+		     ++outlet) {
+			if (!(t->outlets & (1U << outlet)))
+				continue;
+			socket = check_outlet_number(gb->id, outlet);
+			/* the state marks the transfers to collect */
+			if (usb_schedule_submit(&query[i][outlet], gb->udev,
+						socket, write ?
+						&plans[t - targets][outlet] :
+						NULL) != -EINVAL)
+				t->state[outlet] = 0;
+		}
+	}
+	for (i = 0; i < count; ++i) {
+		t = order[i];
+		gb = t->gb;
+		for (outlet = 1; outlet <= gembird_outlets(gb); ++outlet) {
+			if (t->state[outlet] < 0)
+				continue;
+			if (usb_schedule_result(&query[i][outlet],
+						&plans[t - targets][outlet])) {
+				t->state[outlet] = -1;
+				state[i] = -1;
+			}
+		}
+		if (state[i] < 0) {
+			gembird_invalidate(gb);
+			++failed;
+		}
+		gembird_unlock(gb);
+	}
+	free(query);
+	free(state);
+	free(order);
+	return failed;
+}
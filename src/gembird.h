@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Persistent handles for Gembird devices
+ */
+
+#ifndef GEMBIRD_H
+#define GEMBIRD_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include "sispm_ctl.h"
+
+/* Default lifetime of the outlet status snapshot in milliseconds */
+#define STATUSCACHE 1000
+/* File with user defined device names */
+#define GEMBIRD_ALIASES "/etc/sispmctl/devices"
+/* Highest outlet number of any device */
+#define MAXOUTLET 4
+
+/* Commands for gembird_command() */
+enum gembird_cmd {
+	GEMBIRD_ON,
+	GEMBIRD_OFF,
+	GEMBIRD_TOGGLE,
+	GEMBIRD_STATUS,
+	GEMBIRD_POWER,
+	GEMBIRD_BUZZER_ON,
+	GEMBIRD_BUZZER_OFF,
+};
+
+/**
+ * struct gembird - device used by a long running process
+ *
+ * Threads access the device in the order in which they called
+ * gembird_lock().
+ *
+ * @dev:	device as found on the bus, replaced when the device is plugged
+ *		in again
+ * @udev:	claimed handle, NULL if not open
+ * @present:	the device is plugged in
+ * @devnum:	index of the device in the registry
+ * @id:		product id
+ * @serial:	serial number, empty if not yet read
+ * @mutex:	protects the ticket counters
+ * @cond:	signaled when the device is released
+ * @ticket:	next ticket to hand out
+ * @serving:	ticket currently owning the device
+ * @status:	snapshot of the status bytes of all outlets
+ * @status_valid: the snapshot may be used
+ * @status_time: time of the snapshot in milliseconds
+ * @seen:	last published status byte indexed by outlet number as
+ *		counted by gembird_outlets(), -1 if not yet observed
+ */
+struct gembird {
+	struct transport_dev *dev;
+	struct transport_handle *udev;
+	bool present;
+	int devnum;
+	int id;
+	char serial[SERIALSIZE];
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned long ticket;
+	unsigned long serving;
+	int status[MAXOUTLET + 1];
+	bool status_valid;
+	long long status_time;
+	int seen[MAXOUTLET + 1];
+};
+
+/**
+ * struct gembird_target - outlets of a device addressed by gembird_apply()
+ *
+ * @gb:		device
+ * @name:	name by which the device was addressed
+ * @outlets:	bit n set for outlet n as counted by gembird_outlets()
+ * @state:	result per outlet, the new relay status for switching or the
+ *		status byte for queries, -1 on error
+ */
+struct gembird_target {
+	struct gembird *gb;
+	const char *name;
+	unsigned int outlets;
+	int state[MAXOUTLET + 1];
+};
+
+extern int status_cache_ms;
+extern int gembird_count;
+
+void gembird_init(struct gembird *gb, struct transport_dev *dev, int devnum,
+		  const char *serial);
+int gembird_setup(struct transport_dev *dev[], int count);
+struct gembird *gembird_get(int index);
+struct gembird *gembird_find_location(const char *name, size_t len);
+struct gembird *gembird_find_serial(const char *name, size_t len);
+struct gembird *gembird_attach(struct transport_dev *dev);
+struct gembird *gembird_detach(const struct transport_dev *dev);
+struct gembird *gembird_find(const char *name, size_t len);
+int gembird_outlets(struct gembird *gb);
+const char *gembird_serial(struct gembird *gb);
+void gembird_lock(struct gembird *gb);
+void gembird_unlock(struct gembird *gb);
+struct transport_handle *gembird_handle(struct gembird *gb);
+void gembird_invalidate(struct gembird *gb);
+void gembird_close(struct gembird *gb);
+int gembird_command(struct gembird *gb, enum gembird_cmd cmd, int outlet);
+int gembird_poll(void);
+int gembird_snapshot(struct gembird *gb, int status[MAXOUTLET + 1]);
+int gembird_apply(struct gembird_target *targets, int count,
+		  enum gembird_cmd cmd);
+int gembird_schedules(struct gembird_target *targets, int count,
+		      struct plannif (*plans)[MAXOUTLET + 1], bool write);
+
+#endif /* GEMBIRD_H */
@@ -0,0 +1,318 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Named groups of outlets
+ *
+ * Each line of the group file defines a group by its name and its members:
+ *
+ *	<name> <device>/<outlets> [<device>/<outlets> ...]
+ *
+ * A device is given by its serial number, its alias or as Bus:Device.
+ * Outlets are given as a comma separated list, e.g. 1,3, or as all. Lines
+ * starting with # are comments. A group may span several devices.
+ *
+ * Devices are looked up when a group is used, so groups may name devices
+ * that are plugged in later.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "sispm_ctl.h"
+#include "gembird.h"
+#include "group.h"
+
+/* Maximum length of a line of the group file */
+#define GROUP_LINESIZE 4096
+/* Separators of the tokens of a line */
+#define GROUP_BLANKS " \t\r\n"
+/* Outlets of a member given as all */
+#define GROUP_ALL (((1U << MAXOUTLET) - 1) << 1)
+
+/**
+ * struct group_member - outlets of one device
+ *
+ * @spec:	member as written in the group file
+ * @device:	device name
+ * @outlets:	bit n set for outlet n
+ */
+struct group_member {
+	char *spec;
+	char *device;
+	unsigned int outlets;
+};
+
+/**
+ * struct group - named group of outlets
+ *
+ * @name:	name, NULL for a group created by group_target()
+ * @members:	members
+ * @count:	number of members
+ * @next:	next group
+ */
+struct group {
+	char *name;
+	struct group_member *members;
+	int count;
+	struct group *next;
+};
+
+static struct group *groups;
+
+/**
+ * group_outlets() - parse an outlet list
+ *
+ * @arg:	comma separated list of outlet numbers or all
+ * Return:	bit n set for outlet n, 0 for an invalid list
+ */
+static unsigned int group_outlets(const char *arg)
+{
+	unsigned int outlets = 0;
+	long outlet;
+	char *end;
+
+	if (!strcasecmp(arg, "all"))
+		return GROUP_ALL;
+	for (;;) {
+		outlet = strtol(arg, &end, 10);
+		if (end == arg || outlet < 1 || outlet > MAXOUTLET)
+			return 0;
+		outlets |= 1U << outlet;
+		if (!*end)
+			return outlets;
+		if (*end != ',')
+			return 0;
+		arg = end + 1;
+	}
+}
+
+/**
+ * group_member() - parse a member of a group
+ *
+ * @member:	member to fill in
+ * @spec:	<device>/<outlets>
+ * Return:	0 on success, -1 for invalid syntax, -ENOMEM if out of memory
+ */
+static int group_member(struct group_member *member, const char *spec)
+{
+	const char *slash = strrchr(spec, '/');
+
+	if (!slash || slash == spec)
+		return -1;
+	member->outlets = group_outlets(slash + 1);
+	if (!member->outlets)
+		return -1;
+	member->spec = strdup(spec);
+	member->device = strndup(spec, slash - spec);
+	if (!member->spec || !member->device) {
+		free(member->spec);
+		free(member->device);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * group_parse() - parse a line of the group file
+ *
+ * @line:	line, modified by tokenizing
+ * @group:	set to the group, NULL for comments and empty lines
+ * Return:	0 on success, -1 for invalid syntax, -ENOMEM if out of memory
+ */
+static int group_parse(char *line, struct group **group)
+{
+	struct group_member *members;
+	char *name, *token, *save;
+	struct group *g;
+	int ret;
+
+	*group = NULL;
+	name = strtok_r(line, GROUP_BLANKS, &save);
+	if (!name || *name == '#')
+		return 0;
+	g = calloc(1, sizeof(struct group));
+	if (!g)
+		return -ENOMEM;
+	g->name = strdup(name);
+	ret = g->name ? 0 : -ENOMEM;
+	while (!ret && (token = strtok_r(NULL, GROUP_BLANKS, &save))) {
+		members = realloc(g->members,
+				  (g->count + 1) * sizeof(*members));
+		if (!members) {
+			ret = -ENOMEM;
+			break;
+		}
+		g->members = members;
+		ret = group_member(&g->members[g->count], token);
+		if (!ret)
+			++g->count;
+	}
+	if (!ret && !g->count)
+		ret = -1;
+	if (ret) {
+		while (g->count--) {
+			free(g->members[g->count].spec);
+			free(g->members[g->count].device);
+		}
+		free(g->members);
+		free(g->name);
+		free(g);
+		return ret;
+	}
+	*group = g;
+	return 0;
+}
+
+/**
+ * group_load() - read the group definitions
+ *
+ * A missing file defines no groups.
+ *
+ * @path:	group file
+ * Return:	0 on success, -1 on error
+ */
+int group_load(const char *path)
+{
+	char line[GROUP_LINESIZE];
+	struct group *group;
+	int lineno = 0, ret = 0;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file) {
+		if (errno == ENOENT)
+			return 0;
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), file)) {
+		++lineno;
+		ret = group_parse(line, &group);
+		if (ret == -ENOMEM) {
+			fprintf(stderr, "Out of memory\n");
+			break;
+		}
+		if (ret) {
+			fprintf(stderr, "%s:%d: expected name and "
+				"<device>/<outlets>\n", path, lineno);
+			break;
+		}
+		if (group) {
+			group->next = groups;
+			groups = group;
+		}
+	}
+	fclose(file);
+	return ret ? -1 : 0;
+}
+
+/**
+ * group_find() - find a group by name
+ *
+ * @name:	name, need not be terminated
+ * @len:	length of name
+ * Return:	group or NULL if not defined
+ */
+const struct group *group_find(const char *name, size_t len)
+{
+	const struct group *group;
+
+	for (group = groups; group; group = group->next)
+		if (strlen(group->name) == len &&
+		    !strncmp(group->name, name, len))
+			return group;
+	return NULL;
+}
+
+/**
+ * group_target() - get the outlets addressed by a group name or member
+ *
+ * @spec:	@<group> or <device>/<outlets>
+ * Return:	group, a new unnamed group for a member, NULL for an unknown
+ *		group or invalid syntax
+ */
+const struct group *group_target(const char *spec)
+{
+	struct group *group;
+
+	if (*spec == '@')
+		return group_find(spec + 1, strlen(spec + 1));
+	group = calloc(1, sizeof(struct group));
+	if (!group)
+		return NULL;
+	group->members = calloc(1, sizeof(struct group_member));
+	if (!group->members || group_member(group->members, spec)) {
+		free(group->members);
+		free(group);
+		return NULL;
+	}
+	group->count = 1;
+	return group;
+}
+
+/**
+ * group_put() - release a group returned by group_target()
+ *
+ * Named groups are kept.
+ *
+ * @group:	group, may be NULL
+ */
+void group_put(const struct group *group)
+{
+	struct group *g = (struct group *)group;
+
+	if (!g || g->name)
+		return;
+	free(g->members->spec);
+	free(g->members->device);
+	free(g->members);
+	free(g);
+}
+
+/**
+ * group_resolve() - look up the devices of a group
+ *
+ * Members on the same device are merged, so each device appears once.
+ *
+ * @group:	group
+ * @targets:	set to the array of targets allocated with malloc()
+ * @missing:	set to the member that cannot be resolved, NULL if out of
+ *		memory
+ * Return:	number of targets, -1 on error
+ */
+int group_resolve(const struct group *group, struct gembird_target **targets,
+		  const char **missing)
+{
+	const struct group_member *member;
+	struct gembird_target *t;
+	struct gembird *gb;
+	unsigned int valid;
+	int i, j, count = 0;
+
+	*missing = NULL;
+	t = calloc(group->count, sizeof(struct gembird_target));
+	if (!t)
+		return -1;
+	for (i = 0; i < group->count; ++i) {
+		member = &group->members[i];
+		gb = gembird_find(member->device, strlen(member->device));
+		valid = gb ? ((1U << gembird_outlets(gb)) - 1) << 1 : 0;
+		/* all means all outlets the device has */
+		if (!gb || (member->outlets & ~valid &&
+			    member->outlets != GROUP_ALL)) {
+			*missing = member->spec;
+			free(t);
+			return -1;
+		}
+		for (j = 0; j < count && t[j].gb != gb; ++j)
+			;
+		if (j == count) {
+			t[count].gb = gb;
+			t[count++].name = member->device;
+		}
+		t[j].outlets |= member->outlets & valid;
+	}
+	*targets = t;
+	return count;
+}
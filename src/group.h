@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Named groups of outlets
+ */
+
+#ifndef GROUP_H
+#define GROUP_H
+
+#include <stddef.h>
+
+/* File with the group definitions */
+#define GROUP_FILE "/etc/sispmctl/groups"
+
+struct group;
+struct gembird_target;
+
+int group_load(const char *path);
+const struct group *group_find(const char *name, size_t len);
+const struct group *group_target(const char *spec);
+void group_put(const struct group *group);
+int group_resolve(const struct group *group, struct gembird_target **targets,
+		  const char **missing);
+
+#endif /* GROUP_H */
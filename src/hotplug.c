@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Tracking of devices plugged in and unplugged at runtime
+ *
+ * The transport reports devices from the thread handling USB events, where
+ * no transfer may be awaited. The reports are queued and applied to the
+ * list of devices by a separate thread, which reads the serial number of
+ * arriving devices. A device plugged in again is recognized by its serial
+ * number and takes its previous place.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include "gembird.h"
+#include "hotplug.h"
+
+/**
+ * struct hotplug_event - device arrived or left
+ *
+ * @dev:	device, points to @copy for a device that left
+ * @copy:	copy of a device that left
+ * @arrived:	the device arrived
+ * @next:	next event
+ */
+struct hotplug_event {
+	struct transport_dev *dev;
+	struct transport_dev copy;
+	int arrived;
+	struct hotplug_event *next;
+};
+
+static struct hotplug_event *hotplug_head, **hotplug_tail = &hotplug_head;
+static pthread_mutex_t hotplug_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hotplug_cond = PTHREAD_COND_INITIALIZER;
+
+static void hotplug_callback(struct transport_dev *dev, int arrived)
+{
+	struct hotplug_event *event;
+
+	event = calloc(1, sizeof(struct hotplug_event));
+	if (!event) {
+		syslog(LOG_ERR, "Out of memory\n");
+		return;
+	}
+	if (arrived) {
+		event->dev = dev;
+	} else {
+		event->copy = *dev;
+		event->dev = &event->copy;
+	}
+	event->arrived = arrived;
+
+	pthread_mutex_lock(&hotplug_mutex);
+	*hotplug_tail = event;
+	hotplug_tail = &event->next;
+	pthread_cond_signal(&hotplug_cond);
+	pthread_mutex_unlock(&hotplug_mutex);
+}
+
+static void *hotplug_run(void *arg)
+{
+	struct hotplug_event *event;
+	struct gembird *gb;
+	int i, count;
+
+	/*
+	 * A device unplugged before its serial number was read could not be
+	 * recognized when it is plugged in again.
+	 */
+	count = __atomic_load_n(&gembird_count, __ATOMIC_ACQUIRE);
+	for (i = 0; i < count; ++i)
+		gembird_serial(gembird_get(i));
+
+	for (;;) {
+		pthread_mutex_lock(&hotplug_mutex);
+		while (!hotplug_head)
+			pthread_cond_wait(&hotplug_cond, &hotplug_mutex);
+		event = hotplug_head;
+		hotplug_head = event->next;
+		if (!hotplug_head)
+			hotplug_tail = &hotplug_head;
+		pthread_mutex_unlock(&hotplug_mutex);
+
+		if (event->arrived) {
+			gb = gembird_attach(event->dev);
+			if (gb)
+				syslog(LOG_INFO,
+				       "Gembird #%d USB device %s:%s plugged in\n",
+				       gb->devnum, gb->dev->bus,
+				       gb->dev->filename);
+			else
+				/* already known, e.g. from the initial scan */
+				transport_release(event->dev);
+		} else {
+			gb = gembird_detach(event->dev);
+			if (gb)
+				syslog(LOG_INFO,
+				       "Gembird #%d USB device %s:%s unplugged\n",
+				       gb->devnum, event->dev->bus,
+				       event->dev->filename);
+		}
+		free(event);
+	}
+	return NULL;
+}
+
+/**
+ * hotplug_start() - keep the list of devices up to date
+ *
+ * @match:	function selecting the devices of interest
+ * Return:	0 on success, negative error number otherwise, -ENOSYS if the
+ *		transport cannot detect devices arriving or leaving
+ */
+int hotplug_start(int (*match)(const struct transport_dev *dev))
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, hotplug_run, NULL))
+		return -EAGAIN;
+	pthread_detach(thread);
+	return transport_hotplug(match, hotplug_callback);
+}
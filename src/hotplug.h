@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Tracking of devices plugged in and unplugged at runtime
+ */
+
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include "transport.h"
+
+int hotplug_start(int (*match)(const struct transport_dev *dev));
+
+#endif /* HOTPLUG_H */
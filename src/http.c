@@ -0,0 +1,352 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * HTTP connections
+ *
+ * Requests are parsed incrementally as bytes arrive. A request is complete
+ * when its header and the body announced by Content-Length have been
+ * received. Further bytes belong to pipelined requests and are kept.
+ *
+ * HTTP/1.1 connections persist unless the client sends "Connection: close".
+ * HTTP/1.0 connections persist if the client sends "Connection: keep-alive".
+ * Responses are delimited by Content-Length or, for HTTP/1.1 clients, by
+ * chunked transfer encoding. Otherwise the connection is closed after the
+ * response.
+ *
+ * The memory of a connection is bounded by http_memory. Peak usage is
+ * about the number of workers times http_memory.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "config.h"
+#include "arena.h"
+#include "nethelp.h"
+#include "http.h"
+
+size_t http_memory = HTTP_MEMORY;
+
+/**
+ * http_now() - get monotonic time
+ *
+ * Return:	time in milliseconds
+ */
+long long http_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * http_open() - allocate connection
+ *
+ * @fd:		accepted socket
+ * Return:	connection or NULL if out of memory
+ */
+struct http_conn *http_open(int fd)
+{
+	struct http_conn *conn;
+
+	conn = calloc(1, sizeof(struct http_conn));
+	if (!conn)
+		return NULL;
+	arena_init(&conn->arena, http_memory);
+	conn->fd = fd;
+	return conn;
+}
+
+/**
+ * http_close() - close socket and free connection
+ *
+ * @conn:	connection, a file descriptor of -1 marks a socket that has
+ *		been taken over
+ */
+void http_close(struct http_conn *conn)
+{
+	if (conn->fd >= 0)
+		close(conn->fd);
+	arena_free(&conn->arena);
+	free(conn);
+}
+
+/**
+ * http_read() - receive more bytes without waiting
+ *
+ * @conn:	connection
+ * Return:	number of bytes received, 0 if the client closed the
+ *		connection, -1 on error with errno EAGAIN if no bytes are
+ *		available, ENOBUFS if the buffer is full, or ENOMEM if out of
+ *		memory
+ */
+int http_read(struct http_conn *conn)
+{
+	ssize_t n;
+
+	if (!conn->buf) {
+		conn->buf = arena_alloc(&conn->arena, HTTP_BUFSIZE + 1);
+		if (!conn->buf) {
+			errno = ENOMEM;
+			return -1;
+		}
+		conn->mark = conn->arena.used;
+	}
+	if (conn->len >= HTTP_BUFSIZE) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	do {
+		n = recv(conn->fd, conn->buf + conn->len,
+			 HTTP_BUFSIZE - conn->len, MSG_DONTWAIT);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return n;
+	conn->len += n;
+	conn->buf[conn->len] = '\0';
+	return n;
+}
+
+/**
+ * http_token() - check if a header value contains a token
+ *
+ * @value:	header value
+ * @end:	end of the value
+ * @token:	token in lower case
+ * Return:	true if found
+ */
+static bool http_token(const char *value, const char *end, const char *token)
+{
+	size_t len = strlen(token);
+
+	for (; end - value >= len; ++value)
+		if (!strncasecmp(value, token, len))
+			return true;
+	return false;
+}
+
+/**
+ * http_length() - parse the value of Content-Length
+ *
+ * Only digits and trailing blanks are accepted, a sign or a length that
+ * cannot fit into the request buffer would desynchronize the requests.
+ *
+ * @value:	header value
+ * @end:	end of the value
+ * @length:	receives the length
+ * Return:	0 on success, -1 if the value is invalid or too large
+ */
+static int http_length(const char *value, const char *end, size_t *length)
+{
+	const char *ptr;
+	size_t n = 0;
+
+	for (ptr = value; ptr < end && *ptr >= '0' && *ptr <= '9'; ++ptr) {
+		n = 10 * n + (*ptr - '0');
+		if (n > HTTP_BUFSIZE)
+			return -1;
+	}
+	if (ptr == value)
+		return -1;
+	for (; ptr < end; ++ptr)
+		if (*ptr != ' ' && *ptr != '\t' && *ptr != '\r')
+			return -1;
+	*length = n;
+	return 0;
+}
+
+/**
+ * http_header() - parse the header of a complete request
+ *
+ * @conn:	connection, @header_len is set
+ * Return:	HTTP_COMPLETE or HTTP_MALFORMED
+ */
+static enum http_result http_header(struct http_conn *conn)
+{
+	const char *ptr, *eol, *value, *end = conn->buf + conn->header_len;
+	bool close = false, keep_alive = false;
+
+	eol = memchr(conn->buf, '\n', end - conn->buf);
+	if (!eol || eol == conn->buf)
+		return HTTP_MALFORMED;
+	conn->http11 = eol - conn->buf >= 9 &&
+		       !strncmp(eol - (eol[-1] == '\r' ? 9 : 8),
+				"HTTP/1.1", 8);
+	conn->head = !strncmp(conn->buf, "HEAD ", 5);
+	conn->content_length = 0;
+
+	for (ptr = eol + 1; ptr < end; ptr = eol + 1) {
+		eol = memchr(ptr, '\n', end - ptr);
+		if (!eol)
+			break;
+		value = memchr(ptr, ':', eol - ptr);
+		if (!value)
+			continue;
+		for (++value; value < eol && (*value == ' ' || *value == '\t');
+		     ++value)
+			;
+		if (!strncasecmp(ptr, "Content-Length:", 15)) {
+			if (http_length(value, eol, &conn->content_length))
+				return HTTP_MALFORMED;
+		} else if (!strncasecmp(ptr, "Transfer-Encoding:", 18)) {
+			/* chunked request bodies are not supported */
+			return HTTP_MALFORMED;
+		} else if (!strncasecmp(ptr, "Connection:", 11)) {
+			close = http_token(value, eol, "close");
+			keep_alive = http_token(value, eol, "keep-alive");
+		}
+	}
+	conn->keep_alive = conn->http11 ? !close : keep_alive;
+	return HTTP_COMPLETE;
+}
+
+/**
+ * http_parse() - check if a complete request has been received
+ *
+ * A complete request is NUL terminated in @conn->buf until
+ * http_consume() is called.
+ *
+ * @conn:	connection
+ * Return:	HTTP_COMPLETE, HTTP_INCOMPLETE if more bytes are needed,
+ *		HTTP_MALFORMED or HTTP_TOO_LARGE
+ */
+enum http_result http_parse(struct http_conn *conn)
+{
+	size_t skip, total;
+	char *ptr, *end;
+	int ret;
+
+	if (!conn->buf)
+		return HTTP_INCOMPLETE;
+	if (!conn->header_len) {
+		/* empty lines between requests are ignored */
+		skip = strspn(conn->buf, "\r\n");
+		if (skip) {
+			conn->len -= skip;
+			memmove(conn->buf, conn->buf + skip, conn->len + 1);
+		}
+
+		/* continue searching where the last call stopped */
+		end = conn->buf + conn->len;
+		for (ptr = conn->buf + conn->scanned; ptr < end; ++ptr) {
+			if (*ptr != '\n')
+				continue;
+			if (ptr + 1 < end && ptr[1] == '\n') {
+				conn->header_len = ptr + 2 - conn->buf;
+				break;
+			}
+			if (ptr + 2 < end && ptr[1] == '\r' && ptr[2] == '\n') {
+				conn->header_len = ptr + 3 - conn->buf;
+				break;
+			}
+		}
+		if (!conn->header_len) {
+			/* the delimiter may be split across reads */
+			conn->scanned = conn->len > 2 ? conn->len - 2 : 0;
+			return conn->len >= HTTP_BUFSIZE ? HTTP_TOO_LARGE :
+							   HTTP_INCOMPLETE;
+		}
+		ret = http_header(conn);
+		if (ret != HTTP_COMPLETE)
+			return ret;
+	}
+
+	total = conn->header_len + conn->content_length;
+	if (total > HTTP_BUFSIZE)
+		return HTTP_TOO_LARGE;
+	if (conn->len < total)
+		return HTTP_INCOMPLETE;
+	conn->saved = conn->buf[total];
+	conn->buf[total] = '\0';
+	return HTTP_COMPLETE;
+}
+
+/**
+ * http_output() - allocate the output of the response
+ *
+ * @conn:	connection, @out is set
+ * Return:	output or NULL if out of memory
+ */
+struct output *http_output(struct http_conn *conn)
+{
+	conn->out = arena_alloc(&conn->arena, sizeof(struct output));
+	if (conn->out)
+		output_init(conn->out, conn->fd);
+	return conn->out;
+}
+
+/**
+ * http_consume() - drop the current request and release its buffers
+ *
+ * Bytes of pipelined requests are kept.
+ *
+ * @conn:	connection
+ */
+void http_consume(struct http_conn *conn)
+{
+	size_t total = conn->header_len + conn->content_length;
+
+	conn->buf[total] = conn->saved;
+	conn->len -= total;
+	memmove(conn->buf, conn->buf + total, conn->len + 1);
+	conn->scanned = 0;
+	conn->header_len = 0;
+	conn->content_length = 0;
+	conn->head = false;
+	conn->out = NULL;
+	arena_reset(&conn->arena, conn->mark);
+}
+
+/**
+ * http_release() - release the memory of an idle connection
+ *
+ * @conn:	connection without pending bytes
+ */
+void http_release(struct http_conn *conn)
+{
+	arena_free(&conn->arena);
+	conn->buf = NULL;
+	conn->out = NULL;
+}
+
+/**
+ * http_header_end() - add connection handling and end the header
+ *
+ * The header lines gathered before must not contain Connection,
+ * Content-Length or Transfer-Encoding. The body of a response to HEAD is
+ * dropped.
+ *
+ * @out:	output
+ * @conn:	connection
+ * @crlf:	use CR LF as line end instead of LF
+ * @length:	length of the body, HTTP_UNKNOWN_LENGTH, or HTTP_NO_BODY for
+ *		responses without body
+ */
+void http_header_end(struct output *out, struct http_conn *conn, bool crlf,
+		     long length)
+{
+	const char *nl = crlf ? "\r\n" : "\n";
+
+	if (length >= 0) {
+		output_printf(out, "Content-Length: %ld%s", length, nl);
+	} else if (length == HTTP_UNKNOWN_LENGTH) {
+		if (conn->http11 && conn->keep_alive)
+			output_printf(out, "Transfer-Encoding: chunked%s", nl);
+		else
+			conn->keep_alive = false;
+	}
+	if (conn->keep_alive)
+		output_printf(out, "Connection: keep-alive%s"
+			      "Keep-Alive: timeout=%d%s%s",
+			      nl, HTTP_KEEPALIVE, nl, nl);
+	else
+		output_printf(out, "Connection: close%s%s", nl, nl);
+	if (length == HTTP_UNKNOWN_LENGTH && conn->keep_alive)
+		output_chunked(out);
+	if (conn->head)
+		output_discard(out);
+}
@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * HTTP connections
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include "arena.h"
+#include "sispm_ctl.h"
+
+/* Maximum size of a request including its body */
+#define HTTP_BUFSIZE BUFFERSIZE
+/* Seconds an idle persistent connection is kept open */
+#define HTTP_KEEPALIVE 15
+/* Default memory per connection in bytes */
+#define HTTP_MEMORY 32768
+/* Minimum memory per connection, the request and the output must fit */
+#define HTTP_MEMORY_MIN 16384
+
+extern size_t http_memory;
+
+/* Results of http_parse() */
+enum http_result {
+	HTTP_TOO_LARGE = -2,
+	HTTP_MALFORMED = -1,
+	HTTP_INCOMPLETE = 0,
+	HTTP_COMPLETE = 1,
+};
+
+/* Values of the length passed to http_header_end() */
+#define HTTP_UNKNOWN_LENGTH -1
+#define HTTP_NO_BODY -2
+
+struct output;
+
+/**
+ * struct http_conn - client connection
+ *
+ * Bytes received beyond the current request are kept for the next one.
+ * All buffers of a connection are allocated from its arena. The buffers
+ * of a request are released after the response. An idle connection
+ * without pending bytes releases the arena.
+ *
+ * @fd:		socket
+ * @addr:	address of the client
+ * @len:	number of bytes in @buf
+ * @scanned:	number of bytes searched for the end of the header
+ * @header_len:	length of the header including the empty line, 0 while
+ *		the header is incomplete
+ * @content_length: length of the request body
+ * @saved:	byte replaced by the terminating NUL of a complete request
+ * @http11:	the client speaks HTTP/1.1
+ * @head:	the request uses HEAD, the response has no body
+ * @keep_alive:	the connection persists after the response
+ * @delayed:	the response is postponed until @deadline
+ * @status:	status code of the response for the metrics
+ * @start:	time in microseconds when the request was complete
+ * @deadline:	time in milliseconds when an idle connection or an
+ *		incomplete request is given up, or a postponed response is due
+ * @next:	next connection in a list
+ * @arena:	memory of the connection
+ * @mark:	arena usage before the current request
+ * @out:	output of the current response
+ * @buf:	received bytes, NUL terminated, NULL while idle
+ */
+struct http_conn {
+	int fd;
+	struct in_addr addr;
+	size_t len;
+	size_t scanned;
+	size_t header_len;
+	size_t content_length;
+	char saved;
+	bool http11;
+	bool head;
+	bool keep_alive;
+	bool delayed;
+	int status;
+	long long start;
+	long long deadline;
+	struct http_conn *next;
+	struct arena arena;
+	size_t mark;
+	struct output *out;
+	char *buf;
+};
+
+long long http_now(void);
+struct http_conn *http_open(int fd);
+void http_close(struct http_conn *conn);
+int http_read(struct http_conn *conn);
+enum http_result http_parse(struct http_conn *conn);
+struct output *http_output(struct http_conn *conn);
+void http_consume(struct http_conn *conn);
+void http_release(struct http_conn *conn);
+void http_header_end(struct output *out, struct http_conn *conn, bool crlf,
+		     long length);
+
+#endif /* HTTP_H */
@@ -31,62 +31,36 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#define __USE_XOPEN
 #include <signal.h>
 #include <syslog.h>
 #include <time.h>
-#include <usb.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "sispm_ctl.h"
+#include "gembird.h"
+#include "batch.h"
 #include "socket.h"
+#include "auth.h"
+#include "http.h"
+#include "control.h"
+#include "group.h"
+#include "sequence.h"
+#include "fleet.h"
+#include "poller.h"
+#include "hotplug.h"
+#include "template.h"
 #include "config.h"
 
 #ifndef MSG_NOSIGNAL
 #include <signal.h>
 #endif
 
-#ifndef WEBLESS
-
-#define BUFSIZE 256
+/* Command line options */
+#define OPTIONS "i:o:f:t:a:A:b:g:m:lLqvh?nsd:D:u:p:U:w:Q:c:M:P:B:R:S:F:"
 
-static void read_password(void)
-{
-  FILE *file;
-  const char filename[] = "/etc/sispmctl/password";
-  char buf[BUFSIZE];
-  char *pos;
-  size_t len;
-
-  file = fopen(filename, "r");
-  if (!file) {
-    if (errno != ENOENT) {
-      perror(filename);
-      exit(EXIT_FAILURE);
-    }
-    /* It is ok if there is no password file */
-    return;
-  }
-  memset(buf, 0, BUFSIZE);
-  len = fread(buf, 1, BUFSIZE - 1, file);
-  if (!len) {
-    fprintf(stderr, "Failed to read password\n");
-    exit(EXIT_FAILURE);
-  }
-  pos = strchr(buf, '\n');
-  if (pos) {
-    *pos = '\0';
-  }
-  secret = strdup(buf);
-  if (secret) {
-    memset(buf, 0, 256);
-  } else {
-    fprintf(stderr, "Out of memory\n");
-    exit(EXIT_FAILURE);
-  }
-  fclose(file);
-}
+#ifndef WEBLESS
 
 static void daemonize()
 {
@@ -143,6 +117,9 @@ static void print_usage(char *name)
           "sispmctl [-q] [-n] [-d 0...] [-D ...] -[o|f|t|g|m] 1..4|all\n"
           "sispmctl [-q] [-n] [-d 0...] [-D ...] -[a|A] 1..4|all [--Aat '...'] "
           "[--Aafter ...] [--Ado <on|off>] ... [--Aloop ...]\n"
+          "sispmctl [-n] [-d 0...] [-D ...] -B <file|->\n"
+          "sispmctl [-q] -S <sequence>\n"
+          "sispmctl -F <file|->\n"
           "   'v'   - print version & copyright\n"
           "   'h'   - print this usage information\n"
           "   's'   - scan for supported GEMBIRD devices\n"
@@ -158,6 +135,13 @@ static void print_usage(char *name)
           "   'n'   - show result numerically\n"
           "   'q'   - quiet mode, no explanations - but errors\n"
           "   'a'   - get schedule for outlet\n"
+          "   'B'   - execute the commands of a batch file, '-' for stdin\n"
+          "   'S'   - run a power sequence of %s\n"
+          "   'F'   - program the schedules of a schedule file, '-' for "
+          "stdin,\n"
+          "           writing only those that differ\n"
+          "   'R'   - USB retry policy tries[:timeout[:deadline]] in ms "
+          "(%d:%d:%d)\n"
           "   'A'   - set schedule for outlet\n"
           "           '-A<num>'        - select outlet\n"
           "           '--Aat \"date\"'   - sets an event time as a date "
@@ -167,18 +151,28 @@ static void print_usage(char *name)
           "           '--Ado <on|off>' - sets the current event's action\n"
           "           '--Aloop N'      - loops to 1st event's action after "
           "N minutes\n\n"
+          ,SEQUENCE_FILE, USB_TRIES, USB_TIMEOUT, USB_DEADLINE);
 #ifndef WEBLESS
+  fprintf(stderr,
           "Web interface features:\n"
-          "sispmctl [-q] [-i <ip>] [-p <#port>] [-u <path>] -l|L\n"
+          "sispmctl [-q] [-i <ip>] [-p <#port>] [-u <path>] [-w <#workers>]\n"
+          "         [-Q <#backlog>] [-c <ms>] [-M <bytes>] [-P <ms>] -l|L\n"
           "   'l'   - start port listener\n"
           "   'L'   - same as 'l', but stay in foreground\n"
           "   'i'   - bind socket on interface with given IP (dotted decimal, "
           "e.g. 192.168.1.1)\n"
           "   'p'   - port number for listener (%d)\n"
-          "   'u'   - repository for web pages (default=%s)\n\n"
-          ,listenport, homedir
+          "   'u'   - repository for web pages (default=%s)\n"
+          "   'w'   - number of worker threads serving requests (%d)\n"
+          "   'Q'   - length of the queue of pending connections (%d)\n"
+          "   'c'   - milliseconds to reuse the outlet status (%d)\n"
+          "   'M'   - maximum memory per connection in bytes (%zu)\n"
+          "   'P'   - maximum milliseconds between background reads of "
+          "the\n"
+          "           outlet status, 0 = off (%d)\n\n"
+          ,listenport, homedir, listen_workers, listen_backlog,
+          status_cache_ms, http_memory, poll_max_ms);
 #endif
-         );
 
 #ifdef WEBLESS
   fprintf(stderr,"Note: This build was compiled without "
@@ -186,9 +180,641 @@ static void print_usage(char *name)
 #endif
 }
 
-static void parse_command_line(int argc, char *argv[], int count,
-                               struct usb_device *dev[], char *usbdevsn[])
+/*
+ * Build the schedule of option -A from the long options following it.
+ * Terminates on invalid options.
+ */
+static void parse_schedule(int argc, char *argv[], int outlet,
+                           struct plannif *plan)
+{
+  time_t date, lastEventTime;
+  int opt;
+  ulong loop = 0;
+  int actionNo=0;
+
+  time( &date );
+  lastEventTime = ((ulong)(date / 60)) * 60; // round to previous minute
+  plannif_reset (plan);
+  plan->socket = outlet;
+  plan->timeStamp = date;
+  plan->actions[0].switchOn = 0;
+
+  const struct option opts[] = {
+    {"Ado", 1, NULL, 'd'},
+    {"Aafter", 1, NULL, 'a'},
+    {"Aat", 1, NULL, '@'},
+    {"Aloop", 1, NULL, 'l'},
+    {NULL, 0, 0, 0}
+  };
+
+  // scan long options and store in plan+loop variables
+  while ((opt = getopt_long(argc, argv, "", opts, NULL)) != EOF) {
+    if (opt == 'l') {
+      loop = atol(optarg);
+      continue;
+    }
+    if (actionNo+1 >= sizeof(plan->actions)/sizeof(struct plannifAction)) {
+      // last event is reserved for loop or stop
+      fprintf(stderr,"Too many scheduled events\nTerminating\n");
+      exit(-7);
+    }
+    switch (opt) {
+    case 'd':
+      plan->actions[actionNo+1].switchOn = !strcmp(optarg, "on");
+      break;
+    case 'a':
+      plan->actions[actionNo].timeForNext = atol(optarg);
+      break;
+    case '@': {
+      time_t time4next = plannif_date(optarg, date);
+      if (time4next > lastEventTime)
+        plan->actions[actionNo].timeForNext =
+                  (time4next - lastEventTime) / 60;
+      else
+        plan->actions[actionNo].timeForNext = 0;
+      break;
+    }
+    default:
+      fprintf(stderr, "Unknown Option: %s\nTerminating\n",
+              argv[optind-1]);
+      exit(-7);
+      break;
+    }
+    if (plan->actions[actionNo].timeForNext == 0) {
+      fprintf(stderr, "Incorrect Date: %s\nTerminating\n", optarg);
+      exit(-7);
+    }
+
+    if (plan->actions[actionNo].timeForNext != -1
+        && plan->actions[actionNo + 1].switchOn != -1) {
+      lastEventTime += 60 * plan->actions[actionNo].timeForNext;
+      ++actionNo;
+    }
+  }
+
+  // compute the value to set in the last row, according to loop
+  if (plannif_loop(plan, loop)) {
+    printf ("error : the loop period is too short\n");
+    exit(1);
+  }
+}
+
+/*
+ * Options that a running daemon can execute. Invocations with other options
+ * access the devices directly.
+ */
+#define CLIENT_OPTIONS "ofgtmbdDUqnRSBaAsF"
+/* Options that access the devices, refused with others while a daemon runs */
+#define DEVICE_OPTIONS "ofgtmbdDUSBaAsF"
+
+/*
+ * Check that an outlet argument is valid, reporting it like
+ * parse_command_line() does.
+ */
+static void client_outlets(const char *arg, int groups)
+{
+  int outlet;
+
+  if (!strncmp(arg, "all", strlen("all")) || (groups && arg[0] == '@'))
+    return;
+  outlet = atoi(arg);
+  if (outlet < 1 || outlet > 4) {
+    fprintf(stderr,"Invalid outlet number given: %s\n"
+            "Expected: 1, 2, 3, 4, or all.\nTerminating.\n",arg);
+    print_disclaimer();
+    exit(-6);
+  }
+}
+
+/*
+ * Find the first option the daemon cannot execute without letting getopt()
+ * permute the arguments: the arguments of the long options of -A are
+ * skipped as they do not start with a single dash. Returns the option or 0
+ * and sets *devices if any option accesses the devices.
+ */
+static int client_scan(int argc, char *argv[], int *devices)
+{
+  const char *opt;
+  int bad = 0;
+  int i, j;
+  int c;
+
+  *devices = 0;
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--"))
+      break;
+    if (argv[i][0] != '-' || !argv[i][1] || argv[i][1] == '-')
+      continue;
+    for (j = 1; argv[i][j]; ++j) {
+      c = argv[i][j];
+      opt = c == ':' ? NULL : strchr(OPTIONS, c);
+      if (!opt)
+        c = '?';
+      if (strchr(DEVICE_OPTIONS, c))
+        *devices = 1;
+      if (!bad && !strchr(CLIENT_OPTIONS, c))
+        bad = c;
+      if (opt && opt[1] == ':') {
+        /* the argument is the rest of the word or the next one */
+        if (!argv[i][j + 1])
+          ++i;
+        break;
+      }
+    }
+  }
+  return bad;
+}
+
+/* batch commands of the options o, f, g, t and m */
+static const char *batch_commands[] = {"on", "off", "status", "toggle", "power"};
+
+/*
+ * Print the <outlet>=<state> pairs of a batch result like the commands of
+ * parse_command_line() do. For sequences the pairs are <step>=<state>.
+ */
+static int print_states(int c, char *result, int numeric)
+{
+  char *onoff[] = {"off", "on", "0", "1"};
+  char *token, *state, *save;
+  int ret, status = 0;
+
+  for (token = strtok_r(result, " ", &save); token;
+       token = strtok_r(NULL, " ", &save)) {
+    state = strchr(token, '=');
+    if (!state)
+      continue;
+    *state++ = '\0';
+    /* the other outlets of a partially failed command are still reported */
+    if (!strcmp(state, "error")) {
+      fprintf(stderr, "Outlet %s could not be accessed\n", token);
+      status = -1;
+      continue;
+    }
+    ret = !strcmp(state, "on");
+    switch (c) {
+    case 'o':
+    case 'f':
+      if(verbose) printf("Switched outlet %s %s\n", token, onoff[ret + numeric]);
+      break;
+    case 't':
+      if(verbose) printf("Toggled outlet %s %s\n", token, onoff[ret]);
+      break;
+    case 'g':
+      if(verbose) printf("Status of outlet %s:\t", token);
+      printf("%s\n", onoff[ret + numeric]);
+      break;
+    case 'm':
+      if(verbose) printf("Power supply status is:\t");
+      printf("%s\n", onoff[ret + numeric]);
+      break;
+    case 'S':
+      if(verbose) printf("Step %s %s\n", token, state);
+      break;
+    }
+  }
+  return status;
+}
+
+/* Report the states of a result as 0 and 1 like the batch option -n does */
+static void numeric_states(char *result)
+{
+  char buf[CONTROL_LINESIZE];
+  char *token, *state, *save;
+  size_t len = 0;
+
+  for (token = strtok_r(result, " ", &save); token;
+       token = strtok_r(NULL, " ", &save)) {
+    state = strchr(token, '=');
+    if (state && !strcmp(state, "=on"))
+      strcpy(state, "=1");
+    else if (state && !strcmp(state, "=off"))
+      strcpy(state, "=0");
+    len += snprintf(buf + len, sizeof(buf) - len, "%s%s", len ? " " : "",
+                    token);
+  }
+  buf[len] = '\0';
+  strcpy(result, buf);
+}
+
+/*
+ * Pass a fleet block to the daemon and wait for its result. The block is
+ * read from in up to a line consisting of end, for a fleet file up to its
+ * end. The lines of a fleet file are indented by a blank, so none of them
+ * ends the block early. Returns like control_request() and 2 if the line
+ * ending the block is missing.
+ */
+static int control_fleet(int fd, const char *header, FILE *in, int file,
+                         unsigned long *lineno, char *result, size_t size)
+{
+  char line[CONTROL_LINESIZE];
+  char *buf = NULL, *ptr, *next;
+  size_t len = 0;
+  int end = file;
+  FILE *block;
+  int ret;
+
+  /* nothing is sent before the block is complete */
+  block = open_memstream(&buf, &len);
+  if (!block) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), in)) {
+    ++*lineno;
+    if (!file && !strncasecmp(line, "end", 3) &&
+        !line[3 + strspn(line + 3, " \t\r\n")]) {
+      end = 1;
+      break;
+    }
+    fprintf(block, "%s%s", file ? " " : "", line);
+  }
+  if (fclose(block)) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  if (!end) {
+    free(buf);
+    return 2;
+  }
+  ret = control_send(fd, header);
+  for (ptr = buf; !ret && *ptr; ptr = next) {
+    next = ptr + strcspn(ptr, "\n");
+    if (*next)
+      *next++ = '\0';
+    ptr[strcspn(ptr, "\r")] = '\0';
+    ret = control_send(fd, ptr);
+  }
+  free(buf);
+  if (!ret)
+    ret = control_send(fd, "end");
+  return ret ? -1 : control_receive(fd, result, size);
+}
+
+/*
+ * Pass the lines of a batch to the daemon. The results are written like
+ * those of batch_run(). Returns 0 if all lines succeeded, -1 otherwise.
+ */
+static int control_batch(int fd, const char *path, int numeric)
+{
+  char line[CONTROL_LINESIZE];
+  char result[CONTROL_LINESIZE];
+  unsigned long lineno = 0, first;
+  FILE *in = stdin;
+  int ret, status = 0;
+  char *ptr;
+
+  if (strcmp(path, "-")) {
+    in = fopen(path, "r");
+    if (!in) {
+      perror(path);
+      exit(EXIT_FAILURE);
+    }
+  }
+  while (fgets(line, sizeof(line), in)) {
+    first = ++lineno;
+    /* the daemon does not answer empty lines and comments */
+    ptr = line + strspn(line, " \t\r\n");
+    if (!*ptr || *ptr == '#')
+      continue;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!strncasecmp(ptr, "fleet", 5) && (!ptr[5] || strchr(" \t", ptr[5])))
+      ret = control_fleet(fd, line, in, 0, &lineno, result, sizeof(result));
+    else
+      ret = control_request(fd, line, result, sizeof(result));
+    if (ret < 0) {
+      fprintf(stderr, "Connection to daemon at %s lost\n", control_path());
+      exit(1);
+    }
+    if (ret == 2) {
+      printf("%lu error missing end of fleet\n", first);
+      status = -1;
+    } else if (ret) {
+      printf("%lu error %s\n", first, result);
+      status = -1;
+    } else {
+      if (strstr(result, "=error"))
+        status = -1;
+      if (numeric)
+        numeric_states(result);
+      if (*result)
+        printf("%lu ok %s\n", first, result);
+      else
+        printf("%lu ok\n", first);
+    }
+    fflush(stdout);
+  }
+  if (in != stdin)
+    fclose(in);
+  return status;
+}
+
+/*
+ * Print the devices of a scan result like option -s does. The result lists
+ * <index>=<bus>,<device>,<outlets>,<serial number>.
+ */
+static void print_scan(char *result, int numeric)
+{
+  char *token, *save, *field[4];
+  int i;
+
+  for (token = strtok_r(result, " ", &save); token;
+       token = strtok_r(NULL, " ", &save)) {
+    field[0] = strchr(token, '=');
+    if (!field[0])
+      continue;
+    *field[0]++ = '\0';
+    for (i = 1; i < 4; ++i) {
+      field[i] = field[i - 1] ? strchr(field[i - 1], ',') : NULL;
+      if (field[i])
+        *field[i]++ = '\0';
+    }
+    if (!field[3])
+      continue;
+    if (numeric == 0)
+      printf("Gembird #%s\nUSB information:  bus %s, device %s\n", token,
+             field[0], field[1]);
+    else
+      printf("%s %s %s\n", token, field[0], field[1]);
+    if (numeric == 0)
+      printf("device type:      %s\n", atoi(field[2]) == 1 ?
+             "1-socket mSiS-PM." : "4-socket SiS-PM");
+    else
+      printf("%d\n", atoi(field[2]) == 1 ? 1 : 4);
+    if (!*field[3]) {
+      fprintf(stderr, "No access to Gembird #%s USB device %s\n",
+              token, field[1]);
+      exit(1);
+    }
+    if (numeric == 0)
+      printf("serial number:    %s\n", field[3]);
+    else
+      printf("%s\n", field[3]);
+    printf("\n");
+  }
+}
+
+/*
+ * Display the <outlet>=<schedule> pairs of a schedule result like options
+ * -a and -A do.
+ */
+static void print_schedules(char *result, int display, const char *progname)
+{
+  char *token, *text, *save;
+  struct plannif plan;
+
+  for (token = strtok_r(result, " ", &save); token;
+       token = strtok_r(NULL, " ", &save)) {
+    text = strchr(token, '=');
+    if (text && !plannif_parse(text + 1, &plan))
+      plannif_display(&plan, display, progname);
+  }
+}
+
+/*
+ * Print the <device>/<outlet>=<state> pairs of a fleet result like option
+ * -F does. Returns -1 if an outlet failed, 0 otherwise.
+ */
+static int print_fleet(char *result)
+{
+  char *token, *state, *save;
+  int ret = 0;
+
+  for (token = strtok_r(result, " ", &save); token;
+       token = strtok_r(NULL, " ", &save)) {
+    state = strchr(token, '=');
+    if (!state)
+      continue;
+    *state++ = '\0';
+    if (!strcmp(state, "failed"))
+      ret = -1;
+    printf("%s %s\n", token, state);
+  }
+  return ret;
+}
+
+/*
+ * Pass the commands to a daemon listening on the control socket.
+ *
+ * Returns -1 if no daemon is running or if the options do not access the
+ * devices and cannot be passed. Otherwise the output matches that of
+ * parse_command_line() and the exit status is returned. Options that cannot
+ * be passed are refused if other options access the devices while a daemon
+ * runs.
+ */
+static int control_client(int argc, char *argv[])
+{
+  char line[CONTROL_LINESIZE];
+  char result[CONTROL_LINESIZE];
+  char *onoff[] = {"off", "on", "0", "1"};
+  char outlets[CONTROL_LINESIZE / 2];
+  char text[1024];
+  unsigned long lineno = 0;
+  struct plannif plan;
+  int numeric = 0;
+  int status = 0;
+  int c, bad, devices, fd, ret;
+  FILE *in;
+
+  bad = client_scan(argc, argv, &devices);
+  if (argc <= 1 || (bad && !devices))
+    return -1;
+  fd = control_connect();
+  if (fd < 0)
+    return -1;
+  if (bad) {
+    close(fd);
+    fprintf(stderr, "A daemon is running at %s and owns the devices, "
+            "option -%c is not available.\n", control_path(), bad);
+    exit(1);
+  }
+  if (debug)
+    fprintf(stderr, "Using daemon at %s\n", control_path());
+
+  /* the first device is selected by default */
+  if (control_request(fd, "d 0", result, sizeof(result))) {
+    fprintf(stderr, "No GEMBIRD SiS-PM found. Check USB connections, please!\n");
+    exit(1);
+  }
+
+  while ((c = getopt(argc, argv, OPTIONS)) != -1) {
+    switch (c) {
+    case 'q':
+      verbose = 1 - verbose;
+      continue;
+    case 'n':
+      numeric = 2 - numeric;
+      continue;
+    case 'R':
+      /* the daemon applies its own retry policy */
+      if (usb_retry_parse(optarg)) {
+        fprintf(stderr, "Invalid retry policy: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    case 'd':
+    case 'D':
+    case 'U':
+      snprintf(line, sizeof(line), "%c %s", c, optarg);
+      break;
+    case 'b':
+      if (strncmp(optarg, "on", strlen("on")) &&
+          strncmp(optarg, "off", strlen("off"))) {
+        fprintf(stderr,"Unknown option: -b %s\nTerminating\n", optarg);
+        exit(-7);
+      }
+      snprintf(line, sizeof(line), "buzzer %s",
+               strncmp(optarg, "on", strlen("on")) ? "off" : "on");
+      break;
+    case 'S':
+      snprintf(line, sizeof(line), "sequence %s", optarg);
+      break;
+    case 's':
+      snprintf(line, sizeof(line), "scan");
+      break;
+    case 'B':
+      if (control_batch(fd, optarg, numeric))
+        status = EXIT_FAILURE;
+      continue;
+    case 'F':
+      in = stdin;
+      if (strcmp(optarg, "-")) {
+        in = fopen(optarg, "r");
+        if (!in) {
+          perror(optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      snprintf(line, sizeof(line), "fleet %s",
+               strcmp(optarg, "-") ? optarg : "stdin");
+      ret = control_fleet(fd, line, in, 1, &lineno, result, sizeof(result));
+      if (in != stdin)
+        fclose(in);
+      if (ret < 0) {
+        fprintf(stderr, "Connection to daemon at %s lost\n", control_path());
+        exit(1);
+      }
+      if (ret) {
+        fprintf(stderr, "%s\n", result);
+        status = EXIT_FAILURE;
+      } else if (print_fleet(result)) {
+        status = EXIT_FAILURE;
+      }
+      continue;
+    default:
+      client_outlets(optarg, !strchr("aA", c));
+      if (optarg[0] == '@')
+        snprintf(outlets, sizeof(outlets), "%s", optarg);
+      else if (!strncmp(optarg, "all", strlen("all")))
+        snprintf(outlets, sizeof(outlets), "all");
+      else
+        snprintf(outlets, sizeof(outlets), "%d", atoi(optarg));
+      if (c == 'a') {
+        snprintf(line, sizeof(line), "schedule %s", outlets);
+      } else if (c == 'A') {
+        /* the daemon stores the socket number of each outlet */
+        parse_schedule(argc, argv, atoi(optarg), &plan);
+        if (plannif_format(&plan, text, sizeof(text))) {
+          fprintf(stderr, "Too many scheduled events\nTerminating\n");
+          exit(-7);
+        }
+        snprintf(line, sizeof(line), "schedule %s=%s", outlets, text);
+      } else {
+        snprintf(line, sizeof(line), "%s %s", batch_commands[strchr("ofgtm", c) -
+                 "ofgtm"], outlets);
+      }
+    }
+
+    ret = control_request(fd, line, result, sizeof(result));
+    if (ret < 0) {
+      fprintf(stderr, "Connection to daemon at %s lost\n", control_path());
+      exit(1);
+    }
+    if (ret) {
+      switch (c) {
+      case 'd':
+        fprintf(stderr, "Invalid number or given device not found.\n"
+                "Terminating\n");
+        exit(-8);
+      case 'D':
+        fprintf(stderr, "No device with serial number %s found.\n"
+                "Terminating\n", optarg);
+        exit(-8);
+      case 'U':
+        fprintf(stderr, "No device at USB Bus:Device %s found.\n"
+                "Terminating\n", optarg);
+        exit(-8);
+      default:
+        fprintf(stderr, "%s\n", result);
+        exit(1);
+      }
+    }
+
+    if (c == 'b' && verbose)
+      printf("Turned buzzer %s\n",
+             onoff[!strncmp(optarg, "on", strlen("on")) + numeric]);
+
+    switch (c) {
+    case 's':
+      print_scan(result, numeric);
+      break;
+    case 'a':
+      print_schedules(result, verbose, argv[0]);
+      break;
+    case 'A':
+      if (verbose)
+        print_schedules(result, 0, NULL);
+      break;
+    default:
+      /* the result lists <outlet>=<state> pairs */
+      if (print_states(c, result, numeric))
+        status = EXIT_FAILURE;
+    }
+  }
+  close(fd);
+  return status;
+}
+
+static int is_gembird(const struct transport_dev *dev)
+{
+  return (dev->vendor == VENDOR_ID)
+         && ((dev->product == PRODUCT_ID_SISPM) ||
+             (dev->product == PRODUCT_ID_MSISPM_OLD) ||
+             (dev->product == PRODUCT_ID_MSISPM_FLASH) ||
+             (dev->product == PRODUCT_ID_SISPM_FLASH_NEW) ||
+             (dev->product == PRODUCT_ID_SISPM_EG_PMS2));
+}
+
+/*
+ * Execute an outlet option for all outlets of a device or for a group, or run
+ * a sequence. The outlets are switched at once through the batch interpreter.
+ */
+static int outlet_batch(int c, const char *arg, int devnum, int numeric)
 {
+  char line[CONTROL_LINESIZE];
+  char result[CONTROL_LINESIZE];
+  struct gembird *gb = gembird_get(devnum);
+  int j, ret;
+
+  if (c == 'S')
+    snprintf(line, sizeof(line), "sequence %s", arg);
+  else
+    snprintf(line, sizeof(line), "%s %s",
+             batch_commands[strchr("ofgtm", c) - "ofgtm"], arg);
+  usb_exit_on_error = 0;
+  ret = batch_line(line, &gb, 0, result, sizeof(result));
+  for (j = 0; j < gembird_count; ++j)
+    gembird_close(gembird_get(j));
+  usb_exit_on_error = 1;
+  if (ret < 0) {
+    fprintf(stderr, "%s\n", result);
+    return -1;
+  }
+  return print_states(c, result, numeric);
+}
+
+static int parse_command_line(int argc, char *argv[], int count)
+{
+  int exit_status = 0;
   int numeric = 0;
   int c;
   int i,j;
@@ -196,8 +822,10 @@ static void parse_command_line(int argc, char *argv[], int count,
   int from = 1, upto = 4;
   int status;
   int devnum = 0;
-  usb_dev_handle *udev = NULL;
-  usb_dev_handle *sudev = NULL; //scan device
+  struct transport_handle *udev = NULL;
+  struct transport_handle *sudev = NULL; //scan device
+  struct transport_dev *dev;
+  struct gembird *gb;
   unsigned int id=0; //product id of current device
   char *onoff[] = {"off", "on", "0", "1"};
 #ifndef WEBLESS
@@ -213,22 +841,50 @@ static void parse_command_line(int argc, char *argv[], int count,
     bindaddr=BINDADDR;
 #endif
 
-  while((c=getopt(argc, argv,"i:o:f:t:a:A:b:g:m:lLqvh?nsd:D:u:p:U:")) != -1) {
+  while((c=getopt(argc, argv, OPTIONS)) != -1) {
     if (count == 0) {
       switch(c) {
       case '?':
       case 'h':
       case 'v':
+      case 'q':
+      case 'n':
+      case 'R':
+#ifndef WEBLESS
+      /* the listener picks up devices plugged in later */
+      case 'l':
+      case 'L':
+      case 'p':
+      case 'u':
+      case 'w':
+      case 'Q':
+      case 'c':
+      case 'M':
+      case 'P':
+      case 'i':
+#endif
         break;
       default:
         fprintf(stderr, "No GEMBIRD SiS-PM found. Check USB connections, please!\n");
         if (udev != NULL) {
-          usb_close(udev);
+          transport_close(udev);
           udev = NULL;
         }
         exit(1);
       }
     }
+    /* whole devices and groups are switched at once */
+    if (c == 'S' ||
+        (strchr("ofgtm", c) && (optarg[0] == '@' ||
+                                !strncmp(optarg, "all", strlen("all"))))) {
+      if (udev != NULL) {
+        transport_close(udev);
+        udev = NULL;
+      }
+      if (outlet_batch(c, optarg, devnum, numeric))
+        exit(1);
+      continue;
+    }
     if(strchr("ofgtaAm", c)) {
       if(!strncmp(optarg,"all", strlen("all"))) {
         //use all outlets
@@ -249,21 +905,22 @@ static void parse_command_line(int argc, char *argv[], int count,
     if(strchr("ofgbtaAm", c)) { //we need a device handle for these commands
       /* get device-handle/-id if it wasn't done already */
       if(udev == NULL) {
-        udev = get_handle(dev[devnum]);
+        dev = gembird_get(devnum)->dev;
+        udev = get_handle(dev);
         if(udev == NULL) {
           fprintf(stderr, "No access to Gembird #%d USB device %s\n",
-                  devnum, dev[devnum]->filename );
+                  devnum, dev->filename );
           exit(1);
         } else if(verbose) {
           printf("Accessing Gembird #%d USB device %s\n", devnum,
-                 dev[devnum]->filename);
+                 dev->filename);
         }
-        id = get_id(dev[devnum]);
+        id = get_id(dev);
       }
     }
 
 #ifdef WEBLESS
-    if (strchr("lLipu", c)) {
+    if (strchr("lLipuwQcMP", c)) {
       fprintf(stderr,"Application was compiled without web-interface. "
               "Feature not available.\n");
       exit(-100);
@@ -277,7 +934,9 @@ static void parse_command_line(int argc, char *argv[], int count,
     case 'v':
       break;
     default:
-      id = get_id(dev[devnum]);
+      if (count == 0)
+        break;
+      id = get_id(gembird_get(devnum)->dev);
       if (((id == PRODUCT_ID_MSISPM_OLD) || (id == PRODUCT_ID_MSISPM_FLASH))
           && (from != upto))
         from = upto = 1;
@@ -286,13 +945,14 @@ static void parse_command_line(int argc, char *argv[], int count,
       switch(c) {
       case 's':
         for (status = 0; status < count; ++status) {
+          dev = gembird_get(status)->dev;
           if (numeric == 0)
             printf("Gembird #%d\nUSB information:  bus %s, device %s\n", status,
-                   dev[status]->bus->dirname, dev[status]->filename);
+                   dev->bus, dev->filename);
           else
             printf("%d %s %s\n", status,
-                   dev[status]->bus->dirname, dev[status]->filename);
-          id = get_id(dev[status]);
+                   dev->bus, dev->filename);
+          id = get_id(dev);
           if ((id == PRODUCT_ID_SISPM) ||
               (id == PRODUCT_ID_SISPM_FLASH_NEW) ||
               (id == PRODUCT_ID_SISPM_EG_PMS2))
@@ -304,18 +964,18 @@ static void parse_command_line(int argc, char *argv[], int count,
             printf("device type:      1-socket mSiS-PM.\n");
           else
             printf("1\n");
-          sudev = get_handle(dev[status]);
-          id = get_id(dev[status]);
+          sudev = get_handle(dev);
+          id = get_id(dev);
           if(sudev == NULL) {
             fprintf(stderr, "No access to Gembird #%d USB device %s\n",
-                    status, dev[status]->filename );
+                    status, dev->filename );
             exit(1);
           }
           if (numeric == 0)
             printf("serial number:    %s\n",get_serial(sudev));
           else
             printf("%s\n", get_serial(sudev));
-          usb_close(sudev);
+          transport_close(sudev);
           sudev = NULL;
           printf("\n");
         }
@@ -324,7 +984,7 @@ static void parse_command_line(int argc, char *argv[], int count,
       // replace previous (first is default) device by selected one
       case 'd': // by id
         if (udev != NULL) {
-          usb_close(udev);
+          transport_close(udev);
           udev = NULL;
         }
         devnum = atoi(optarg);
@@ -332,60 +992,40 @@ static void parse_command_line(int argc, char *argv[], int count,
           fprintf(stderr, "Invalid number or given device not found.\n"
                   "Terminating\n");
           if (udev != NULL) {
-            usb_close(udev);
+            transport_close(udev);
             udev = NULL;
           }
           exit(-8);
         }
         break;
-      case 'D': // by serial number
-        for (j = 0; j < count; ++j) {
-          if (debug)
-            fprintf(stderr, "now comparing %s and %s\n", usbdevsn[j], optarg);
-          if (strcasecmp(usbdevsn[j], optarg) == 0) {
-            if (udev != NULL) {
-              usb_close(udev);
-              udev = NULL;
-            }
-            devnum = j;
-            break;
-          }
+      case 'D': // by serial number or alias
+        /* the serial number may have to be read from the device */
+        if (udev != NULL) {
+          transport_close(udev);
+          udev = NULL;
         }
-        if (devnum != j) {
+        gb = gembird_find_serial(optarg, strlen(optarg));
+        if (gb == NULL) {
           fprintf(stderr, "No device with serial number %s found.\n"
                   "Terminating\n",optarg);
-          if (udev != NULL) {
-            usb_close(udev);
-            udev = NULL;
-          }
           exit(-8);
         }
+        if (debug)
+          fprintf(stderr, "%s is Gembird #%d\n", optarg, gb->devnum);
+        devnum = gb->devnum;
         break;
       case 'U': // by USB Bus:Device
-        for (j=0; j < count; ++j) {
-          char tmp[8194];
-          sprintf(tmp, "%s:%s", dev[j]->bus->dirname, dev[j]->filename);
-
-          if (debug)
-            fprintf(stderr, "now comparing %s and %s\n", tmp, optarg);
-          if (strcasecmp(tmp, optarg) == 0) {
-            if (udev != NULL) {
-              usb_close(udev);
-              udev = NULL;
-            }
-            devnum = j;
-            break;
-          }
+        if (udev != NULL) {
+          transport_close(udev);
+          udev = NULL;
         }
-        if (devnum != j) {
+        gb = gembird_find_location(optarg, strlen(optarg));
+        if (gb == NULL) {
           fprintf(stderr, "No device at USB Bus:Device %s found.\n"
                   "Terminating\n",optarg);
-          if (udev != NULL) {
-            usb_close(udev);
-            udev = NULL;
-          }
           exit(-8);
         }
+        devnum = gb->devnum;
         break;
       case 'o':
         outlet = check_outlet_number(id, i);
@@ -403,96 +1043,11 @@ static void parse_command_line(int argc, char *argv[], int count,
         if(verbose) printf("Toggled outlet %d %s\n",i,onoff[result]);
         break;
       case 'A': {
-        time_t date, lastEventTime;
-        struct tm *timeStamp_tm;
         struct plannif plan;
-        int opt, lastAction = 0;
-        ulong loop = 0;
         int optindsave = optind;
-        int actionNo=0;
 
         outlet = check_outlet_number(id, i);
-
-        time( &date );
-        timeStamp_tm = localtime(&date);
-        lastEventTime = ((ulong)(date / 60)) * 60; // round to previous minute
-        plannif_reset (&plan);
-        plan.socket = outlet;
-        plan.timeStamp = date;
-        plan.actions[0].switchOn = 0;
-
-        const struct option opts[] = {
-          {"Ado", 1, NULL, 'd'},
-          {"Aafter", 1, NULL, 'a'},
-          {"Aat", 1, NULL, '@'},
-          {"Aloop", 1, NULL, 'l'},
-          {NULL, 0, 0, 0}
-        };
-
-        // scan long options and store in plan+loop variables
-        while ((opt = getopt_long(argc, argv, "", opts, NULL)) != EOF) {
-          if (opt == 'l') {
-            loop = atol(optarg);
-            continue;
-          }
-          if (actionNo+1 >= sizeof(plan.actions)/sizeof(struct plannifAction)) {
-            // last event is reserved for loop or stop
-            fprintf(stderr,"Too many scheduled events\nTerminating\n");
-            exit(-7);
-          }
-          switch (opt) {
-          case 'd':
-            plan.actions[actionNo+1].switchOn = !strcmp(optarg, "on");
-            break;
-          case 'a':
-            plan.actions[actionNo].timeForNext = atol(optarg);
-            break;
-          case '@': {
-            struct tm tm;
-            time_t time4next;
-            bzero (&tm, sizeof(tm));
-            tm.tm_isdst = timeStamp_tm->tm_isdst;
-            strptime(optarg, "%Y-%m-%d %H:%M", &tm);
-            time4next = mktime(&tm);
-            if (time4next > lastEventTime)
-              plan.actions[actionNo].timeForNext =
-                        (time4next - lastEventTime) / 60;
-            else
-              plan.actions[actionNo].timeForNext = 0;
-            break;
-          }
-          default:
-            fprintf(stderr, "Unknown Option: %s\nTerminating\n",
-                    argv[optind-1]);
-            exit(-7);
-            break;
-          }
-          if (plan.actions[actionNo].timeForNext == 0) {
-            fprintf(stderr, "Incorrect Date: %s\nTerminating\n", optarg);
-            exit(-7);
-          }
-
-          if (plan.actions[actionNo].timeForNext != -1
-              && plan.actions[actionNo + 1].switchOn != -1) {
-            lastEventTime += 60 * plan.actions[actionNo].timeForNext;
-            ++actionNo;
-          }
-        }
-
-        // compute the value to set in the last row, according to loop
-        while (plan.actions[lastAction].timeForNext != -1) {
-          if (loop && (lastAction > 0)) {
-            // we ignore the first time for the loop calculation
-            if (loop <= plan.actions[lastAction].timeForNext) {
-              printf ("error : the loop period is too short\n");
-              exit(1);
-            }
-            loop -= plan.actions[lastAction].timeForNext;
-          }
-          ++lastAction;
-        }
-        if (lastAction >= 1)
-          plan.actions[lastAction].timeForNext = loop;
+        parse_schedule(argc, argv, outlet, &plan);
 
         // let's go, and check
         usb_command_setplannif(udev, &plan);
@@ -540,6 +1095,43 @@ static void parse_command_line(int argc, char *argv[], int count,
         }
         if(verbose) printf("Web pages come from \"%s\".\n",homedir);
         break;
+      case 'w':
+        listen_workers = atoi(optarg);
+        if (listen_workers < 1) {
+          fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        if(verbose) printf("Server will use %d workers.\n",listen_workers);
+        break;
+      case 'Q':
+        listen_backlog = atoi(optarg);
+        if (listen_backlog < 1) {
+          fprintf(stderr, "Invalid queue length: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'c':
+        status_cache_ms = atoi(optarg);
+        if (status_cache_ms < 0) {
+          fprintf(stderr, "Invalid status cache lifetime: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'M':
+        if (atol(optarg) < HTTP_MEMORY_MIN) {
+          fprintf(stderr, "Memory per connection must be at least %d bytes\n",
+                  HTTP_MEMORY_MIN);
+          exit(EXIT_FAILURE);
+        }
+        http_memory = atol(optarg);
+        break;
+      case 'P':
+        poll_max_ms = atoi(optarg);
+        if (poll_max_ms < 0) {
+          fprintf(stderr, "Invalid polling interval: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
       case 'i':
         bindaddr = optarg;
         if (verbose) printf("Web server will bind on interface with IP %s\n",
@@ -549,26 +1141,102 @@ static void parse_command_line(int argc, char *argv[], int count,
       case 'L': {
         int *s;
 
+        /* the listener claims the devices itself */
+        if (udev != NULL) {
+          transport_close(udev);
+          udev = NULL;
+        }
+        usb_exit_on_error = 0;
+
         openlog("sispmctl", LOG_PID, LOG_INFO);
-        read_password();
+        if (auth_load(AUTH_FILE))
+          exit(EXIT_FAILURE);
         if (verbose)
           printf("Server goes to listen mode now.\n");
         if ((s = socket_init(bindaddr)) != NULL) {
           if (c == 'l')
             daemonize();
+          /* command line invocations are served without a control socket */
+          if (control_listen())
+            syslog(LOG_WARNING, "Control socket not available\n");
+          if (poller_start())
+            syslog(LOG_WARNING, "Background reading not available\n");
+          /* without notifications the devices found at start are used */
+          if (hotplug_start(is_gembird))
+            syslog(LOG_WARNING, "Hotplug notifications not available\n");
+          else if (count == 0)
+            syslog(LOG_INFO, "No GEMBIRD SiS-PM found, waiting for one\n");
+          /* without notifications skin files are checked per request */
+          template_watch(homedir);
           while(1)
-            l_listen(s,dev[devnum],devnum);
+            l_listen(s, count ? gembird_get(devnum) : NULL);
         } else
           exit(EXIT_FAILURE);
         break;
       }
 #endif
+      case 'B': {
+        FILE *in = stdin;
+
+        /* the batch uses its own handles */
+        if (udev != NULL) {
+          transport_close(udev);
+          udev = NULL;
+        }
+        usb_exit_on_error = 0;
+        if (strcmp(optarg, "-")) {
+          in = fopen(optarg, "r");
+          if (!in) {
+            perror(optarg);
+            exit(EXIT_FAILURE);
+          }
+        }
+        if (batch_run(in, stdout, gembird_get(devnum), numeric))
+          exit_status = EXIT_FAILURE;
+        if (in != stdin)
+          fclose(in);
+        for (j = 0; j < count; ++j)
+          gembird_close(gembird_get(j));
+        usb_exit_on_error = 1;
+        break;
+      }
+      case 'F': {
+        FILE *in = stdin;
+
+        /* the schedules are transferred on their own handles */
+        if (udev != NULL) {
+          transport_close(udev);
+          udev = NULL;
+        }
+        usb_exit_on_error = 0;
+        if (strcmp(optarg, "-")) {
+          in = fopen(optarg, "r");
+          if (!in) {
+            perror(optarg);
+            exit(EXIT_FAILURE);
+          }
+        }
+        if (fleet_run(in, stdout, stderr, strcmp(optarg, "-") ? optarg : "stdin"))
+          exit_status = EXIT_FAILURE;
+        if (in != stdin)
+          fclose(in);
+        for (j = 0; j < count; ++j)
+          gembird_close(gembird_get(j));
+        usb_exit_on_error = 1;
+        break;
+      }
       case 'q':
         verbose = 1 - verbose;
         break;
       case 'n':
         numeric = 2 - numeric;
         break;
+      case 'R':
+        if (usb_retry_parse(optarg)) {
+          fprintf(stderr, "Invalid retry policy: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
       case 'b':
         if (!strncmp(optarg, "on", strlen("on"))) {
           sispm_buzzer_on(udev);
@@ -596,94 +1264,44 @@ static void parse_command_line(int argc, char *argv[], int count,
   } // loop through options
 
   if (udev) {
-    usb_close(udev);
+    transport_close(udev);
     udev = NULL;
   }
-  return;
+  return exit_status;
 }
 
 
 int main(int argc, char *argv[])
 {
-  struct usb_bus *bus;
-  struct usb_device *dev, *usbdev[MAXGEMBIRD], *usbdevtemp;
-  char *usbdevsn[MAXGEMBIRD];
-  int count=0, found = 0, i=1;
+  struct transport_dev **usbdev;
+  int count, ret;
 
 #ifndef MSG_NOSIGNAL
   signal(SIGPIPE, SIG_IGN);
 #endif
 
-  memset(usbdev,0,sizeof(usbdev));
-
-  usb_init();
-  usb_find_busses();
-  usb_find_devices();
+  /* a running daemon owns the devices */
+  ret = control_client(argc, argv);
+  if (ret >= 0)
+    return ret;
 
-  // initialize by setting device pointers to zero
-  for (count = 0; count < MAXGEMBIRD; ++count)
-    usbdev[count] = NULL;
-  count = 0;
-
-  //first search for GEMBIRD (m)SiS-PM devices
-  for (bus = usb_busses; bus; bus = bus->next) {
-    for (dev = bus->devices; dev; dev = dev->next) {
-      if ((dev->descriptor.idVendor == VENDOR_ID)
-          && ((dev->descriptor.idProduct == PRODUCT_ID_SISPM) ||
-              (dev->descriptor.idProduct == PRODUCT_ID_MSISPM_OLD) ||
-              (dev->descriptor.idProduct == PRODUCT_ID_MSISPM_FLASH) ||
-              (dev->descriptor.idProduct == PRODUCT_ID_SISPM_FLASH_NEW) ||
-              (dev->descriptor.idProduct == PRODUCT_ID_SISPM_EG_PMS2))) {
-        usbdev[count] = dev;
-        ++count;
-      }
-      if (count == MAXGEMBIRD) {
-        fprintf(stderr,"%d devices found. Please recompile if you need to "
-                "support more devices!\n",count);
-        break;
-      }
-    }
+  if (transport_init()) {
+    fprintf(stderr, "Cannot initialize USB: %s\n", transport_strerror());
+    return 1;
   }
 
-  /* bubble sort them first, thnx Ingo Flaschenberger */
-  if (count > 1) {
-    do {
-      found = 0;
-      for (i = 1; i < count; ++i) {
-        if (usbdev[i]->devnum < usbdev[i - 1]->devnum) {
-          usbdevtemp = usbdev[i];
-          usbdev[i] = usbdev[i - 1];
-          usbdev[i - 1] = usbdevtemp;
-          found = 1;
-        }
-      }
-    } while (found != 0);
-  }
-
-  /* get serial number of each device */
-  for (i = 0; i < count; ++i) {
-    usb_dev_handle *sudev = NULL;
-
-    sudev = get_handle(usbdev[i]);
-    if (sudev == NULL) {
-      fprintf(stderr, "No access to Gembird #%d USB device %s\n",
-              i, usbdev[i]->filename );
-      usbdevsn[i] = malloc(5);
-      usbdevsn[i][0] = '#';
-      usbdevsn[i][1] = '0'+i;
-      usbdevsn[i][2] = '\0';
-    } else {
-      usbdevsn[i] = strdup(get_serial(sudev));
-      usb_close(sudev);
-      sudev = NULL;
-    }
-  }
+  //first search for GEMBIRD (m)SiS-PM devices
+  count = transport_scan(is_gembird, &usbdev);
+  /* number them by device number */
+  if (gembird_setup(usbdev, count) || group_load(GROUP_FILE) ||
+      sequence_load(SEQUENCE_FILE))
+    return 1;
+  free(usbdev);
 
   /* do the real work here */
-  if (argc <= 1)
+  if (argc <= 1) {
     print_usage(argv[0]);
-  else
-    parse_command_line(argc, argv, count, usbdev, usbdevsn);
-
-  return 0;
+    return 0;
+  }
+  return parse_command_line(argc, argv, count);
 }
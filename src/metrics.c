@@ -0,0 +1,411 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Metrics in the Prometheus text format
+ *
+ * All values are counters updated with relaxed atomic operations, so
+ * recording takes no lock. A scrape may see the counters of a histogram
+ * at slightly different moments, which Prometheus tolerates.
+ *
+ * The statistics of a device are created on its first transfer and kept
+ * for the lifetime of the process. They are identified by the USB location
+ * bus:device, so the series of a strip stay attached to the port it is
+ * plugged into. The serial number is only exported by the info metric
+ * sispmctl_device_info, it becomes known later than the first transfer and
+ * would split the series. The list of devices only grows, entries are
+ * pushed with compare-and-swap.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "config.h"
+#include "gembird.h"
+#include "http.h"
+#include "nethelp.h"
+#include "transport.h"
+#include "metrics.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Upper bounds of the USB histogram buckets in microseconds */
+static const long long usb_bounds[] = {
+	500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+	1000000,
+};
+
+/* Upper bounds of the HTTP histogram buckets in microseconds */
+static const long long http_bounds[] = {
+	250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+	500000, 1000000, 2500000, 5000000,
+};
+
+/* Maximum number of buckets including +Inf */
+#define METRICS_BUCKETS 16
+
+/* HTTP status codes counted separately, others are counted as 0 */
+static const int http_codes[] = {
+	200, 304, 400, 401, 404, 405, 413, 503, 0,
+};
+
+#ifndef WEBLESS
+static const char *const op_names[METRICS_OPS] = {
+	[METRICS_STATUS] = "status",
+	[METRICS_SWITCH] = "switch",
+	[METRICS_SERIAL] = "serial",
+	[METRICS_SCHEDULE_READ] = "schedule_read",
+	[METRICS_SCHEDULE_WRITE] = "schedule_write",
+};
+
+static const char *const cache_names[METRICS_CACHES] = {
+	[METRICS_CACHE_TEMPLATE] = "template",
+	[METRICS_CACHE_STATUS] = "status",
+	[METRICS_CACHE_AUTH] = "auth",
+};
+#endif
+
+/**
+ * struct metrics_hist - histogram
+ *
+ * @bucket:	number of samples per bucket, not cumulative
+ * @sum:	sum of the samples in microseconds
+ * @count:	number of samples
+ */
+struct metrics_hist {
+	unsigned long long bucket[METRICS_BUCKETS];
+	unsigned long long sum;
+	unsigned long long count;
+};
+
+/**
+ * struct metrics_dev - statistics of a device
+ *
+ * @name:	USB location bus:device
+ * @duration:	duration of the operations including retries
+ * @retries:	repeated transfers
+ * @timeouts:	transfers that timed out
+ * @failures:	operations that failed after all retries
+ * @next:	next device
+ */
+struct metrics_dev {
+	char name[24];
+	struct metrics_hist duration[METRICS_OPS];
+	unsigned long long retries[METRICS_OPS];
+	unsigned long long timeouts[METRICS_OPS];
+	unsigned long long failures[METRICS_OPS];
+	struct metrics_dev *next;
+};
+
+static struct metrics_dev *metrics_devs;
+static long long metrics_handles;
+static unsigned long long metrics_requests[ARRAY_SIZE(http_codes)];
+static struct metrics_hist metrics_http_duration;
+static unsigned long long metrics_hits[METRICS_CACHES];
+static unsigned long long metrics_misses[METRICS_CACHES];
+
+static void metrics_inc(unsigned long long *counter)
+{
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+#ifndef WEBLESS
+static unsigned long long metrics_get(const unsigned long long *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+#endif
+
+static void metrics_hist_add(struct metrics_hist *hist,
+			     const long long *bounds, size_t n, long long us)
+{
+	size_t i;
+
+	for (i = 0; i < n && us > bounds[i]; ++i)
+		;
+	metrics_inc(&hist->bucket[i]);
+	__atomic_fetch_add(&hist->sum, us > 0 ? us : 0, __ATOMIC_RELAXED);
+	metrics_inc(&hist->count);
+}
+
+/**
+ * metrics_now() - get monotonic time
+ *
+ * Return:	time in microseconds
+ */
+long long metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * metrics_device() - find or create the statistics of a device
+ *
+ * @dev:	device
+ * Return:	statistics, NULL if out of memory
+ */
+static struct metrics_dev *metrics_device(const struct transport_dev *dev)
+{
+	struct metrics_dev *md, *other, *head;
+	char name[sizeof(md->name)];
+
+	snprintf(name, sizeof(name), "%s:%s", dev->bus, dev->filename);
+	head = __atomic_load_n(&metrics_devs, __ATOMIC_ACQUIRE);
+	for (md = head; md; md = md->next)
+		if (!strcmp(md->name, name))
+			return md;
+
+	md = calloc(1, sizeof(struct metrics_dev));
+	if (!md)
+		return NULL;
+	strcpy(md->name, name);
+	md->next = head;
+	while (!__atomic_compare_exchange_n(&metrics_devs, &md->next, md, false,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_ACQUIRE)) {
+		/* another thread added devices, it may have been this one */
+		for (other = md->next; other != head; other = other->next) {
+			if (!strcmp(other->name, name)) {
+				free(md);
+				return other;
+			}
+		}
+		head = md->next;
+	}
+	return md;
+}
+
+/**
+ * metrics_usb() - record a USB operation
+ *
+ * @dev:	device
+ * @op:		operation
+ * @us:		duration including retries in microseconds
+ * @ok:		the operation succeeded
+ */
+void metrics_usb(const struct transport_dev *dev, enum metrics_op op,
+		 long long us, bool ok)
+{
+	struct metrics_dev *md = metrics_device(dev);
+
+	if (!md)
+		return;
+	metrics_hist_add(&md->duration[op], usb_bounds, ARRAY_SIZE(usb_bounds),
+			 us);
+	if (!ok)
+		metrics_inc(&md->failures[op]);
+}
+
+/**
+ * metrics_usb_retry() - record a failed attempt that is repeated
+ *
+ * @dev:	device
+ * @op:		operation
+ * @err:	negative error number of the attempt
+ */
+void metrics_usb_retry(const struct transport_dev *dev, enum metrics_op op,
+		       int err)
+{
+	struct metrics_dev *md = metrics_device(dev);
+
+	if (!md)
+		return;
+	metrics_inc(&md->retries[op]);
+	if (err == -ETIMEDOUT)
+		metrics_inc(&md->timeouts[op]);
+}
+
+/**
+ * metrics_handle() - count opened and closed device handles
+ *
+ * @delta:	1 for an opened, -1 for a closed handle
+ */
+void metrics_handle(int delta)
+{
+	__atomic_fetch_add(&metrics_handles, delta, __ATOMIC_RELAXED);
+}
+
+/**
+ * metrics_http() - record an HTTP response
+ *
+ * @status:	status code
+ * @us:		time from the complete request to the sent response in
+ *		microseconds
+ */
+void metrics_http(int status, long long us)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(http_codes) - 1; ++i)
+		if (http_codes[i] == status)
+			break;
+	metrics_inc(&metrics_requests[i]);
+	metrics_hist_add(&metrics_http_duration, http_bounds,
+			 ARRAY_SIZE(http_bounds), us);
+}
+
+/**
+ * metrics_cache() - record a cache lookup
+ *
+ * @cache:	cache
+ * @hit:	the entry was found
+ */
+void metrics_cache(enum metrics_cache cache, bool hit)
+{
+	metrics_inc(hit ? &metrics_hits[cache] : &metrics_misses[cache]);
+}
+
+#ifndef WEBLESS
+
+static void metrics_hist_print(struct output *out, const char *name,
+			       const char *labels,
+			       const struct metrics_hist *hist,
+			       const long long *bounds, size_t n)
+{
+	unsigned long long sum = 0;
+	size_t i;
+
+	for (i = 0; i <= n; ++i) {
+		sum += metrics_get(&hist->bucket[i]);
+		if (i < n)
+			output_printf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n",
+				      name, labels, *labels ? "," : "",
+				      bounds[i] / 1e6, sum);
+		else
+			output_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+				      name, labels, *labels ? "," : "", sum);
+	}
+	output_printf(out, "%s_sum%s%s%s %.6f\n", name, *labels ? "{" : "",
+		      labels, *labels ? "}" : "", metrics_get(&hist->sum) / 1e6);
+	output_printf(out, "%s_count%s%s%s %llu\n", name, *labels ? "{" : "",
+		      labels, *labels ? "}" : "", metrics_get(&hist->count));
+}
+
+/* serial number of a device if it is known without USB access, or "" */
+static const char *metrics_serial(const struct metrics_dev *md)
+{
+	struct gembird *gb;
+
+	gb = gembird_find_location(md->name, strlen(md->name));
+	return gb ? gb->serial : "";
+}
+
+/* print a counter array of struct metrics_dev found at @offset */
+static void metrics_counter_print(struct output *out, const char *name,
+				  const char *help, size_t offset)
+{
+	const unsigned long long *counter;
+	struct metrics_dev *md;
+	int op;
+
+	output_printf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help,
+		      name);
+	for (md = __atomic_load_n(&metrics_devs, __ATOMIC_ACQUIRE); md;
+	     md = md->next) {
+		counter = (const void *)((const char *)md + offset);
+		for (op = 0; op < METRICS_OPS; ++op)
+			output_printf(out, "%s{device=\"%s\",op=\"%s\"} %llu\n",
+				      name, md->name, op_names[op],
+				      metrics_get(&counter[op]));
+	}
+}
+
+/**
+ * metrics_send() - answer a request for the metrics
+ *
+ * @conn:	connection
+ */
+void metrics_send(struct http_conn *conn)
+{
+	struct output *out = conn->out;
+	struct metrics_dev *md;
+	const char *serial;
+	char labels[128];
+	size_t i;
+	int op;
+
+	conn->status = 200;
+	output_printf(out, "HTTP/1.1 200 OK\r\n"
+		      "Server: SisPM\r\n"
+		      "Content-Type: text/plain; version=0.0.4\r\n"
+		      "Cache-Control: no-store\r\n");
+	http_header_end(out, conn, true, HTTP_UNKNOWN_LENGTH);
+
+	output_printf(out, "# HELP sispmctl_device_info "
+		      "Serial number of the device at a USB location.\n"
+		      "# TYPE sispmctl_device_info gauge\n");
+	for (md = __atomic_load_n(&metrics_devs, __ATOMIC_ACQUIRE); md;
+	     md = md->next) {
+		serial = metrics_serial(md);
+		if (*serial)
+			output_printf(out, "sispmctl_device_info{device=\"%s\","
+				      "serial=\"%s\"} 1\n", md->name, serial);
+	}
+	output_printf(out, "# HELP sispmctl_usb_duration_seconds "
+		      "Duration of USB operations including retries.\n"
+		      "# TYPE sispmctl_usb_duration_seconds histogram\n");
+	for (md = __atomic_load_n(&metrics_devs, __ATOMIC_ACQUIRE); md;
+	     md = md->next) {
+		for (op = 0; op < METRICS_OPS; ++op) {
+			if (!metrics_get(&md->duration[op].count))
+				continue;
+			snprintf(labels, sizeof(labels),
+				 "device=\"%s\",op=\"%s\"", md->name,
+				 op_names[op]);
+			metrics_hist_print(out, "sispmctl_usb_duration_seconds",
+					   labels, &md->duration[op],
+					   usb_bounds, ARRAY_SIZE(usb_bounds));
+		}
+	}
+	metrics_counter_print(out, "sispmctl_usb_retries_total",
+			      "USB transfers that were repeated.",
+			      offsetof(struct metrics_dev, retries));
+	metrics_counter_print(out, "sispmctl_usb_timeouts_total",
+			      "USB transfers that timed out.",
+			      offsetof(struct metrics_dev, timeouts));
+	metrics_counter_print(out, "sispmctl_usb_failures_total",
+			      "USB operations that failed after all retries.",
+			      offsetof(struct metrics_dev, failures));
+
+	output_printf(out, "# HELP sispmctl_usb_handles_open "
+		      "Open USB device handles.\n"
+		      "# TYPE sispmctl_usb_handles_open gauge\n"
+		      "sispmctl_usb_handles_open %lld\n",
+		      __atomic_load_n(&metrics_handles, __ATOMIC_RELAXED));
+
+	output_printf(out, "# HELP sispmctl_http_requests_total "
+		      "HTTP responses by status code, 0 for other codes.\n"
+		      "# TYPE sispmctl_http_requests_total counter\n");
+	for (i = 0; i < ARRAY_SIZE(http_codes); ++i)
+		output_printf(out, "sispmctl_http_requests_total{code=\"%d\"} "
+			      "%llu\n", http_codes[i],
+			      metrics_get(&metrics_requests[i]));
+	output_printf(out, "# HELP sispmctl_http_request_duration_seconds "
+		      "Time from the complete request to the sent response.\n"
+		      "# TYPE sispmctl_http_request_duration_seconds "
+		      "histogram\n");
+	metrics_hist_print(out, "sispmctl_http_request_duration_seconds", "",
+			   &metrics_http_duration, http_bounds,
+			   ARRAY_SIZE(http_bounds));
+
+	output_printf(out, "# HELP sispmctl_cache_hits_total "
+		      "Lookups answered from a cache.\n"
+		      "# TYPE sispmctl_cache_hits_total counter\n");
+	for (i = 0; i < METRICS_CACHES; ++i)
+		output_printf(out, "sispmctl_cache_hits_total{cache=\"%s\"} "
+			      "%llu\n", cache_names[i],
+			      metrics_get(&metrics_hits[i]));
+	output_printf(out, "# HELP sispmctl_cache_misses_total "
+		      "Lookups not answered from a cache.\n"
+		      "# TYPE sispmctl_cache_misses_total counter\n");
+	for (i = 0; i < METRICS_CACHES; ++i)
+		output_printf(out, "sispmctl_cache_misses_total{cache=\"%s\"} "
+			      "%llu\n", cache_names[i],
+			      metrics_get(&metrics_misses[i]));
+	output_finish(out);
+}
+#endif
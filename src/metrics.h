@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Metrics in the Prometheus text format
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+
+/* Path of the metrics on the web server */
+#define METRICS_PATH "/metrics"
+
+/* USB operations */
+enum metrics_op {
+	METRICS_STATUS,
+	METRICS_SWITCH,
+	METRICS_SERIAL,
+	METRICS_SCHEDULE_READ,
+	METRICS_SCHEDULE_WRITE,
+	METRICS_OPS,
+};
+
+/* Caches */
+enum metrics_cache {
+	METRICS_CACHE_TEMPLATE,
+	METRICS_CACHE_STATUS,
+	METRICS_CACHE_AUTH,
+	METRICS_CACHES,
+};
+
+struct http_conn;
+struct transport_dev;
+
+long long metrics_now(void);
+void metrics_usb(const struct transport_dev *dev, enum metrics_op op,
+		 long long us, bool ok);
+void metrics_usb_retry(const struct transport_dev *dev, enum metrics_op op,
+		       int err);
+void metrics_handle(int delta);
+void metrics_http(int status, long long us);
+void metrics_cache(enum metrics_cache cache, bool hit);
+void metrics_send(struct http_conn *conn);
+
+#endif /* METRICS_H */
@@ -19,8 +19,14 @@
     Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 */
 
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include "nethelp.h"
 
 #ifndef MSG_NOSIGNAL
 #define	MSG_NOSIGNAL 0
@@ -44,3 +50,210 @@ int sock_write_bytes(int sockfd, const unsigned char *buff, int len)
   }
   return(t);
 }
+
+/*
+ * Write the buffers described by iov to the socket, continuing after
+ * partial writes. The array iov is modified.
+ * Returns the number of bytes written or -1 on error.
+ */
+ssize_t sock_writev(int sockfd, struct iovec *iov, int count)
+{
+  struct msghdr msg;
+  ssize_t t = 0, n;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  while (msg.msg_iovlen) {
+    /* sendmsg() is writev() with flags */
+    n = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    t += n;
+    while (msg.msg_iovlen && n >= msg.msg_iov->iov_len) {
+      n -= msg.msg_iov->iov_len;
+      ++msg.msg_iov;
+      --msg.msg_iovlen;
+    }
+    if (n) {
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+      msg.msg_iov->iov_len -= n;
+    }
+  }
+  return t;
+}
+
+/*
+ * Prepare gathering a response for the socket.
+ */
+void output_init(struct output *out, int sockfd)
+{
+  out->fd = sockfd;
+  out->count = 0;
+  out->used = 0;
+  out->error = 0;
+  out->chunked = 0;
+  out->chunk_start = 0;
+  out->discard = 0;
+}
+
+/* Check if the I/O vector is full, a chunk needs one entry for its end */
+static int output_full(const struct output *out)
+{
+  return out->count >= OUTPUT_IOVECS - (out->chunked ? 1 : 0);
+}
+
+/* Reserve the entry for the size line of the next chunk */
+static void output_chunk_start(struct output *out)
+{
+  out->chunk_start = out->count;
+  out->iov[out->count].iov_base = out->chunk;
+  out->iov[out->count].iov_len = 0;
+  ++out->count;
+}
+
+/*
+ * Send everything gathered so far with a single system call. In chunked
+ * mode the data gathered since the last flush forms a chunk.
+ * Returns 0 on success, -1 if the client cannot be reached.
+ */
+int output_flush(struct output *out)
+{
+  size_t len = 0;
+  int i;
+
+  if (out->chunked) {
+    for (i = out->chunk_start + 1; i < out->count; ++i)
+      len += out->iov[i].iov_len;
+    if (len) {
+      out->iov[out->chunk_start].iov_len =
+        snprintf(out->chunk, sizeof(out->chunk), "%zx\r\n", len);
+      out->iov[out->count].iov_base = "\r\n";
+      out->iov[out->count].iov_len = 2;
+      ++out->count;
+    } else {
+      out->count = out->chunk_start;
+    }
+  }
+  if (out->count && !out->error && !out->discard &&
+      sock_writev(out->fd, out->iov, out->count) < 0)
+    out->error = 1;
+  out->count = 0;
+  out->used = 0;
+  if (out->chunked)
+    output_chunk_start(out);
+  return out->error ? -1 : 0;
+}
+
+/*
+ * Send everything gathered after this call with chunked transfer encoding.
+ */
+void output_chunked(struct output *out)
+{
+  if (out->chunked)
+    return;
+  if (output_full(out))
+    output_flush(out);
+  out->chunked = 1;
+  output_chunk_start(out);
+}
+
+/*
+ * Send everything gathered so far and drop the rest of the response, like
+ * the body of a response to HEAD.
+ */
+void output_discard(struct output *out)
+{
+  output_flush(out);
+  out->discard = 1;
+}
+
+/*
+ * Send the rest of the response and the last chunk in chunked mode.
+ * Returns 0 on success, -1 if the client cannot be reached.
+ */
+int output_finish(struct output *out)
+{
+  output_flush(out);
+  if (out->chunked) {
+    out->chunked = 0;
+    out->count = 0;
+    output_add(out, "0\r\n\r\n", 5);
+    output_flush(out);
+  }
+  return out->error ? -1 : 0;
+}
+
+/*
+ * Append len bytes from data to the response without copying them. The
+ * data must stay valid until the next output_flush().
+ */
+void output_add(struct output *out, const void *data, size_t len)
+{
+  struct iovec *last;
+
+  if (!len)
+    return;
+  /* extend the last entry if the data is contiguous */
+  last = out->count ? &out->iov[out->count - 1] : NULL;
+  if (last && (char *)last->iov_base + last->iov_len == data &&
+      !(out->chunked && out->count - 1 == out->chunk_start)) {
+    last->iov_len += len;
+    return;
+  }
+  if (output_full(out))
+    output_flush(out);
+  out->iov[out->count].iov_base = (void *)data;
+  out->iov[out->count].iov_len = len;
+  ++out->count;
+}
+
+/*
+ * Append a copy of len bytes from data to the response.
+ */
+void output_copy(struct output *out, const void *data, size_t len)
+{
+  /* flushing resets the buffer, so make room beforehand */
+  if (out->used + len > sizeof(out->buf) || output_full(out))
+    output_flush(out);
+  if (len > sizeof(out->buf)) {
+    output_add(out, data, len);
+    output_flush(out);
+    return;
+  }
+  memcpy(out->buf + out->used, data, len);
+  output_add(out, out->buf + out->used, len);
+  out->used += len;
+}
+
+/*
+ * Append formatted text to the response. Text longer than the buffer is
+ * truncated.
+ */
+void output_printf(struct output *out, const char *fmt, ...)
+{
+  va_list args;
+  size_t size;
+  int len;
+
+  if (output_full(out))
+    output_flush(out);
+  for (;;) {
+    size = sizeof(out->buf) - out->used;
+    va_start(args, fmt);
+    len = vsnprintf(out->buf + out->used, size, fmt, args);
+    va_end(args);
+    if (len < 0)
+      return;
+    if (len < size || !out->used)
+      break;
+    output_flush(out);
+  }
+  if (len >= size)
+    len = size - 1;
+  output_add(out, out->buf + out->used, len);
+  out->used += len;
+}
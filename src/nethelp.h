@@ -1,6 +1,45 @@
 #ifndef NETHELP_H
 #define NETHELP_H
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Maximum number of buffers sent by one system call */
+#define OUTPUT_IOVECS 64
+/* Size of the buffer for copied and formatted text */
+#define OUTPUT_BUFSIZE 4096
+
+/*
+ * Response gathered into an I/O vector and sent by one system call.
+ * fd: socket, count: used entries of iov, used: used bytes of buf,
+ * error: the client cannot be reached, chunked: each flush sends a chunk,
+ * chunk_start: entry of iov holding the size line of the chunk,
+ * chunk: size line
+ */
+struct output {
+  int fd;
+  int count;
+  size_t used;
+  int error;
+  int chunked;
+  int chunk_start;
+  int discard;
+  char chunk[24];
+  struct iovec iov[OUTPUT_IOVECS];
+  char buf[OUTPUT_BUFSIZE];
+};
+
 int sock_write_bytes(int sockfd, const unsigned char *buff, int len);
+ssize_t sock_writev(int sockfd, struct iovec *iov, int count);
+void output_init(struct output *out, int sockfd);
+int output_flush(struct output *out);
+void output_chunked(struct output *out);
+void output_discard(struct output *out);
+int output_finish(struct output *out);
+void output_add(struct output *out, const void *data, size_t len);
+void output_copy(struct output *out, const void *data, size_t len);
+void output_printf(struct output *out, const char *fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
 
 #endif /* ! NETHELP_H */
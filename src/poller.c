@@ -0,0 +1,242 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Background reading of the outlet status
+ *
+ * Outlets also change by their buttons and by the schedules stored in the
+ * devices. A thread of the daemon reads the status of all devices so that
+ * such changes are observed and published like those caused by commands.
+ *
+ * The interval adapts to the activity. After a change the status is read
+ * every POLLER_MIN milliseconds, while nothing changes the interval doubles
+ * up to poll_max_ms. Around the switchings of the device schedules it is
+ * read every POLLER_MIN milliseconds, too. Reads by other clients within
+ * status_cache_ms are reused, so the thread causes no extra USB traffic
+ * while web clients are busy.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+#include "sispm_ctl.h"
+#include "gembird.h"
+#include "poller.h"
+
+/* Interval in milliseconds after a change */
+#define POLLER_MIN 1000
+/* Milliseconds before a scheduled switching from which on to read often */
+#define POLLER_LEAD 2000
+/* Seconds after a scheduled switching until which to read often */
+#define POLLER_TRAIL 10
+/* Milliseconds after which the schedules are read again */
+#define POLLER_SCHEDULES 600000
+
+int poll_max_ms = POLLMAX;
+
+static pthread_mutex_t poller_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poller_cond;
+static bool poller_running;
+static unsigned long poller_changes;
+
+static long long poller_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * poller_changed() - note that the status of an outlet changed
+ *
+ * The thread then reads the status often for a while.
+ */
+void poller_changed(void)
+{
+	pthread_mutex_lock(&poller_mutex);
+	++poller_changes;
+	if (poller_running)
+		pthread_cond_signal(&poller_cond);
+	pthread_mutex_unlock(&poller_mutex);
+}
+
+static unsigned long poller_generation(void)
+{
+	unsigned long ret;
+
+	pthread_mutex_lock(&poller_mutex);
+	ret = poller_changes;
+	pthread_mutex_unlock(&poller_mutex);
+	return ret;
+}
+
+/**
+ * poller_sleep() - wait until the next read
+ *
+ * A change restarts the wait with the shortest interval, so a burst of
+ * commands is followed by a single read.
+ *
+ * @ms:		milliseconds to wait
+ */
+static void poller_sleep(long ms)
+{
+	unsigned long changes;
+	struct timespec ts;
+	long long until;
+
+	pthread_mutex_lock(&poller_mutex);
+	changes = poller_changes;
+	until = poller_now() + ms;
+	for (;;) {
+		ts.tv_sec = until / 1000;
+		ts.tv_nsec = until % 1000 * 1000000;
+		if (pthread_cond_timedwait(&poller_cond, &poller_mutex, &ts) &&
+		    poller_changes == changes)
+			break;
+		if (poller_changes != changes) {
+			changes = poller_changes;
+			until = poller_now() + POLLER_MIN;
+		}
+	}
+	pthread_mutex_unlock(&poller_mutex);
+}
+
+/**
+ * poller_schedules() - read the schedules of all devices
+ *
+ * Devices with a single outlet have no schedules. The schedules of a
+ * device that cannot be read are left empty.
+ *
+ * @plans:	schedules indexed by device and outlet
+ * @count:	number of devices
+ */
+static void poller_schedules(struct plannif (*plans)[MAXOUTLET + 1],
+			     int count)
+{
+	struct transport_handle *udev;
+	struct gembird *gb;
+	int i, outlet;
+
+	for (i = 0; i < count; ++i) {
+		gb = gembird_get(i);
+		for (outlet = 1; outlet <= MAXOUTLET; ++outlet)
+			plannif_reset(&plans[i][outlet]);
+		if (gembird_outlets(gb) == 1)
+			continue;
+		gembird_lock(gb);
+		udev = gembird_handle(gb);
+		for (outlet = 1; udev && outlet <= MAXOUTLET; ++outlet) {
+			if (usb_command_getplannif(udev, outlet,
+						   &plans[i][outlet])) {
+				plannif_reset(&plans[i][outlet]);
+				gembird_invalidate(gb);
+				break;
+			}
+		}
+		gembird_unlock(gb);
+	}
+}
+
+/**
+ * poller_next() - find the next switching of any schedule
+ *
+ * @plans:	schedules indexed by device and outlet
+ * @count:	number of devices
+ * @after:	time after which to search
+ * Return:	time of the next switching, 0 if none
+ */
+static time_t poller_next(struct plannif (*plans)[MAXOUTLET + 1], int count,
+			  time_t after)
+{
+	time_t date, next = 0;
+	int i, outlet;
+
+	for (i = 0; i < count; ++i) {
+		for (outlet = 1; outlet <= MAXOUTLET; ++outlet) {
+			date = plannif_next(&plans[i][outlet], after);
+			if (date && (!next || date < next))
+				next = date;
+		}
+	}
+	return next;
+}
+
+static void *poller_run(void *arg)
+{
+	struct plannif (*plans)[MAXOUTLET + 1] = NULL, (*grown)[MAXOUTLET + 1];
+	long long schedules = 0;
+	long interval = POLLER_MIN, delay;
+	unsigned long changes;
+	time_t now, next;
+	int count = 0;
+
+	for (;;) {
+		changes = poller_generation();
+		gembird_poll();
+		/* make room for the schedules of devices plugged in */
+		if (gembird_count > count) {
+			grown = realloc(plans, gembird_count * sizeof(*plans));
+			if (grown) {
+				plans = grown;
+				count = gembird_count;
+				schedules = 0;
+			}
+		}
+		if (poller_now() >= schedules) {
+			poller_schedules(plans, count);
+			schedules = poller_now() + POLLER_SCHEDULES;
+		}
+
+		if (poller_generation() != changes)
+			interval = POLLER_MIN;
+		else if (interval < poll_max_ms / 2)
+			interval *= 2;
+		else
+			interval = poll_max_ms;
+
+		/* read often shortly before until shortly after a switching */
+		delay = interval;
+		now = time(NULL);
+		next = poller_next(plans, count, now - POLLER_TRAIL);
+		if (next && (next - now) * 1000 - POLLER_LEAD < delay)
+			delay = (next - now) * 1000 - POLLER_LEAD;
+		if (delay < POLLER_MIN)
+			delay = POLLER_MIN;
+		poller_sleep(delay);
+	}
+	return NULL;
+}
+
+/**
+ * poller_start() - start reading the status in the background
+ *
+ * Nothing is started if poll_max_ms is 0.
+ *
+ * Return:	0 on success, -1 on error
+ */
+int poller_start(void)
+{
+	pthread_condattr_t attr;
+	pthread_t thread;
+
+	if (!poll_max_ms)
+		return 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&poller_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_mutex_lock(&poller_mutex);
+	poller_running = true;
+	pthread_mutex_unlock(&poller_mutex);
+	if (pthread_create(&thread, NULL, poller_run, NULL)) {
+		pthread_mutex_lock(&poller_mutex);
+		poller_running = false;
+		pthread_mutex_unlock(&poller_mutex);
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Background reading of the outlet status
+ */
+
+#ifndef POLLER_H
+#define POLLER_H
+
+/* Default maximum interval between reads in milliseconds */
+#define POLLMAX 30000
+
+extern int poll_max_ms;
+
+int poller_start(void);
+void poller_changed(void);
+
+#endif /* POLLER_H */
@@ -23,19 +23,27 @@
   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
-#include <usb.h>
 #include "config.h"
 #include "sispm_ctl.h"
+#include "gembird.h"
+#include "api.h"
+#include "auth.h"
+#include "events.h"
+#include "metrics.h"
+#include "http.h"
+#include "nethelp.h"
+#include "template.h"
 
-#define BSIZE   65536
 int debug = 0;
 int verbose = 1;
 #ifdef DATADIR
@@ -45,55 +53,67 @@ char *homedir = 0;
 #endif
 
 #ifndef WEBLESS
-char *secret;
+static const char head_503[] =
+  "HTTP/1.1 503 Service not available\nServer: SisPM\n"
+  "Content-Type: text/html\n";
+static const char page_503[] =
+  "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\" "
+  "\"http://www.w3.org/TR/html4/loose.dtd\">\n"
+  "<html><head>\n<title>503 Service not available</title>\n"
+  "<meta http-equiv=\"refresh\" content=\"2;url=/\">\n"
+  "</head><body>\n"
+  "<h1>503 Service not available</h1></body></html>\n\n";
+
+static const char head_401[] =
+  "HTTP/1.1 401 Unauthorized\nServer: SisPM\n"
+  "WWW-Authenticate: Basic realm=\"SisPM\"\n"
+  "Content-Type: text/html\n";
+static const char page_401[] =
+  "<!DOCTYPE HTML>\n"
+  "<html><head>\n<title>401 Unauthorized</title>\n"
+  "<meta http-equiv=\"refresh\" content=\"10;url=/\">\n"
+  "</head><body>\n"
+  "<h1>401 Unauthorized</h1></body></html>\n\n";
+
+static const char head_404[] =
+  "HTTP/1.1 404 Not found\nServer: SisPM\nContent-Type: text/html\n";
+static const char page_404[] =
+  "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\" "
+  "\"http://www.w3.org/TR/html4/loose.dtd\">\n"
+  "<html><head>\n<title>404 Not found</title>\n"
+  "<meta http-equiv=\"refresh\" content=\"2;url=/\">\n"
+  "</head><body>\n"
+  "<h1>404 Not found</h1></body></html>\n\n";
+
+static void send_page(struct http_conn *conn, const char *head,
+                      const char *page)
+{
+  conn->status = atoi(head + 9);
+  output_add(conn->out, head, strlen(head));
+  http_header_end(conn->out, conn, false, strlen(page));
+  output_add(conn->out, page, strlen(page));
+  output_finish(conn->out);
+}
 
-static void service_not_available(int out)
+static void service_not_available(struct http_conn *conn)
 {
-  char xbuffer[BSIZE+2];
-
-  sprintf(xbuffer, "HTTP/1.1 503 Service not available\n"
-          "Server: SisPM\nContent-Type: "
-          "text/html\n\n"
-          "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\" "
-          "\"http://www.w3.org/TR/html4/loose.dtd\">\n"
-          "<html><head>\n<title>503 Service not available</title>\n"
-          "<meta http-equiv=\"refresh\" content=\"2;url=/\">\n"
-          "</head><body>\n"
-          "<h1>503 Service not available</h1></body></html>\n\n");
-  send(out,xbuffer,strlen(xbuffer),0);
+  send_page(conn, head_503, page_503);
 }
 
-static void unauthorized(int out)
+static void unauthorized(struct http_conn *conn, long delay)
 {
-  char xbuffer[BSIZE+2];
-
-  /* Sleep here to make password guessing more expensive */
-  usleep(2000000);
-  sprintf(xbuffer,
-          "HTTP/1.1 401 Unauthorized\nServer: SisPM\n"
-          "WWW-Authenticate: Basic realm=\"SisPM\n\""
-          "Content-Type: text/html\n\n"
-          "<!DOCTYPE HTML>\n"
-          "<html><head>\n<title>401 Unauthorized</title>\n"
-          "<meta http-equiv=\"refresh\" content=\"10;url=/\">\n"
-          "</head><body>\n"
-          "<h1>401 Unauthorized</h1></body></html>\n\n");
-  send(out,xbuffer,strlen(xbuffer),0);
+  /* delay the answer to make password guessing more expensive */
+  if (delay) {
+    conn->delayed = true;
+    conn->deadline = http_now() + delay;
+    return;
+  }
+  send_page(conn, head_401, page_401);
 }
 
-static void bad_request(int out)
+static void bad_request(struct http_conn *conn)
 {
-  char xbuffer[BSIZE+2];
-
-  sprintf(xbuffer, "HTTP/1.1 404 Not found\nServer: SisPM\nContent-Type: "
-          "text/html\n\n"
-          "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\" "
-          "\"http://www.w3.org/TR/html4/loose.dtd\">\n"
-          "<html><head>\n<title>404 Not found</title>\n"
-          "<meta http-equiv=\"refresh\" content=\"2;url=/\">\n"
-          "</head><body>\n"
-          "<h1>404 Not found</h1></body></html>\n\n");
-  send(out,xbuffer,strlen(xbuffer),0);
+  send_page(conn, head_404, page_404);
 }
 
 char *next_word(char *ptr)
@@ -117,29 +137,95 @@ char *next_word(char *ptr)
   }
 }
 
-void process(int out,char *request, struct usb_device *dev, int devnum)
+/* get value of a request header, the value ends at the line end */
+static const char *header_value(const char *headers, const char *name)
 {
-  char xbuffer[BSIZE+2];
+  size_t len = strlen(name);
+  const char *ptr;
+
+  for (ptr = headers; ptr && *ptr && *ptr != '\r' && *ptr != '\n';
+       ptr = strchr(ptr, '\n'), ptr = ptr ? ptr + 1 : NULL) {
+    if (!strncasecmp(ptr, name, len) && ptr[len] == ':') {
+      for (ptr += len + 1; *ptr == ' ' || *ptr == '\t'; ++ptr)
+        ;
+      return ptr;
+    }
+  }
+  return NULL;
+}
+
+/* check if the client's copy of a static file is up to date */
+static bool not_modified(const char *none_match, const char *modified_since,
+                         const struct template *tpl)
+{
+  size_t len = strlen(tpl->etag);
+  const char *end;
+
+  if (!len)
+    return false;
+  if (none_match) {
+    if (*none_match == '*')
+      return true;
+    end = none_match + strcspn(none_match, "\r\n");
+    for (; end - none_match >= len; ++none_match)
+      if (!strncmp(none_match, tpl->etag, len))
+        return true;
+    return false;
+  }
+  return modified_since &&
+         !strncmp(modified_since, tpl->modified, strlen(tpl->modified));
+}
+
+static void send_not_modified(struct http_conn *conn,
+                              const struct template *tpl)
+{
+  conn->status = 304;
+  output_printf(conn->out, "HTTP/1.1 304 Not Modified\n"
+                "Server: SisPM\nETag: %s\nLast-Modified: %s\n",
+                tpl->etag, tpl->modified);
+  http_header_end(conn->out, conn, false, HTTP_NO_BODY);
+  output_finish(conn->out);
+}
+
+void process(struct http_conn *conn, struct gembird *gb)
+{
+  char *request = conn->buf;
   char filename[1024];
-  char *eol, *ptr;
-  FILE *in = NULL;
-  long length = 0;
-  long lastpos = 0;
-  long remlen = 0;
-  usb_dev_handle *udev;
-  unsigned int id; //product id of current device
-  char *retvalue = NULL;
-
-  /* Make sure the string is terminated */
-  request[BUFFERSIZE - 1] = 0;
+  char path[2048];
+  char method[16];
+  char *eol, *ptr, *body;
+  const char *none_match = NULL, *modified_since = NULL;
+  struct template *tpl;
+  struct transport_handle *udev;
+
+  /* the delay of a rejection has passed */
+  if (conn->delayed) {
+    conn->delayed = false;
+    unauthorized(conn, 0);
+    return;
+  }
+
   if (debug)
     fprintf(stderr,"\nRequested is\n(%s)\n",request);
 
-  /* Extract the file name */
+  /* The body follows the first empty line */
+  body = strstr(request, "\r\n\r\n");
+  if (body)
+    body += 4;
+  else if ((body = strstr(request, "\n\n")))
+    body += 2;
+
+  /* Extract the method and the file name */
+  memset(method, 0, sizeof(method));
   memset(filename, 0, sizeof(filename));
   eol = strchr(request, '\n');
   if (eol) {
+    for (ptr = request; *ptr > ' ' && ptr - request < sizeof(method) - 1;
+         ++ptr)
+      method[ptr - request] = *ptr;
     *eol = 0;
+    none_match = header_value(eol + 1, "If-None-Match");
+    modified_since = header_value(eol + 1, "If-Modified-Since");
     ptr = strchr(request, ' ');
     if (ptr)
       strncpy(filename, strchr(request, ' ') + 1, sizeof(filename) - 1);
@@ -148,8 +234,9 @@ void process(int out,char *request, struct usb_device *dev, int devnum)
       *ptr = 0;
   }
   /* Look for authentication */
-  if (secret) {
+  if (auth_required()) {
     char *password = NULL;
+    long delay;
 
     for(; eol;) {
       ptr = eol + 1;
@@ -167,12 +254,36 @@ void process(int out,char *request, struct usb_device *dev, int devnum)
       *ptr = '\0';
       break;
     }
-    if (!password || strcmp(secret, password)) {
-      unauthorized(out);
+    /* browsers ask for credentials after the first rejection */
+    if (!password) {
+      unauthorized(conn, 0);
+      return;
+    }
+    delay = auth_check(conn->addr, password);
+    if (delay) {
+      unauthorized(conn, delay);
       return;
     }
   }
 
+  /* JSON interface */
+  ptr = strchr(filename, '?');
+  if (ptr)
+    *ptr = '\0';
+  if (api_request(filename)) {
+    api_process(conn, method, filename, body);
+    return;
+  }
+  if (!strcmp(filename, METRICS_PATH)) {
+    metrics_send(conn);
+    return;
+  }
+  if (!strcmp(filename, EVENTS_PATH)) {
+    if (events_subscribe(conn))
+      service_not_available(conn);
+    return;
+  }
+
   // avoid to read other directories, %-codes are not evaluated
   ptr = strrchr(filename,'/');
   if (ptr != NULL)
@@ -180,194 +291,83 @@ void process(int out,char *request, struct usb_device *dev, int devnum)
   else
     ptr = filename;
 
+  /* /<serial or Bus:Device>/<file> selects the device */
+  if (filename[0] == '/' && ptr > filename + 1) {
+    char *dir = filename + 1;
+    char *end = strchr(dir, '/');
+
+    gb = gembird_find(dir, end - dir);
+    if (!gb) {
+      bad_request(conn);
+      return;
+    }
+  }
+
   if (strlen(ptr) == 0)
     ptr="index.html";
 
   if (debug) {
     fprintf(stderr,"\nrequested file name(%s)\n", filename);
     fprintf(stderr,"resulting file name(%s)\n", ptr);
-    fprintf(stderr,"change directory to (%s)\n", homedir);
   }
 
-  if (chdir(homedir) != 0) {
-    syslog(LOG_ERR, "Cannot access directory %s\n", homedir);
-    bad_request(out);
+  if (snprintf(path, sizeof(path), "%s/%s", homedir, ptr) >= sizeof(path)) {
+    bad_request(conn);
     return;
   }
 
   if (debug)
-    fprintf(stderr,"\nopen file(%s)\n",ptr);
+    fprintf(stderr,"\nopen file(%s)\n",path);
 
-  in = fopen(ptr,"r");
-
-  if (in == NULL) {
-    syslog(LOG_ERR, "Cannot open %s\n", ptr);
-    bad_request(out);
+  /* the template is parsed once and cached until the file changes */
+  tpl = template_get(path);
+  if (tpl == NULL && errno == EINVAL) {
+    service_not_available(conn);
+    return;
+  }
+  if (tpl == NULL) {
+    syslog(LOG_ERR, "Cannot open %s\n", path);
+    bad_request(conn);
     return;
   }
 
-  /* get device-handle/-id */
-  udev = get_handle(dev);
-  if (udev == NULL) {
-    fprintf(stderr, "No access to Gembird #%d USB device %s\n", devnum,
-            dev->filename);
-    syslog(LOG_ERR, "No access to Gembird #%d USB device %s\n", devnum,
-           dev->filename);
-    service_not_available(out);
-    fclose(in);
+  if (not_modified(none_match, modified_since, tpl)) {
+    send_not_modified(conn, tpl);
+    template_put(tpl);
     return;
-  } else if (verbose)
-    fprintf(stderr, "Accessing Gembird #%d USB device %s\n", devnum,
-            dev->filename );
-  id = get_id(dev);
-
-  lastpos = ftell(in);
-
-  while (!feof(in)) {
-    memset(xbuffer, 0, BSIZE);
-    retvalue = fgets(xbuffer, BSIZE-1, in);
-    remlen = length = ftell(in) - lastpos;
-    lastpos = ftell(in);
-    if (retvalue == NULL) {
-      break;
-    }
+  }
 
-    char *mrk = xbuffer;
-    char *ptr = xbuffer;
-    /* search for:
-     *  $$off(#)?.1.:.2.$$      to switch off(#)
-     *  $$on(#)?.1.:.2.$$       to switch on(#)
-     *  $$toggle(#)?.1.:.2.$$   to toggle(#)
-     *  $$status(#)?.1.:.2.$$   to evaluate status(#)
-     *  $$version()$$           to evaluate version
-     */
-    for (mrk = ptr = xbuffer; (ptr-xbuffer) < length; ++ptr) {
-      if (*ptr=='$' && ptr[1]=='$') {
-        /*
-         * $$exec(1)?positive:negative$$
-         *   ^cmd    ^pos             ^trm
-         * ^ptr   ^num        ^neg
-         */
-        char *cmd=&ptr[2];
-        char *num=strchr(cmd,'(');
-        char *pos=strchr(num?num:cmd,'?');
-        char *neg=strchr(pos?pos:cmd,':');
-        char *trm=strchr(neg?neg:cmd,'$');
-        if (debug) {
-          fprintf(stderr,"%p\n%p\n%p\n%p\n%p\n%p\n",cmd,num,pos,neg,trm,ptr);
-          fprintf(stderr,"%s%s%s%s%s%s",cmd,num,pos,neg,trm,ptr);
-        }
-
-        if (trm != NULL) {
-          if (num == NULL) {
-            fprintf(stderr, "Command-Format: $$exec(#)?positive:negative$$ - "
-                    "ERROR at #\n");
-            syslog(LOG_ERR, "Command-Format: $$exec(#)?positive:negative$$ - "
-                   "ERROR at #\n");
-            service_not_available(out);
-            fclose(in);
-            return;
-          }
-          ++num;
-          if (pos != NULL)
-            ++pos;
-          if (neg != NULL)
-            ++neg;
-
-          send(out,mrk,ptr-mrk,0);
-          remlen = remlen - (ptr - mrk);
-          mrk=ptr;
-
-          if (strncasecmp(cmd,"on(",3)==0) {
-            if (trm[1] != '$' || !pos || !neg) {
-              fprintf(stderr, "Command-Format: $$on(#)?positive:negative$$\n");
-              syslog(LOG_ERR, "Command-Format: $$on(#)?positive:negative$$\n");
-              service_not_available(out);
-              fclose(in);
-              return;
-            }
-            if (debug)
-              fprintf(stderr,"\nON(%s)\n",num);
-            if (sispm_switch_on(udev,id,atoi(num)) !=0)
-              send(out,pos,neg-pos-1,0);
-            else
-              send(out,neg,trm-neg,0);
-          } else if (strncasecmp(cmd,"off(",4)==0) {
-            if (trm[1] != '$' || !pos || !neg) {
-              fprintf(stderr, "Command-Format: $$off(#)?positive:negative$$\n");
-              syslog(LOG_ERR, "Command-Format: $$off(#)?positive:negative$$\n");
-              service_not_available(out);
-              fclose(in);
-              return;
-            }
-            if (debug)
-              fprintf(stderr,"\nOFF(%s)\n",num);
-            if (sispm_switch_off(udev,id,atoi(num)) !=0)
-              send(out,pos,neg-pos-1,0);
-            else
-              send(out,neg,trm-neg,0);
-          } else if (strncasecmp(cmd,"toggle(",7)==0) {
-            if (trm[1] != '$' || !pos || !neg) {
-              fprintf(stderr,
-                      "Command-Format: $$toggle(#)?positive:negative$$\n");
-              syslog(LOG_ERR,
-                     "Command-Format: $$toggle(#)?positive:negative$$\n");
-              service_not_available(out);
-              fclose(in);
-              return;
-            }
-            if (debug)
-              fprintf(stderr,"\nTOGGLE(%s)\n",num);
-            if (sispm_switch_getstatus(udev,id,atoi(num)) == 0) {
-              sispm_switch_on(udev,id,atoi(num));
-              send(out,pos,neg-pos-1,0);
-            } else {
-              sispm_switch_off(udev,id,atoi(num));
-              send(out,neg,trm-neg,0);
-            }
-          } else if (strncasecmp(cmd,"status(",7)==0) {
-            if (trm[1] != '$' || !pos || !neg) {
-              fprintf(stderr,
-                      "Command-Format: $$status(#)?positive:negative$$\n");
-              syslog(LOG_ERR,
-                      "Command-Format: $$status(#)?positive:negative$$\n");
-              service_not_available(out);
-              fclose(in);
-              return;
-            }
-            if (debug)
-              fprintf(stderr,"\nSTATUS(%s)\n",num);
-            if (sispm_switch_getstatus(udev,id,atoi(num)) != 0)
-              send(out,pos,neg-pos-1,0);
-            else
-              send(out,neg,trm-neg,0);
-          } else if (strncasecmp(cmd, "version(", 8) == 0) {
-            if (trm[1] != '$') {
-              fprintf(stderr, "Command-Format: $$version()$$\n");
-              syslog(LOG_ERR, "Command-Format: $$version()$$\n");
-              service_not_available(out);
-              fclose(in);
-              return;
-            }
-            if (debug)
-              fprintf(stderr,"\nVERSION(%s)\n",num);
-            send(out, PACKAGE_VERSION, strlen(PACKAGE_VERSION), 0);
-          } else {
-            send(out,"$$",2,0);
-          }
-          remlen=remlen-(2+trm-mrk);
-          mrk=ptr=&trm[2];
-        }
-      }
+  /* without a device at start the first one plugged in is used */
+  if (gb == NULL && __atomic_load_n(&gembird_count, __ATOMIC_ACQUIRE))
+    gb = gembird_get(0);
+
+  /* check device access, the handle stays open between requests */
+  if (tpl->usb) {
+    udev = NULL;
+    if (gb != NULL) {
+      gembird_lock(gb);
+      udev = gembird_handle(gb);
+      gembird_unlock(gb);
+    }
+    if (udev == NULL) {
+      service_not_available(conn);
+      template_put(tpl);
+      return;
     }
-    send(out, mrk, remlen, 0);
   }
 
-  if (udev != NULL) {
-    usb_close(udev);
-    udev = NULL;
+  /* the page is streamed, the output references the template */
+  if (tpl->head) {
+    conn->status = atoi(tpl->head + 9);
+    output_add(conn->out, tpl->head, strlen(tpl->head));
+    http_header_end(conn->out, conn, tpl->crlf, tpl->length);
+  } else {
+    /* without a separate header the end of the response is unknown */
+    conn->status = 200;
+    conn->keep_alive = false;
   }
-  fclose(in);
-  return;
+  template_render(conn->out, tpl, gb);
+  output_finish(conn->out);
+  template_put(tpl);
 }
 #endif
@@ -5,12 +5,20 @@
  * Copyright (c) 2020 Heinrich Schuchardt
  */
 
+/* strptime() */
+#define _GNU_SOURCE
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "sispm_ctl.h"
 
 #define PMS2_BUFFER_SIZE 0x28
+/* Number of actions of a schedule including the initial wait */
+#define PLANNIF_ACTIONS ((int)(sizeof(((struct plannif *)0)->actions) / \
+			       sizeof(struct plannifAction)))
 
 static unsigned char
 *pms2_write_block(uint8_t action, uint32_t time, unsigned char *ptr)
@@ -53,7 +61,7 @@ static const unsigned char
  * @schedule:	schedule
  * @buffer:	40 character buffer
  *
- * Return:	0 = success
+ * Return:	0 = success, -1 if the schedule has too many items
  */
 int pms2_schedule_to_buffer(const struct plannif *schedule,
 			    unsigned char *buffer)
@@ -76,10 +84,8 @@ int pms2_schedule_to_buffer(const struct plannif *schedule,
 			break;
 		ptr = pms2_write_block(action, start, ptr);
 	}
-	if (action <= 1) {
-		fprintf(stderr, "Schedule has too many items\n");
+	if (action <= 1)
 		return -1;
-	}
 	if (schedule->actions[i].timeForNext)
 		start -= loop_ref;
 	else
@@ -129,3 +135,229 @@ void pms2_buffer_to_schedule(const unsigned char *buffer,
 		schedule->actions[i].timeForNext =
 				((int32_t)loop_ref + time - (int32_t)last) / 60;
 }
+
+/**
+ * plannif_next() - find the next switching of a schedule
+ *
+ * @schedule:	schedule
+ * @after:	time after which to search
+ *
+ * Return:	time of the first switching after @after, 0 if none
+ */
+time_t plannif_next(const struct plannif *schedule, time_t after)
+{
+	const int count = sizeof(schedule->actions) /
+			  sizeof(struct plannifAction);
+	time_t start, date, offset = 0, loop = 0, next = 0;
+	int last, i;
+
+	/* the last action is followed by the loop time or a stop */
+	for (last = count - 1;
+	     last > 0 && schedule->actions[last].switchOn == -1; --last)
+		;
+	if (last < 1)
+		return 0;
+	if (schedule->actions[last].timeForNext != -1)
+		for (i = 1; i <= last; ++i)
+			loop += 60 * schedule->actions[i].timeForNext;
+
+	/* action dates are on round minutes */
+	start = (schedule->timeStamp / 60) * 60;
+	for (i = 1; i <= last; ++i) {
+		offset += 60 * schedule->actions[i - 1].timeForNext;
+		date = start + offset;
+		if (date <= after && loop > 0)
+			date += ((after - date) / loop + 1) * loop;
+		if (date > after && (!next || date < next))
+			next = date;
+	}
+	return next;
+}
+
+/**
+ * plannif_last() - find the last action of a schedule
+ *
+ * @schedule:	schedule
+ * Return:	index of the last action, 0 if the schedule is empty
+ */
+static int plannif_last(const struct plannif *schedule)
+{
+	int last;
+
+	for (last = sizeof(schedule->actions) /
+		    sizeof(struct plannifAction) - 1;
+	     last > 0 && schedule->actions[last].switchOn == -1; --last)
+		;
+	return last;
+}
+
+/**
+ * plannif_equal() - check if two schedules switch at the same times
+ *
+ * The time stamps of the schedules are ignored. Schedules are equal if
+ * they switch the same way at the same dates. Looping schedules are also
+ * equal if they loop in the same phase and one of them has started, so a
+ * loop running since yesterday equals the same loop starting at its next
+ * repetition. Schedules whose actions all lie in the past are equal.
+ *
+ * @a:		schedule
+ * @b:		schedule
+ * @now:	current time
+ * Return:	true if the schedules are equal
+ */
+bool plannif_equal(const struct plannif *a, const struct plannif *b,
+		   time_t now)
+{
+	int last = plannif_last(a);
+	time_t start_a, start_b, end_a, end_b, loop_a = 0, loop_b = 0;
+	int i;
+
+	if (last != plannif_last(b))
+		return false;
+	if (!last)
+		return true;
+	for (i = 1; i <= last; ++i)
+		if (a->actions[i].switchOn != b->actions[i].switchOn ||
+		    (i < last && a->actions[i].timeForNext !=
+				 b->actions[i].timeForNext))
+			return false;
+	/* the last action is followed by the loop time, 0 or -1 for a stop */
+	if (a->actions[last].timeForNext != -1)
+		loop_a = a->actions[last].timeForNext;
+	if (b->actions[last].timeForNext != -1)
+		loop_b = b->actions[last].timeForNext;
+	if (loop_a != loop_b)
+		return false;
+
+	/* action dates are on round minutes */
+	start_a = (a->timeStamp / 60) * 60 + 60 * a->actions[0].timeForNext;
+	start_b = (b->timeStamp / 60) * 60 + 60 * b->actions[0].timeForNext;
+	if (start_a == start_b)
+		return true;
+	if (loop_a) {
+		for (i = 1; i < last; ++i)
+			loop_a += a->actions[i].timeForNext;
+		return (start_a <= now || start_b <= now) &&
+		       (start_a - start_b) % (60 * loop_a) == 0;
+	}
+	end_a = start_a;
+	end_b = start_b;
+	for (i = 1; i < last; ++i) {
+		end_a += 60 * a->actions[i].timeForNext;
+		end_b += 60 * b->actions[i].timeForNext;
+	}
+	return end_a <= now && end_b <= now;
+}
+
+/**
+ * plannif_date() - convert a date to a time
+ *
+ * Like the device the conversion does not consider daylight saving time
+ * switches after @now.
+ *
+ * @date:	date as '%Y-%m-%d %H:%M' in the local time zone
+ * @now:	current time
+ * Return:	time, -1 for an invalid date
+ */
+time_t plannif_date(const char *date, time_t now)
+{
+	struct tm tm, now_tm;
+
+	localtime_r(&now, &now_tm);
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_isdst = now_tm.tm_isdst;
+	if (!strptime(date, "%Y-%m-%d %H:%M", &tm))
+		return -1;
+	return mktime(&tm);
+}
+
+/**
+ * plannif_loop() - store the loop time after the last action
+ *
+ * @schedule:	schedule with the time before each action filled in
+ * @loop:	minutes from the first action to its repetition, 0 for no
+ *		repetition
+ * Return:	0 on success, -1 if the loop period is too short
+ */
+int plannif_loop(struct plannif *schedule, ulong loop)
+{
+	int last = 0;
+
+	while (schedule->actions[last].timeForNext != -1) {
+		/* the time before the first action is not part of the loop */
+		if (loop && last > 0) {
+			if (loop <= schedule->actions[last].timeForNext)
+				return -1;
+			loop -= schedule->actions[last].timeForNext;
+		}
+		++last;
+	}
+	if (last >= 1)
+		schedule->actions[last].timeForNext = loop;
+	return 0;
+}
+
+/**
+ * plannif_format() - convert a schedule to text
+ *
+ * The text is <socket>,<time stamp> followed by <switch on>:<time for
+ * next> for each action up to the last one used, with -1 for unused
+ * fields. It contains no blanks and is read back by plannif_parse().
+ *
+ * @schedule:	schedule
+ * @buf:	buffer for the text
+ * @size:	size of the buffer
+ * Return:	0 on success, -1 if the buffer is too small
+ */
+int plannif_format(const struct plannif *schedule, char *buf, size_t size)
+{
+	int i, last;
+	size_t len;
+
+	for (last = PLANNIF_ACTIONS - 1;
+	     last > 0 && schedule->actions[last].switchOn == -1 &&
+	     schedule->actions[last].timeForNext == -1; --last)
+		;
+	len = snprintf(buf, size, "%d,%lu", schedule->socket,
+		       schedule->timeStamp);
+	for (i = 0; i <= last && len < size; ++i)
+		len += snprintf(buf + len, size - len, ",%ld:%ld",
+				(long)schedule->actions[i].switchOn,
+				(long)schedule->actions[i].timeForNext);
+	return len < size ? 0 : -1;
+}
+
+/**
+ * plannif_parse() - convert text written by plannif_format() to a schedule
+ *
+ * @text:	text
+ * @schedule:	schedule
+ * Return:	0 on success, -1 for invalid text
+ */
+int plannif_parse(const char *text, struct plannif *schedule)
+{
+	char *end;
+	int i;
+
+	plannif_reset(schedule);
+	schedule->socket = strtol(text, &end, 10);
+	if (end == text || *end != ',')
+		return -1;
+	text = end + 1;
+	schedule->timeStamp = strtoul(text, &end, 10);
+	if (end == text)
+		return -1;
+	for (i = 0; *end; ++i) {
+		if (*end != ',' || i == PLANNIF_ACTIONS)
+			return -1;
+		text = end + 1;
+		schedule->actions[i].switchOn = strtol(text, &end, 10);
+		if (end == text || *end != ':')
+			return -1;
+		text = end + 1;
+		schedule->actions[i].timeForNext = strtol(text, &end, 10);
+		if (end == text)
+			return -1;
+	}
+	return 0;
+}
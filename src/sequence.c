@@ -0,0 +1,802 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Power sequencing
+ *
+ * A sequence switches groups of outlets in steps. Each line of the sequence
+ * file defines a step:
+ *
+ *	<sequence> <step> <on|off> <target> [+<ms>] [after <step>[,<step>...]]
+ *
+ * The target is @<group> or <device>/<outlets> as in the group file. A step
+ * starts <ms> milliseconds after the steps it depends on have completed, or
+ * after the start of the sequence if it depends on none. Only earlier steps
+ * of the same sequence may be named, so there are no cycles. Steps whose
+ * dependencies have completed run concurrently, also across sequences. A
+ * step fails if one of its outlets cannot be switched, the steps depending
+ * on it are skipped.
+ *
+ * Switching on many outlets at once may trip a breaker. The line
+ *
+ *	inrush <count> <ms>
+ *
+ * limits the outlets switched on by all sequences to <count> per <ms>
+ * milliseconds. Steps with more outlets are switched in parts.
+ *
+ * A single thread runs all sequences. Where available it sleeps on a
+ * timerfd, so steps fire at the millisecond.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include "config.h"
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+#include "sispm_ctl.h"
+#include "gembird.h"
+#include "group.h"
+#include "sequence.h"
+
+/* Maximum length of a line of the sequence file */
+#define SEQUENCE_LINESIZE 1024
+/* Separators of the tokens of a line */
+#define SEQUENCE_BLANKS " \t\r\n"
+
+/**
+ * struct sequence_step - step of a sequence
+ *
+ * @name:	name
+ * @cmd:	GEMBIRD_ON or GEMBIRD_OFF
+ * @target:	outlets to switch
+ * @delay:	milliseconds to wait after the dependencies
+ * @after:	indexes of the steps this step depends on
+ * @nafter:	number of dependencies
+ */
+struct sequence_step {
+	char *name;
+	enum gembird_cmd cmd;
+	const struct group *target;
+	long delay;
+	int *after;
+	int nafter;
+};
+
+/**
+ * struct sequence - named sequence of steps
+ *
+ * @name:	name
+ * @steps:	steps
+ * @count:	number of steps
+ * @next:	next sequence
+ */
+struct sequence {
+	char *name;
+	struct sequence_step *steps;
+	int count;
+	struct sequence *next;
+};
+
+/* State of a step in a run */
+enum sequence_state {
+	SEQUENCE_WAITING,
+	SEQUENCE_SCHEDULED,
+	SEQUENCE_SWITCHING,
+	SEQUENCE_DONE,
+	SEQUENCE_FAILED,
+	SEQUENCE_SKIPPED,
+};
+
+static const char *sequence_states[] = {
+	"waiting", "scheduled", "switching", "done", "failed", "skipped"
+};
+
+/**
+ * struct sequence_progress - progress of a step in a run
+ *
+ * @state:	state
+ * @due:	time in milliseconds when a scheduled step starts
+ * @finished:	time in milliseconds when the step completed
+ * @targets:	devices resolved when the step started, outlets not yet
+ *		switched
+ * @parts:	outlets switched in the current round, per target
+ * @count:	number of targets
+ */
+struct sequence_progress {
+	enum sequence_state state;
+	long long due;
+	long long finished;
+	struct gembird_target *targets;
+	unsigned int *parts;
+	int count;
+};
+
+/**
+ * struct sequence_run - execution of a sequence
+ *
+ * @seq:	sequence
+ * @steps:	progress of the steps
+ * @start:	time in milliseconds when the run started
+ * @active:	number of steps not completed
+ * @next:	next run
+ */
+struct sequence_run {
+	const struct sequence *seq;
+	struct sequence_progress *steps;
+	long long start;
+	int active;
+	struct sequence_run *next;
+};
+
+static struct sequence *sequences;
+/* Outlets switched on per inrush window, 0 for no limit */
+static int inrush_count;
+static long inrush_ms;
+/* Time in milliseconds when each inrush slot is free again */
+static long long *inrush_slots;
+
+/* Protects the runs */
+static pthread_mutex_t sequence_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when a run completes */
+static pthread_cond_t sequence_done = PTHREAD_COND_INITIALIZER;
+/* Wakes the thread if there is no timerfd */
+static pthread_cond_t sequence_wakeup;
+static struct sequence_run *sequence_runs;
+#ifdef HAVE_SYS_TIMERFD_H
+static int sequence_timer = -1;
+#endif
+
+static long long sequence_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* find a step of a sequence, -1 if not found */
+static int sequence_step(const struct sequence *seq, const char *name)
+{
+	int i;
+
+	for (i = 0; i < seq->count; ++i)
+		if (!strcmp(seq->steps[i].name, name))
+			return i;
+	return -1;
+}
+
+/**
+ * sequence_after() - parse the dependencies of a step
+ *
+ * @seq:	sequence, the new step not yet counted
+ * @step:	new step
+ * @list:	comma separated step names, modified by tokenizing
+ * Return:	0 on success, -1 for unknown steps, -ENOMEM if out of memory
+ */
+static int sequence_after(const struct sequence *seq,
+			  struct sequence_step *step, char *list)
+{
+	char *name, *save;
+	int *after, i;
+
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		i = sequence_step(seq, name);
+		if (i < 0)
+			return -1;
+		after = realloc(step->after, (step->nafter + 1) * sizeof(int));
+		if (!after)
+			return -ENOMEM;
+		step->after = after;
+		step->after[step->nafter++] = i;
+	}
+	return 0;
+}
+
+/**
+ * sequence_parse() - parse a step definition
+ *
+ * @name:	sequence name
+ * @save:	tokenizer state after the sequence name
+ * Return:	0 on success, -1 for invalid syntax, -ENOMEM if out of memory
+ */
+static int sequence_parse(const char *name, char **save)
+{
+	struct sequence_step *steps, *step;
+	struct sequence *seq;
+	char *token, *end;
+	int ret;
+
+	for (seq = sequences; seq; seq = seq->next)
+		if (!strcmp(seq->name, name))
+			break;
+	if (!seq) {
+		seq = calloc(1, sizeof(struct sequence));
+		if (!seq)
+			return -ENOMEM;
+		seq->name = strdup(name);
+		if (!seq->name) {
+			free(seq);
+			return -ENOMEM;
+		}
+		seq->next = sequences;
+		sequences = seq;
+	}
+	steps = realloc(seq->steps, (seq->count + 1) * sizeof(*steps));
+	if (!steps)
+		return -ENOMEM;
+	seq->steps = steps;
+	step = &steps[seq->count];
+	memset(step, 0, sizeof(*step));
+
+	token = strtok_r(NULL, SEQUENCE_BLANKS, save);
+	if (!token || sequence_step(seq, token) >= 0)
+		return -1;
+	step->name = strdup(token);
+	if (!step->name)
+		return -ENOMEM;
+	ret = -1;
+	token = strtok_r(NULL, SEQUENCE_BLANKS, save);
+	if (!token)
+		goto err;
+	if (!strcmp(token, "on"))
+		step->cmd = GEMBIRD_ON;
+	else if (!strcmp(token, "off"))
+		step->cmd = GEMBIRD_OFF;
+	else
+		goto err;
+	token = strtok_r(NULL, SEQUENCE_BLANKS, save);
+	if (!token)
+		goto err;
+	step->target = group_target(token);
+	if (!step->target)
+		goto err;
+	token = strtok_r(NULL, SEQUENCE_BLANKS, save);
+	if (token && *token == '+') {
+		step->delay = strtol(token + 1, &end, 10);
+		if (end == token + 1 || *end || step->delay < 0)
+			goto err;
+		token = strtok_r(NULL, SEQUENCE_BLANKS, save);
+	}
+	if (token) {
+		if (strcmp(token, "after"))
+			goto err;
+		token = strtok_r(NULL, SEQUENCE_BLANKS, save);
+		if (!token || strtok_r(NULL, SEQUENCE_BLANKS, save))
+			goto err;
+		ret = sequence_after(seq, step, token);
+		if (ret)
+			goto err;
+	}
+	++seq->count;
+	return 0;
+err:
+	free(step->after);
+	free(step->name);
+	return ret;
+}
+
+/**
+ * sequence_load() - read the sequence definitions
+ *
+ * A missing file defines no sequences. Groups must be loaded before.
+ *
+ * @path:	sequence file
+ * Return:	0 on success, -1 on error
+ */
+int sequence_load(const char *path)
+{
+	char line[SEQUENCE_LINESIZE];
+	char *token, *end, *save;
+	int lineno = 0, ret = 0;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file) {
+		if (errno == ENOENT)
+			return 0;
+		perror(path);
+		return -1;
+	}
+	while (!ret && fgets(line, sizeof(line), file)) {
+		++lineno;
+		token = strtok_r(line, SEQUENCE_BLANKS, &save);
+		if (!token || *token == '#')
+			continue;
+		if (!strcmp(token, "inrush")) {
+			ret = -1;
+			token = strtok_r(NULL, SEQUENCE_BLANKS, &save);
+			if (!token)
+				break;
+			inrush_count = strtol(token, &end, 10);
+			if (*end || inrush_count < 1)
+				break;
+			token = strtok_r(NULL, SEQUENCE_BLANKS, &save);
+			if (!token)
+				break;
+			inrush_ms = strtol(token, &end, 10);
+			if (*end || inrush_ms < 1 ||
+			    strtok_r(NULL, SEQUENCE_BLANKS, &save))
+				break;
+			ret = 0;
+			continue;
+		}
+		ret = sequence_parse(token, &save);
+	}
+	fclose(file);
+	if (ret == -ENOMEM) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	if (ret) {
+		fprintf(stderr, "%s:%d: invalid step or unknown group\n", path,
+			lineno);
+		return -1;
+	}
+	if (inrush_count) {
+		inrush_slots = calloc(inrush_count, sizeof(long long));
+		if (!inrush_slots) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * sequence_sleep() - wait until a time or until woken
+ *
+ * The caller holds sequence_mutex, it is released while waiting.
+ *
+ * @until:	time in milliseconds, -1 to wait until woken
+ */
+static void sequence_sleep(long long until)
+{
+	struct timespec ts;
+#ifdef HAVE_SYS_TIMERFD_H
+	struct itimerspec its = {{0, 0}, {0, 0}};
+	uint64_t expirations;
+
+	if (sequence_timer >= 0) {
+		/* a zero time disarms the timer */
+		if (until >= 0) {
+			its.it_value.tv_sec = until / 1000;
+			its.it_value.tv_nsec = until % 1000 * 1000000 + 1;
+		}
+		timerfd_settime(sequence_timer, TFD_TIMER_ABSTIME, &its, NULL);
+		pthread_mutex_unlock(&sequence_mutex);
+		if (read(sequence_timer, &expirations, sizeof(expirations)) < 0 &&
+		    errno != EINTR)
+			syslog(LOG_ERR, "Reading timer failed: %s\n",
+			       strerror(errno));
+		pthread_mutex_lock(&sequence_mutex);
+		return;
+	}
+#endif
+	if (until < 0) {
+		pthread_cond_wait(&sequence_wakeup, &sequence_mutex);
+		return;
+	}
+	ts.tv_sec = until / 1000;
+	ts.tv_nsec = until % 1000 * 1000000;
+	pthread_cond_timedwait(&sequence_wakeup, &sequence_mutex, &ts);
+}
+
+/**
+ * sequence_wake() - make the thread look at the runs
+ *
+ * The caller holds sequence_mutex.
+ */
+static void sequence_wake(void)
+{
+#ifdef HAVE_SYS_TIMERFD_H
+	struct itimerspec its = {{0, 0}, {0, 1}};
+
+	if (sequence_timer >= 0) {
+		timerfd_settime(sequence_timer, 0, &its, NULL);
+		return;
+	}
+#endif
+	pthread_cond_signal(&sequence_wakeup);
+}
+
+/**
+ * sequence_finish() - complete a step
+ *
+ * The caller holds sequence_mutex.
+ *
+ * @run:	run
+ * @p:		progress of the step
+ * @state:	SEQUENCE_DONE, SEQUENCE_FAILED or SEQUENCE_SKIPPED
+ * @now:	current time in milliseconds
+ */
+static void sequence_finish(struct sequence_run *run,
+			    struct sequence_progress *p,
+			    enum sequence_state state, long long now)
+{
+	p->state = state;
+	p->finished = now;
+	free(p->targets);
+	free(p->parts);
+	p->targets = NULL;
+	p->parts = NULL;
+	if (!--run->active)
+		pthread_cond_broadcast(&sequence_done);
+}
+
+/**
+ * sequence_advance() - start the steps whose time has come
+ *
+ * The caller holds sequence_mutex.
+ *
+ * @run:	run
+ * @now:	current time in milliseconds
+ * @next:	lowered to the time of the next scheduled step
+ */
+static void sequence_advance(struct sequence_run *run, long long now,
+			     long long *next)
+{
+	const struct sequence_step *step;
+	struct sequence_progress *p, *dep;
+	const char *missing;
+	bool changed = true;
+	long long due;
+	int i, j;
+
+	/* completing a step may make later steps ready */
+	while (changed) {
+		changed = false;
+		for (i = 0; i < run->seq->count; ++i) {
+			step = &run->seq->steps[i];
+			p = &run->steps[i];
+			if (p->state != SEQUENCE_WAITING)
+				continue;
+			due = run->start;
+			for (j = 0; j < step->nafter; ++j) {
+				dep = &run->steps[step->after[j]];
+				if (dep->state == SEQUENCE_FAILED ||
+				    dep->state == SEQUENCE_SKIPPED) {
+					due = -1;
+					break;
+				}
+				if (dep->state != SEQUENCE_DONE) {
+					due = 0;
+					break;
+				}
+				if (dep->finished > due)
+					due = dep->finished;
+			}
+			if (due < 0) {
+				sequence_finish(run, p, SEQUENCE_SKIPPED, now);
+				changed = true;
+			} else if (due) {
+				p->state = SEQUENCE_SCHEDULED;
+				p->due = due + step->delay;
+			}
+		}
+		for (i = 0; i < run->seq->count; ++i) {
+			p = &run->steps[i];
+			if (p->state != SEQUENCE_SCHEDULED)
+				continue;
+			if (p->due > now) {
+				if (*next < 0 || p->due < *next)
+					*next = p->due;
+				continue;
+			}
+			/* devices may have been plugged in since the start */
+			p->count = group_resolve(run->seq->steps[i].target,
+						 &p->targets, &missing);
+			p->parts = p->count > 0 ?
+				   calloc(p->count, sizeof(unsigned int)) :
+				   NULL;
+			if (!p->parts) {
+				if (missing)
+					syslog(LOG_WARNING, "Sequence %s: no "
+					       "device %s\n", run->seq->name,
+					       missing);
+				sequence_finish(run, p, SEQUENCE_FAILED, now);
+				changed = true;
+				continue;
+			}
+			p->state = SEQUENCE_SWITCHING;
+		}
+	}
+}
+
+/**
+ * sequence_merge() - add outlets to the targets of a command
+ *
+ * @merged:	targets, one per device
+ * @count:	number of targets
+ * @gb:		device
+ * @outlets:	outlets to add
+ */
+static void sequence_merge(struct gembird_target *merged, int *count,
+			   struct gembird *gb, unsigned int outlets)
+{
+	int i;
+
+	for (i = 0; i < *count && merged[i].gb != gb; ++i)
+		;
+	if (i == *count) {
+		memset(&merged[i], 0, sizeof(merged[i]));
+		merged[i].gb = gb;
+		++*count;
+	}
+	merged[i].outlets |= outlets;
+}
+
+/* find the target of a device */
+static const struct gembird_target *
+sequence_lookup(const struct gembird_target *merged, int count,
+		const struct gembird *gb)
+{
+	int i;
+
+	for (i = 0; i < count && merged[i].gb != gb; ++i)
+		;
+	return &merged[i];
+}
+
+/**
+ * sequence_switch() - switch the outlets of the running steps
+ *
+ * All steps switching outlets off or on are executed as one command each,
+ * so all devices are accessed concurrently. Outlets are switched on only as
+ * far as the inrush limit allows. The caller holds sequence_mutex, it is
+ * released while switching.
+ *
+ * @cmd:	GEMBIRD_ON or GEMBIRD_OFF
+ * @next:	lowered to the time when the inrush limit allows more
+ * Return:	true if steps completed
+ */
+static bool sequence_switch(enum gembird_cmd cmd, long long *next)
+{
+	const struct gembird_target *result;
+	struct gembird_target *merged = NULL, *grown;
+	struct sequence_progress *p;
+	struct sequence_run *run;
+	unsigned int bit, part;
+	int i, j, outlet, count = 0, size = 0, avail = -1, slot = 0;
+	bool completed = false, failed;
+	long long now = sequence_now();
+
+	if (cmd == GEMBIRD_ON && inrush_count)
+		for (i = 0, avail = 0; i < inrush_count; ++i)
+			avail += inrush_slots[i] <= now;
+
+	/* select the outlets to switch */
+	for (run = sequence_runs; run; run = run->next) {
+		for (i = 0; i < run->seq->count; ++i) {
+			p = &run->steps[i];
+			if (p->state != SEQUENCE_SWITCHING ||
+			    run->seq->steps[i].cmd != cmd)
+				continue;
+			for (j = 0; j < p->count; ++j) {
+				part = 0;
+				for (outlet = 1; outlet <= MAXOUTLET && avail;
+				     ++outlet) {
+					bit = 1U << outlet;
+					if (!(p->targets[j].outlets & bit))
+						continue;
+					part |= bit;
+					if (avail > 0)
+						--avail;
+				}
+				p->parts[j] = part;
+				if (!part)
+					continue;
+				if (count == size) {
+					size = size ? 2 * size : 16;
+					grown = realloc(merged, size *
+							sizeof(*merged));
+					if (!grown)
+						goto oom;
+					merged = grown;
+				}
+				sequence_merge(merged, &count,
+					       p->targets[j].gb, part);
+			}
+		}
+	}
+	if (!count)
+		goto wait;
+
+	pthread_mutex_unlock(&sequence_mutex);
+	if (gembird_apply(merged, count, cmd) < 0)
+		for (i = 0; i < count; ++i)
+			memset(merged[i].state, -1, sizeof(merged[i].state));
+	pthread_mutex_lock(&sequence_mutex);
+	now = sequence_now();
+
+	/* attribute the results to the steps */
+	for (run = sequence_runs; run; run = run->next) {
+		for (i = 0; i < run->seq->count; ++i) {
+			p = &run->steps[i];
+			if (p->state != SEQUENCE_SWITCHING ||
+			    run->seq->steps[i].cmd != cmd)
+				continue;
+			failed = false;
+			for (j = 0; j < p->count; ++j) {
+				if (!p->parts[j])
+					continue;
+				result = sequence_lookup(merged, count,
+							 p->targets[j].gb);
+				for (outlet = 1; outlet <= MAXOUTLET;
+				     ++outlet) {
+					bit = 1U << outlet;
+					if (!(p->parts[j] & bit))
+						continue;
+					if (result->state[outlet] < 0)
+						failed = true;
+					p->targets[j].outlets &= ~bit;
+					/* a slot per outlet switched on */
+					if (cmd != GEMBIRD_ON || !inrush_count)
+						continue;
+					while (inrush_slots[slot] > now)
+						++slot;
+					inrush_slots[slot] = now + inrush_ms;
+				}
+				p->parts[j] = 0;
+			}
+			for (j = 0; j < p->count && !p->targets[j].outlets;
+			     ++j)
+				;
+			if (failed || j == p->count) {
+				if (failed)
+					syslog(LOG_WARNING, "Sequence %s: step "
+					       "%s failed\n", run->seq->name,
+					       run->seq->steps[i].name);
+				sequence_finish(run, p, failed ?
+						SEQUENCE_FAILED :
+						SEQUENCE_DONE, now);
+				completed = true;
+			}
+		}
+	}
+wait:
+	free(merged);
+	/* wait for the next free slot if steps are left */
+	if (cmd == GEMBIRD_ON && inrush_count) {
+		for (run = sequence_runs; run; run = run->next)
+			for (i = 0; i < run->seq->count; ++i)
+				if (run->steps[i].state == SEQUENCE_SWITCHING &&
+				    run->seq->steps[i].cmd == cmd)
+					goto busy;
+	}
+	return completed;
+busy:
+	for (i = 0; i < inrush_count; ++i)
+		if (*next < 0 || inrush_slots[i] < *next)
+			*next = inrush_slots[i];
+	return completed;
+oom:
+	free(merged);
+	syslog(LOG_ERR, "Out of memory\n");
+	if (*next < 0 || now + 1000 < *next)
+		*next = now + 1000;
+	return false;
+}
+
+static void *sequence_thread(void *arg)
+{
+	struct sequence_run *run;
+	long long next;
+	bool completed;
+
+	pthread_mutex_lock(&sequence_mutex);
+	for (;;) {
+		do {
+			next = -1;
+			for (run = sequence_runs; run; run = run->next)
+				sequence_advance(run, sequence_now(), &next);
+			/* switching off first lowers the load */
+			completed = sequence_switch(GEMBIRD_OFF, &next);
+			completed |= sequence_switch(GEMBIRD_ON, &next);
+		} while (completed);
+		sequence_sleep(next);
+	}
+	return NULL;
+}
+
+/**
+ * sequence_start() - start the thread running the sequences
+ *
+ * Return:	0 on success, -1 on error
+ */
+static int sequence_start(void)
+{
+	static bool started;
+	pthread_condattr_t attr;
+	pthread_t thread;
+
+	if (started)
+		return 0;
+#ifdef HAVE_SYS_TIMERFD_H
+	sequence_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+#endif
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sequence_wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&thread, NULL, sequence_thread, NULL))
+		return -1;
+	pthread_detach(thread);
+	started = true;
+	return 0;
+}
+
+/**
+ * sequence_run() - run a sequence and wait for its completion
+ *
+ * Several sequences may run at the same time.
+ *
+ * @name:	sequence name
+ * @result:	buffer for the result, <step>=<state> pairs or an error
+ *		message
+ * @size:	size of the result buffer
+ * Return:	0 if all steps succeeded, 1 if steps failed, -1 on error
+ */
+int sequence_run(const char *name, char *result, size_t size)
+{
+	const struct sequence *seq;
+	struct sequence_run *run, **pos;
+	size_t len = 0;
+	int i, ret = 0;
+
+	for (seq = sequences; seq && strcmp(seq->name, name); seq = seq->next)
+		;
+	if (!seq) {
+		snprintf(result, size, "no sequence %s", name);
+		return -1;
+	}
+	run = calloc(1, sizeof(struct sequence_run));
+	if (run)
+		run->steps = calloc(seq->count, sizeof(*run->steps));
+	if (!run || !run->steps) {
+		free(run);
+		snprintf(result, size, "out of memory");
+		return -1;
+	}
+	run->seq = seq;
+	run->active = seq->count;
+
+	pthread_mutex_lock(&sequence_mutex);
+	if (sequence_start()) {
+		pthread_mutex_unlock(&sequence_mutex);
+		free(run->steps);
+		free(run);
+		snprintf(result, size, "cannot start sequencing thread");
+		return -1;
+	}
+	run->start = sequence_now();
+	run->next = sequence_runs;
+	sequence_runs = run;
+	sequence_wake();
+	while (run->active)
+		pthread_cond_wait(&sequence_done, &sequence_mutex);
+	for (pos = &sequence_runs; *pos != run; pos = &(*pos)->next)
+		;
+	*pos = run->next;
+	pthread_mutex_unlock(&sequence_mutex);
+
+	*result = '\0';
+	for (i = 0; i < seq->count; ++i) {
+		if (run->steps[i].state != SEQUENCE_DONE)
+			ret = 1;
+		if (len < size)
+			len += snprintf(result + len, size - len, "%s%s=%s",
+					len ? " " : "", seq->steps[i].name,
+					sequence_states[run->steps[i].state]);
+	}
+	free(run->steps);
+	free(run);
+	return ret;
+}
@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Power sequencing
+ */
+
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <stddef.h>
+
+/* File with the sequence definitions */
+#define SEQUENCE_FILE "/etc/sispmctl/sequences"
+
+int sequence_load(const char *path);
+int sequence_run(const char *name, char *result, size_t size);
+
+#endif /* SEQUENCE_H */
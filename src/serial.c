@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Cache of serial numbers
+ *
+ * Reading the serial number requires claiming the device. To avoid this on
+ * every invocation serial numbers are kept in a small file in the runtime
+ * directory, $XDG_RUNTIME_DIR/sispmctl.serials or /run/sispmctl/serials. It
+ * is cleared on reboot. Entries are keyed by USB bus, device number and
+ * device descriptor. The kernel assigns increasing device numbers, so a
+ * replugged device gets a new entry. Simulated devices are never cached,
+ * they must not mix with real ones.
+ *
+ * Each line of the file reads
+ *	<bus> <device> <vendor>:<product>:<release> <serial>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "sispm_ctl.h"
+#include "serial.h"
+
+#define SERIAL_CACHE_DIR "/run/sispmctl"
+#define SERIAL_CACHE_FILE "serials"
+/* Maximum number of entries kept */
+#define SERIAL_CACHE_ENTRIES 64
+#define SERIAL_LINESIZE 256
+
+/**
+ * serial_cache_path() - get path of the cache file
+ *
+ * @path:	buffer for the path
+ * @size:	size of the buffer
+ * @create:	create the directory if needed
+ * Return:	0 on success, -1 if there is no suitable directory or the
+ *		devices are simulated
+ */
+static int serial_cache_path(char *path, size_t size, bool create)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+
+	if (!strcmp(transport_name(), "sim"))
+		return -1;
+	if (dir && *dir) {
+		snprintf(path, size, "%s/sispmctl.%s", dir, SERIAL_CACHE_FILE);
+		return 0;
+	}
+	if (create && mkdir(SERIAL_CACHE_DIR, 0755) && errno != EEXIST)
+		return -1;
+	snprintf(path, size, "%s/%s", SERIAL_CACHE_DIR, SERIAL_CACHE_FILE);
+	return 0;
+}
+
+/**
+ * serial_cache_open() - open the cache file
+ *
+ * Files not owned by the current user or writable by others are ignored.
+ *
+ * @path:	path of the cache file
+ * Return:	stream or NULL
+ */
+static FILE *serial_cache_open(const char *path)
+{
+	struct stat st;
+	FILE *file;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || st.st_uid != geteuid() ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+	file = fdopen(fd, "r");
+	if (!file)
+		close(fd);
+	return file;
+}
+
+static void serial_key(struct transport_dev *dev, char *key, size_t size)
+{
+	snprintf(key, size, "%s %s %04x:%04x:%04x ", dev->bus,
+		 dev->filename, dev->vendor,
+		 dev->product, dev->release);
+}
+
+/**
+ * serial_lookup() - look up serial number in the cache
+ *
+ * @dev:	device
+ * @serial:	buffer of SERIALSIZE bytes for the serial number
+ * Return:	0 if found, -1 otherwise
+ */
+int serial_lookup(struct transport_dev *dev, char *serial)
+{
+	char path[SERIAL_LINESIZE];
+	char line[SERIAL_LINESIZE];
+	char key[SERIAL_LINESIZE];
+	size_t len;
+	FILE *file;
+	int ret = -1;
+
+	if (serial_cache_path(path, sizeof(path), false))
+		return -1;
+	file = serial_cache_open(path);
+	if (!file)
+		return -1;
+	serial_key(dev, key, sizeof(key));
+	len = strlen(key);
+	while (fgets(line, sizeof(line), file)) {
+		if (strncmp(line, key, len))
+			continue;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (strlen(line + len) != SERIALSIZE - 1)
+			continue;
+		memcpy(serial, line + len, SERIALSIZE);
+		ret = 0;
+		break;
+	}
+	fclose(file);
+	if (!ret && debug)
+		fprintf(stderr, "Serial number %s of USB device %s:%s cached\n",
+			serial, dev->bus, dev->filename);
+	return ret;
+}
+
+/**
+ * serial_store() - add serial number to the cache
+ *
+ * Failures are ignored, the cache is only an optimization.
+ *
+ * @dev:	device
+ * @serial:	serial number
+ */
+void serial_store(struct transport_dev *dev, const char *serial)
+{
+	char path[SERIAL_LINESIZE];
+	char tmp[SERIAL_LINESIZE + 8];
+	char line[SERIAL_LINESIZE];
+	char key[SERIAL_LINESIZE];
+	char *lines[SERIAL_CACHE_ENTRIES];
+	int i, count = 0;
+	size_t len;
+	FILE *file;
+	int fd;
+
+	if (serial_cache_path(path, sizeof(path), true))
+		return;
+	serial_key(dev, key, sizeof(key));
+	len = strlen(key);
+
+	/* keep the most recent entries for other devices */
+	file = serial_cache_open(path);
+	if (file) {
+		while (fgets(line, sizeof(line), file)) {
+			if (!strncmp(line, key, len) || !strchr(line, '\n'))
+				continue;
+			if (count == SERIAL_CACHE_ENTRIES - 1) {
+				free(lines[0]);
+				memmove(lines, lines + 1,
+					--count * sizeof(char *));
+			}
+			lines[count] = strdup(line);
+			if (lines[count])
+				++count;
+		}
+		fclose(file);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+	file = fd < 0 ? NULL : fdopen(fd, "w");
+	if (file) {
+		for (i = 0; i < count; ++i)
+			fputs(lines[i], file);
+		fprintf(file, "%s%s\n", key, serial);
+		if (fclose(file) || rename(tmp, path))
+			unlink(tmp);
+	} else if (fd >= 0) {
+		close(fd);
+		unlink(tmp);
+	}
+	for (i = 0; i < count; ++i)
+		free(lines[i]);
+}
+
+/**
+ * serial_get() - get serial number from the cache or the device
+ *
+ * @dev:	device
+ * @serial:	buffer of SERIALSIZE bytes for the serial number, set to an
+ *		empty string if the serial number cannot be determined
+ * Return:	0 on success, -1 on error
+ */
+int serial_get(struct transport_dev *dev, char *serial)
+{
+	struct transport_handle *udev;
+	int ret;
+
+	if (!serial_lookup(dev, serial))
+		return 0;
+	serial[0] = '\0';
+	udev = get_handle(dev);
+	if (!udev)
+		return -1;
+	ret = sispm_get_serial(udev, serial);
+	transport_close(udev);
+	if (ret) {
+		serial[0] = '\0';
+		return -1;
+	}
+	serial_store(dev, serial);
+	return 0;
+}
@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Cache of serial numbers
+ */
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "transport.h"
+
+int serial_lookup(struct transport_dev *dev, char *serial);
+void serial_store(struct transport_dev *dev, const char *serial);
+int serial_get(struct transport_dev *dev, char *serial);
+
+#endif /* SERIAL_H */
@@ -0,0 +1,85 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0+
+#
+# Checks of the command line against simulated devices
+#
+# Each invocation starts with fresh simulated devices, so every check
+# switches or programs and reads back within a single invocation. The
+# control socket points to a path without a daemon, the devices are always
+# accessed directly.
+
+SISPMCTL=${SISPMCTL:-./sispmctl}
+SISPMCTL_SIM=pms2,sispm
+SISPMCTL_SOCKET=${TMPDIR:-/tmp}/sispmctl-check-$$.sock
+# nothing is left behind in the runtime directory of the user
+XDG_RUNTIME_DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$XDG_RUNTIME_DIR"' EXIT
+export SISPMCTL_SIM SISPMCTL_SOCKET XDG_RUNTIME_DIR
+
+PMS2=53:49:4d:00:01
+SISPM=53:49:4d:00:02
+status=0
+
+# check <name> <expected output> <output>
+check() {
+	if [ "$3" = "$2" ]; then
+		echo "PASS: $1"
+	else
+		echo "FAIL: $1"
+		echo "expected:"
+		echo "$2"
+		echo "got:"
+		echo "$3"
+		status=1
+	fi
+}
+
+# the dates of a schedule read back are left out
+events() {
+	sed -n -e 's/^  On .* switch on$/on/p' -e 's/^  On .* switch off$/off/p'
+}
+
+check "switch and status" "on
+off
+on" "$("$SISPMCTL" -q -o 1 -g 1 -f 1 -g 1 -t 2 -g 2 2>&1)"
+
+check "numeric status of a device by serial" "1
+1
+1
+1" "$("$SISPMCTL" -q -n -D $SISPM -o all -g all 2>&1)"
+
+check "batch" "1 ok 1=on 3=on
+2 ok 1=on 2=off 3=on 4=off
+4 error unknown command bogus" \
+	"$(printf 'on 1,3\nstatus all\n# comment\nbogus 1\n' |
+	   "$SISPMCTL" -q -B - 2>&1)"
+
+check "power supply" "on
+off
+on" "$(SISPMCTL_SIM=pms2,sispm,nopower=2 "$SISPMCTL" -q -m 1 -m 2 -d 1 \
+	-m 1 2>&1)"
+
+for dev in 0 1; do
+	check "schedule readback of device $dev" "on
+off" "$("$SISPMCTL" -d $dev -A 2 --Aafter 5 --Ado on --Aafter 10 \
+		--Ado off 2>&1 | events)"
+done
+
+FLEET=${TMPDIR:-/tmp}/sispmctl-check-$$.fleet
+printf '%s\n' "$PMS2/1 after 5 on after 10 off" \
+	"$SISPM/2,3 after 60 on after 60 off loop 1440" > "$FLEET"
+check "schedules of a fleet" "$PMS2/1 programmed
+$SISPM/2 programmed
+$SISPM/3 programmed" "$("$SISPMCTL" -q -F "$FLEET" 2>&1)"
+
+# eight pairs of long waits do not fit into the buffer of a SiS-PM
+line="$SISPM/1"
+for i in 1 2 3 4 5 6 7 8; do
+	line="$line after 20000 on after 20000 off"
+done
+printf '%s\n' "$PMS2/1 after 5 on" "$line" > "$FLEET"
+"$SISPMCTL" -q -F "$FLEET" >/dev/null 2>&1
+check "schedule too large for a device" "1" "$?"
+rm -f "$FLEET"
+
+exit $status
@@ -26,44 +26,242 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <string.h>
+#include <syslog.h>
 #include <wchar.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
-#include <usb.h>
 #include <assert.h>
 #include "sispm_ctl.h"
+#include "metrics.h"
+
+char serial_id[SERIALSIZE];
+
+/* Terminate on USB errors. Long running processes report them instead. */
+int usb_exit_on_error = 1;
+
+/* Retry policy of control transfers */
+struct usb_retry usb_retry = {
+	.tries = USB_TRIES,
+	.timeout = USB_TIMEOUT,
+	.deadline = USB_DEADLINE,
+};
+
+/**
+ * struct usb_latency - response time of a device
+ *
+ * @count:	number of transfers measured
+ * @avg:	moving average of the response time in microseconds
+ * @slow:	the device was reported as slow
+ */
+struct usb_latency {
+	unsigned long count;
+	long long avg;
+	bool slow;
+};
+
+static pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int get_id(struct transport_dev *dev)
+{
+  assert(dev!=0);
+  return dev->product;
+}
 
-char serial_id[15];
+static long long now_us(void)
+{
+	struct timespec ts;
 
-int get_id(struct usb_device *dev)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * usb_retry_parse() - set the retry policy
+ *
+ * @arg:	tries[:timeout[:deadline]], times in milliseconds
+ * Return:	0 on success, -1 for invalid values
+ */
+int usb_retry_parse(const char *arg)
 {
-  assert(dev!=0);
-  return dev->descriptor.idProduct;
+	struct usb_retry retry = usb_retry;
+	char *end;
+
+	retry.tries = strtol(arg, &end, 10);
+	if (*end == ':')
+		retry.timeout = strtol(end + 1, &end, 10);
+	if (*end == ':')
+		retry.deadline = strtol(end + 1, &end, 10);
+	if (*end || retry.tries < 1 || retry.timeout < 1 || retry.deadline < 1)
+		return -1;
+	usb_retry = retry;
+	return 0;
+}
+
+/**
+ * usb_latency() - get latency statistics of a device
+ *
+ * The statistics are allocated on first use. The caller must hold
+ * latency_mutex.
+ *
+ * @dev:	device
+ * Return:	statistics, NULL if out of memory
+ */
+static struct usb_latency *usb_latency(struct transport_dev *dev)
+{
+	if (!dev->latency)
+		dev->latency = calloc(1, sizeof(struct usb_latency));
+	return dev->latency;
 }
 
-static int usb_control_msg_tries(usb_dev_handle *dev, int requesttype,
+/**
+ * usb_latency_timeout() - get timeout of the first attempt of a transfer
+ *
+ * Devices answer within milliseconds. A multiple of the average latency
+ * detects a wedged device much earlier than the maximum timeout.
+ *
+ * @dev:	device
+ * Return:	timeout in milliseconds
+ */
+static int usb_latency_timeout(struct transport_dev *dev)
+{
+	struct usb_latency *lat;
+	long long timeout = USB_TIMEOUT_START;
+
+	pthread_mutex_lock(&latency_mutex);
+	lat = usb_latency(dev);
+	if (lat && lat->count) {
+		timeout = USB_LATENCY_FACTOR * lat->avg / 1000;
+		if (timeout < USB_TIMEOUT_MIN)
+			timeout = USB_TIMEOUT_MIN;
+	}
+	pthread_mutex_unlock(&latency_mutex);
+	return timeout;
+}
+
+/**
+ * usb_latency_update() - add a sample to the latency statistics
+ *
+ * Changes between normal and slow response are logged.
+ *
+ * @dev:	device
+ * @us:		duration of the transfer in microseconds
+ */
+static void usb_latency_update(struct transport_dev *dev, long long us)
+{
+	struct usb_latency *lat;
+	bool slow = false, fast = false;
+	long long avg = 0;
+
+	pthread_mutex_lock(&latency_mutex);
+	lat = usb_latency(dev);
+	if (lat) {
+		/* exponentially weighted moving average with weight 1/8 */
+		if (lat->count++)
+			lat->avg += (us - lat->avg) / 8;
+		else
+			lat->avg = us;
+		avg = lat->avg;
+		if (!lat->slow && avg > USB_SLOW * 1000LL)
+			slow = lat->slow = true;
+		else if (lat->slow && avg < USB_SLOW * 500LL)
+			fast = !(lat->slow = false);
+	}
+	pthread_mutex_unlock(&latency_mutex);
+
+	if (slow) {
+		syslog(LOG_WARNING, "USB device %s:%s responds slowly (%lld ms)\n",
+		       dev->bus, dev->filename, avg / 1000);
+		if (debug)
+			fprintf(stderr, "USB device %s:%s responds slowly "
+				"(%lld ms)\n", dev->bus,
+				dev->filename, avg / 1000);
+	} else if (fast) {
+		syslog(LOG_INFO, "USB device %s:%s responds normally again\n",
+		       dev->bus, dev->filename);
+	}
+}
+
+/**
+ * usb_control_msg_tries() - control transfer with retries
+ *
+ * Errors are handled according to their kind:
+ *
+ * * A missing device (-ENODEV) is reported at once.
+ * * A stall (-EPIPE) is cleared by the next setup packet, the transfer is
+ *   repeated at once.
+ * * After a timeout (-ETIMEDOUT) the timeout is doubled.
+ * * Short transfers and other errors are repeated with exponential backoff.
+ *
+ * The number of attempts and the overall duration are limited by usb_retry.
+ * Duration, retries and failures are recorded in the metrics of @op.
+ *
+ * @dev:	handle
+ * @requesttype:	request type
+ * @request:	request
+ * @value:	value
+ * @index:	index
+ * @bytes:	data buffer
+ * @size:	size of the data
+ * @limit:	maximum timeout of a single attempt in milliseconds
+ * @op:		operation for the metrics
+ * Return:	number of bytes transferred or negative error code
+ */
+static int usb_control_msg_tries(struct transport_handle *dev, int requesttype,
 				 int request, int value, int index,
-				 char *bytes, size_t size, int timeout)
+				 char *bytes, size_t size, int limit,
+				 enum metrics_op op)
 {
-	int ret;
-	char buf[64];
+	struct transport_dev *device = dev->dev;
+	long long start, begin, remaining;
+	int timeout, backoff = USB_BACKOFF;
+	int ret = -ETIMEDOUT;
+	unsigned char buf[TRANSPORT_MAXDATA];
 
 	if (size > sizeof(buf)) {
 		return -1;
 	}
 
-	for (int i = 0; i < 5; ++i) {
-		usleep(500 * i);
+	if (limit > usb_retry.timeout)
+		limit = usb_retry.timeout;
+	timeout = usb_latency_timeout(device);
+	if (timeout > limit)
+		timeout = limit;
+	start = now_us();
+	for (int i = 0; i < usb_retry.tries; ++i) {
+		remaining = usb_retry.deadline - (now_us() - start) / 1000;
+		if (remaining <= 0)
+			break;
+		if (i)
+			metrics_usb_retry(device, op, ret);
 		memcpy(buf, bytes, size);
-		ret = usb_control_msg(dev, requesttype, request, value, index,
-				      buf, size, timeout);
+		begin = now_us();
+		ret = transport_control(dev, requesttype, request, value, index,
+					buf, size,
+					timeout < remaining ? timeout : remaining);
 		if (ret == size) {
+			usb_latency_update(device, now_us() - begin);
+			break;
+		}
+		if (debug)
+			fprintf(stderr, "USB transfer to %s:%s failed (%d), "
+				"attempt %d\n", device->bus,
+				device->filename, ret, i + 1);
+		if (ret == -ENODEV)
 			break;
+		if (ret == -ETIMEDOUT) {
+			usb_latency_update(device, now_us() - begin);
+			timeout = 2 * timeout < limit ? 2 * timeout : limit;
+		} else if (ret != -EPIPE) {
+			usleep(1000 * backoff);
+			backoff *= 2;
 		}
 	}
 
+	metrics_usb(device, op, now_us() - start, ret == size);
 	memcpy(bytes, buf, size);
 
 	return ret;
@@ -72,7 +270,7 @@ static int usb_control_msg_tries(usb_dev_handle *dev, int requesttype,
 
 
 // for identification: reqtype=a1, request=01, b1=0x01, size=5
-char *get_serial(usb_dev_handle *udev)
+int sispm_get_serial(struct transport_handle *udev, char *serial)
 {
   int  reqtype=0xa1; //USB_DIR_OUT + USB_TYPE_CLASS + USB_RECIP_INTERFACE /* request type */,
   int  req=0x01;
@@ -85,19 +283,32 @@ char *get_serial(usb_dev_handle *udev)
                             0,                  /* index  */
                             (char *)buffer,     /* bytes  */
                             5,                  /* size   */
-                            5000) < 2 ) {
+                            5000,
+                            METRICS_SERIAL) < 2 ) {
+    if (!usb_exit_on_error) {
+      fprintf(stderr, "Error reading serial number\n"
+              "Libusb error string: %s\n", transport_strerror());
+      return -1;
+    }
     fprintf(stderr, "Error performing requested action\n"
-            "Libusb error string: %s\nTerminating\n", usb_strerror());
-    usb_close (udev);
+            "Libusb error string: %s\nTerminating\n", transport_strerror());
+    transport_close(udev);
     exit(-5);
   }
 
-  snprintf(serial_id, 15, "%02x:%02x:%02x:%02x:%02x", buffer[0], buffer[1],
-           buffer[2], buffer[3], buffer[4]);
+  snprintf(serial, SERIALSIZE, "%02x:%02x:%02x:%02x:%02x", buffer[0],
+           buffer[1], buffer[2], buffer[3], buffer[4]);
+  return 0;
+}
+
+char *get_serial(struct transport_handle *udev)
+{
+  if (sispm_get_serial(udev, serial_id))
+    return NULL;
   return serial_id;
 }
 
-int usb_command(usb_dev_handle *udev, int b1, int b2, int return_value_expected)
+int usb_command(struct transport_handle *udev, int b1, int b2, int return_value_expected)
 {
   int  reqtype=0x21; //USB_DIR_OUT + USB_TYPE_CLASS + USB_RECIP_INTERFACE /* request type */,
   int  req=0x09;
@@ -116,43 +327,177 @@ int usb_command(usb_dev_handle *udev, int b1, int b2, int return_value_expected)
                             0,                  /* index  */
                             buffer,             /* bytes  */
                             5,                  /* size   */
-                            5000) < 2 ) {
+                            5000,
+                            return_value_expected ? METRICS_STATUS :
+                                                    METRICS_SWITCH) < 2 ) {
+    if (!usb_exit_on_error) {
+      fprintf(stderr, "Error performing requested action\n"
+              "Libusb error string: %s\n", transport_strerror());
+      return -1;
+    }
     fprintf(stderr, "Error performing requested action\n"
-            "Libusb error string: %s\nTerminating\n", usb_strerror());
-    usb_close (udev);
+            "Libusb error string: %s\nTerminating\n", transport_strerror());
+    transport_close(udev);
     exit(-5);
   }
 
-  return buffer[1];//(buffer[1]!=0)?1:0;
+  return (unsigned char)buffer[1];//(buffer[1]!=0)?1:0;
+}
+
+/**
+ * usb_query_init() - prepare an asynchronous request
+ *
+ * @query:	query
+ * @udev:	handle
+ * @b1:		first byte of the request
+ * @b2:		second byte of the request
+ * @in:		the request reads from the device
+ * @size:	size of the data stage
+ */
+static void usb_query_init(struct usb_query *query,
+                           struct transport_handle *udev, int b1, int b2,
+                           int in, size_t size)
+{
+  struct transport_xfer *xfer = &query->xfer;
+  int timeout = usb_latency_timeout(udev->dev);
+
+  memset(xfer, 0, sizeof(*xfer));
+  query->b1 = b1;
+  query->b2 = b2;
+  xfer->th = udev;
+  xfer->requesttype = in ? 0x21 | USB_DIR_IN : 0x21;
+  xfer->request = in ? 0x01 : 0x09;
+  xfer->value = (0x03 << 8) | b1;
+  xfer->size = size;
+  xfer->timeout = timeout < usb_retry.timeout ? timeout : usb_retry.timeout;
+  xfer->data[0] = b1;
+  xfer->data[1] = b2;
+}
+
+/**
+ * usb_query_send() - submit a request prepared by usb_query_init()
+ *
+ * @query:	query, must stay allocated until its result is collected
+ * Return:	0 on success, negative error number otherwise
+ */
+static int usb_query_send(struct usb_query *query)
+{
+  struct transport_xfer *xfer = &query->xfer;
+  int ret;
+
+  query->start = metrics_now();
+  ret = transport_submit(xfer);
+  if (ret) {
+    xfer->result = ret;
+    xfer->done = 1;
+  }
+  return ret;
+}
+
+/**
+ * usb_query_start() - start an asynchronous request
+ *
+ * If the request cannot be submitted usb_query_result() falls back to a
+ * synchronous transfer.
+ *
+ * @query:	query, must stay allocated until usb_query_result() returns
+ * @udev:	handle
+ * @b1:		first byte of the request
+ * @b2:		second byte of the request
+ * @in:		the request reads from the device
+ * Return:	0 on success, negative error number otherwise
+ */
+static int usb_query_start(struct usb_query *query,
+                           struct transport_handle *udev, int b1, int b2,
+                           int in)
+{
+  usb_query_init(query, udev, b1, b2, in, 5);
+  return usb_query_send(query);
+}
+
+/**
+ * usb_query_submit() - start an asynchronous status query
+ *
+ * Queries to several devices are processed concurrently.
+ *
+ * @query:	query, must stay allocated until usb_query_result() returns
+ * @udev:	handle
+ * @b1:		first byte of the request, 3 * outlet
+ * Return:	0 on success, negative error number otherwise
+ */
+int usb_query_submit(struct usb_query *query, struct transport_handle *udev,
+                     int b1)
+{
+  return usb_query_start(query, udev, b1, 0x03, 1);
+}
+
+/**
+ * usb_switch_submit() - start switching an outlet asynchronously
+ *
+ * Requests to one device are queued and sent back-to-back, requests to
+ * several devices are processed concurrently.
+ *
+ * @query:	query, must stay allocated until usb_query_result() returns
+ * @udev:	handle
+ * @b1:		first byte of the request, 3 * outlet
+ * @on:		switch on if non-zero, off otherwise
+ * Return:	0 on success, negative error number otherwise
+ */
+int usb_switch_submit(struct usb_query *query, struct transport_handle *udev,
+                      int b1, int on)
+{
+  return usb_query_start(query, udev, b1, on ? 0x03 : 0x00, 0);
+}
+
+/**
+ * usb_query_result() - wait for a status query or switch
+ *
+ * A failed request is repeated synchronously according to the retry policy.
+ *
+ * @query:	query started by usb_query_submit() or usb_switch_submit()
+ * Return:	result as of usb_command()
+ */
+int usb_query_result(struct usb_query *query)
+{
+  int in = query->xfer.requesttype & USB_DIR_IN;
+  enum metrics_op op = in ? METRICS_STATUS : METRICS_SWITCH;
+
+  transport_wait(&query->xfer);
+  if (query->xfer.result < 2) {
+    metrics_usb_retry(query->xfer.th->dev, op, query->xfer.result);
+    return usb_command(query->xfer.th, query->b1, query->b2, in);
+  }
+  metrics_usb(query->xfer.th->dev, op, metrics_now() - query->start, true);
+  return (unsigned char)query->xfer.data[1];
 }
 
 
-usb_dev_handle *get_handle(struct usb_device*dev)
+struct transport_handle *get_handle(struct transport_dev *dev)
 {
-  usb_dev_handle *udev=NULL;
+  struct transport_handle *udev=NULL;
   if(!dev)
     return NULL;
-  udev = usb_open(dev);
+  udev = transport_open(dev);
 
   /* prepare USB access */
   if (!udev) {
-    fprintf(stderr, "Unable to open USB device %s\n", usb_strerror());
+    fprintf(stderr, "Unable to open USB device %s\n", transport_strerror());
     return NULL;
   }
-  if (usb_set_configuration(udev, 1)) {
-    fprintf(stderr, "USB set configuration %s\n", usb_strerror());
-    usb_close (udev);
+  if (transport_set_configuration(udev, 1)) {
+    fprintf(stderr, "USB set configuration %s\n", transport_strerror());
+    transport_close(udev);
     return NULL;
   }
-  if (usb_claim_interface(udev, 0)) {
+  if (transport_claim_interface(udev, 0)) {
     fprintf(stderr, "USB claim interface %s\nMaybe device already in use?\n",
-            usb_strerror());
-    usb_close(udev);
+            transport_strerror());
+    transport_close(udev);
     return NULL;
   }
-  if (usb_set_altinterface(udev, 0)) {
-    fprintf(stderr, "USB set alt interface %s\n", usb_strerror());
-    usb_close (udev);
+  if (transport_set_altinterface(udev, 0)) {
+    fprintf(stderr, "USB set alt interface %s\n", transport_strerror());
+    transport_close(udev);
     return NULL;;
   }
   return udev;
@@ -190,46 +535,55 @@ int check_outlet_number(int id, int outlet)
   return outlet;
 }
 
-int sispm_switch_on(usb_dev_handle *udev, int id, int outlet)
+int sispm_switch_on(struct transport_handle *udev, int id, int outlet)
 {
   outlet=check_outlet_number(id, outlet);
   return usb_command(udev, 3 * outlet, 0x03, 0 ) ;
 }
 
-int sispm_switch_off(usb_dev_handle *udev, int id, int outlet)
+int sispm_switch_off(struct transport_handle *udev, int id, int outlet)
 {
   outlet=check_outlet_number(id, outlet);
   return usb_command(udev, 3 * outlet, 0x00, 0 );
 }
 
-int sispm_switch_toggle(usb_dev_handle *udev, int id, int outlet)
+int sispm_switch_toggle(struct transport_handle *udev, int id, int outlet)
 {
-  if (!sispm_switch_getstatus(udev, id, outlet)) { //on
-    sispm_switch_on(udev, id, outlet);
+  int result;
+
+  result = sispm_switch_getstatus(udev, id, outlet);
+  if (result < 0)
+    return result;
+  if (!result) { //on
+    if (sispm_switch_on(udev, id, outlet) < 0)
+      return -1;
     return 1;
   } else {
-    sispm_switch_off(udev, id, outlet);
+    if (sispm_switch_off(udev, id, outlet) < 0)
+      return -1;
     return 0;
   }
-
-  return 0;
 }
 
-int sispm_switch_getstatus(usb_dev_handle * udev, int id, int outlet)
+int sispm_switch_getstatus(struct transport_handle *udev, int id, int outlet)
 {
   int result;
 
   outlet=check_outlet_number(id, outlet);
   result=(usb_command(udev, 3 * outlet, 0x03, 1)); //take bit 1, which gives the relais status
+  if (result < 0)
+    return result;
   return result & 1;
 }
 
-int sispm_get_power_supply_status(usb_dev_handle *udev, int id, int outlet)
+int sispm_get_power_supply_status(struct transport_handle *udev, int id, int outlet)
 {
   int result;
 
   outlet = check_outlet_number(id, outlet);
   result = usb_command(udev, 3 * outlet, 0x03, 1); //take bit 0, which gives the power supply status
+  if (result < 0)
+    return result;
   return (result >> 1) & 1;
 }
 
@@ -374,14 +728,24 @@ void plannif_scanf(struct plannif *plan, const unsigned char *buffer)
 
 }
 
-// queries the device, and fills the schedule structure
-void usb_command_getplannif(usb_dev_handle *udev, int socket,
-                            struct plannif *plan)
+// private : fills the schedule structure from the buffer read from the device
+static void plannif_decode(struct transport_handle *udev,
+                           const unsigned char *buffer, struct plannif *plan)
+{
+  plannif_reset(plan);
+  if (get_id(udev->dev) == PRODUCT_ID_SISPM_EG_PMS2)
+    pms2_buffer_to_schedule(buffer, plan);
+  else
+    plannif_scanf(plan, buffer);
+}
+
+// queries the device, and fills the schedule structure, -1 on error
+int usb_command_getplannif(struct transport_handle *udev, int socket,
+                           struct plannif *plan)
 {
   int reqtype = 0x21 | USB_DIR_IN; /* request type */
   int req = 0x01;
   unsigned char buffer[0x28];
-  unsigned int id;
 
   if (usb_control_msg_tries(udev,                               /* handle */
                             reqtype,
@@ -390,10 +754,16 @@ void usb_command_getplannif(usb_dev_handle *udev, int socket,
                             0,                                  /* index  */
                             (char *)buffer,                     /* bytes  */
                             0x28,                               /* size   */
-                            5000) < 0x27 ) {
+                            5000,
+                            METRICS_SCHEDULE_READ) < 0x27 ) {
+    if (!usb_exit_on_error) {
+      fprintf(stderr, "Error reading schedule\n"
+              "Libusb error string: %s\n", transport_strerror());
+      return -1;
+    }
     fprintf(stderr, "Error performing requested action\n"
-            "Libusb error string: %s\nTerminating\n", usb_strerror());
-    usb_close(udev);
+            "Libusb error string: %s\nTerminating\n", transport_strerror());
+    transport_close(udev);
     exit(-5);
   }
 
@@ -404,15 +774,12 @@ void usb_command_getplannif(usb_dev_handle *udev, int socket,
   printf("\n");
   // */
 
-  id = get_id(usb_device(udev));
-  if (id == PRODUCT_ID_SISPM_EG_PMS2)
-    pms2_buffer_to_schedule(buffer, plan);
-  else
-    plannif_scanf(plan, buffer);
+  plannif_decode(udev, buffer, plan);
+  return 0;
 }
 
-// private : prints the buffer according to the schedule structure
-void plannif_printf(const struct plannif *plan, unsigned char *buffer)
+// prints the buffer according to the schedule structure, -1 if it does not fit
+int plannif_printf(const struct plannif *plan, unsigned char *buffer)
 {
   int bufindex = 0;
   ulong nextWord, time4next;
@@ -470,49 +837,127 @@ void plannif_printf(const struct plannif *plan, unsigned char *buffer)
       nextWord = time4next | (plan->actions[actionNo].switchOn << 15);
     WRITENEXTWORD;
   }
+  return 0;
+}
+
+// prepares the 0x28 byte buffer of a device with the given product id,
+// -1 if the device cannot store the schedule
+int plannif_encode(int id, const struct plannif *plan, unsigned char *buffer)
+{
+  if (id == PRODUCT_ID_SISPM_EG_PMS2)
+    return pms2_schedule_to_buffer(plan, buffer);
+  return plannif_printf(plan, buffer);
 }
 
-// prepares the buffer according to plannif and sends it to the device
-void usb_command_setplannif(usb_dev_handle *udev, struct plannif* plan)
+// private : sends a schedule buffer to the device, -1 on error
+static int plannif_send(struct transport_handle *udev, int socket,
+                        unsigned char *buffer)
 {
   int reqtype=0x21; //USB_DIR_OUT + USB_TYPE_CLASS + USB_RECIP_INTERFACE /*request type*/,
   int req=0x09;
   unsigned char buffer_size = 0x27;
-  unsigned char buffer[0x28];
-  unsigned int id;
-
-  id = get_id(usb_device(udev));
-  if (id == PRODUCT_ID_SISPM_EG_PMS2) {
-    if (pms2_schedule_to_buffer(plan, buffer))
-        exit(-2);
-  } else {
-    buffer_size = 0x27;
-    plannif_printf(plan, buffer);
-  }
 
   /*// debug
   int n;
   for(n = 0 ; n < 0x27 ; n++)
     printf("%02x ", (unsigned char)buffer[n]);
   printf("\n");
-  plannif_reset(plan);
-  plannif_scanf(plan, &buffer[0]);
-  plannif_display(plan, 0, NULL);
-  exit(0);
   //*/
   if (usb_control_msg_tries(udev,                                  /* handle */
                             reqtype,
                             req,
-                            ((0x03 << 8) | (3 * plan->socket)) + 1,
+                            ((0x03 << 8) | (3 * socket)) + 1,
                             0,                                      /* index */
                             (char *) buffer,                        /* bytes */
                             buffer_size,                            /* size  */
-                            5000) < buffer_size ) {
+                            5000,
+                            METRICS_SCHEDULE_WRITE) < buffer_size ) {
+    if (!usb_exit_on_error) {
+      fprintf(stderr, "Error writing schedule\n"
+              "Libusb error string: %s\n", transport_strerror());
+      return -1;
+    }
     fprintf(stderr, "Error performing requested action\n"
-            "Libusb error string: %s\nTerminating\n", usb_strerror());
-    usb_close (udev);
+            "Libusb error string: %s\nTerminating\n", transport_strerror());
+    transport_close(udev);
     exit(-5);
   }
+  return 0;
+}
+
+// prepares the buffer according to plannif and sends it to the device, -1 on error
+int usb_command_setplannif(struct transport_handle *udev, struct plannif* plan)
+{
+  unsigned char buffer[0x28];
+
+  if (plannif_encode(get_id(udev->dev), plan, buffer)) {
+    fprintf(stderr, "Error : too many planification items, "
+            "or combined with large time intervals\n");
+    if (!usb_exit_on_error)
+      return -1;
+    exit(2);
+  }
+  return plannif_send(udev, plan->socket, buffer);
+}
+
+/**
+ * usb_schedule_submit() - start reading or writing a schedule
+ *
+ * Requests to one device are queued and sent back-to-back, requests to
+ * several devices are processed concurrently.
+ *
+ * @query:	query, must stay allocated until usb_schedule_result() returns
+ * @udev:	handle
+ * @socket:	outlet as numbered by the device
+ * @plan:	schedule to write, NULL to read
+ * Return:	0 on success, negative error number otherwise, -EINVAL if the
+ *		device cannot store the schedule; usb_schedule_result() must
+ *		not be called then
+ */
+int usb_schedule_submit(struct usb_query *query, struct transport_handle *udev,
+                        int socket, const struct plannif *plan)
+{
+  unsigned char buffer[0x28];
+  struct plannif copy;
+
+  if (plan) {
+    copy = *plan;
+    copy.socket = socket;
+    if (plannif_encode(get_id(udev->dev), &copy, buffer))
+      return -EINVAL;
+  }
+  usb_query_init(query, udev, 3 * socket + 1, 0, !plan, plan ? 0x27 : 0x28);
+  if (plan)
+    memcpy(query->xfer.data, buffer, 0x27);
+  return usb_query_send(query);
+}
+
+/**
+ * usb_schedule_result() - wait for a schedule to be read or written
+ *
+ * A failed transfer is repeated synchronously according to the retry policy.
+ *
+ * @query:	query started by usb_schedule_submit()
+ * @plan:	receives the schedule read
+ * Return:	0 on success, -1 on error
+ */
+int usb_schedule_result(struct usb_query *query, struct plannif *plan)
+{
+  struct transport_xfer *xfer = &query->xfer;
+  int in = xfer->requesttype & USB_DIR_IN;
+  enum metrics_op op = in ? METRICS_SCHEDULE_READ : METRICS_SCHEDULE_WRITE;
+
+  transport_wait(xfer);
+  if (xfer->result < 0x27) {
+    metrics_usb_retry(xfer->th->dev, op, xfer->result);
+    if (in)
+      return usb_command_getplannif(xfer->th, query->b1 / 3, plan);
+    return plannif_send(xfer->th, query->b1 / 3, xfer->data);
+  }
+  metrics_usb(xfer->th->dev, op, metrics_now() - query->start, true);
+  if (in)
+    plannif_decode(xfer->th, xfer->data, plan);
+  return 0;
 }
 
 // prepares the plannif structure with initial values : compulsory before structure use !
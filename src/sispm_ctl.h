@@ -27,10 +27,13 @@
 #ifndef SISPM_CTL_H
 #define SISPM_CTL_H
 
-#include <usb.h>
+#include <stdbool.h>
+#include <time.h>
+#include "transport.h"
 
-#define MAXGEMBIRD                      32
 #define MAXANSWER                       8192
+/* Size of a serial number string, e.g. 01:02:03:04:05 */
+#define SERIALSIZE                      15
 
 #define VENDOR_ID                       0x04B4
 
@@ -41,6 +44,23 @@
 #define PRODUCT_ID_SISPM_FLASH_NEW      0xFD13
 #define PRODUCT_ID_SISPM_EG_PMS2        0xFD15
 
+/* Default retry policy of USB control transfers */
+#define USB_TRIES                       5
+/* Maximum timeout of a single attempt in milliseconds */
+#define USB_TIMEOUT                     5000
+/* Maximum duration of all attempts in milliseconds */
+#define USB_DEADLINE                    5000
+/* Timeout of the first attempt if the latency is not yet known */
+#define USB_TIMEOUT_START               1000
+/* Minimum timeout derived from the latency */
+#define USB_TIMEOUT_MIN                 200
+/* First attempt times out after this multiple of the average latency */
+#define USB_LATENCY_FACTOR              8
+/* Initial backoff after a failed attempt in milliseconds */
+#define USB_BACKOFF                     1
+/* Average latency in milliseconds above which a device is reported as slow */
+#define USB_SLOW                        250
+
 /* Size of socket receive buffer */
 #define BUFFERSIZE                      4096
 
@@ -60,8 +80,7 @@
 
 #define CHECK(idx, size) \
   if (idx > 0x27 - (size - 1) -2) { \
-    printf ("Error : too many planification items, or combined with large time intervals\n"); \
-    exit(2); \
+    return -1; \
   } // avoid writing outside the buffer, or even in the last 2 bytes
 
 #define WRITENEXTBYTE { \
@@ -115,38 +134,90 @@ struct plannif {
 };
 
 void plannif_reset (struct plannif* plan);
-void usb_command_getplannif(usb_dev_handle *udev, int socket,
-                            struct plannif* plan);
-void usb_command_setplannif(usb_dev_handle *udev, struct plannif* plan);
+int usb_command_getplannif(struct transport_handle *udev, int socket,
+                           struct plannif* plan);
+int usb_command_setplannif(struct transport_handle *udev, struct plannif* plan);
 void plannif_display(const struct plannif* plan, int verbose,
                      const char* progname);
-void process(int out,char*v,struct usb_device*dev,int devnum);
+int plannif_printf(const struct plannif *plan, unsigned char *buffer);
+int plannif_encode(int id, const struct plannif *plan, unsigned char *buffer);
+/**
+ * struct usb_retry - retry policy of USB control transfers
+ *
+ * @tries:	maximum number of attempts
+ * @timeout:	maximum timeout of a single attempt in milliseconds
+ * @deadline:	maximum duration of all attempts in milliseconds
+ */
+struct usb_retry {
+  int tries;
+  int timeout;
+  int deadline;
+};
+
+extern struct usb_retry usb_retry;
+int usb_retry_parse(const char *arg);
+
+struct gembird;
+struct http_conn;
+void process(struct http_conn *conn, struct gembird *gb);
 
-usb_dev_handle*get_handle(struct usb_device*dev);
-int usb_command(usb_dev_handle *udev, int b1, int b2,
+struct transport_handle *get_handle(struct transport_dev *dev);
+int usb_command(struct transport_handle *udev, int b1, int b2,
                 int return_value_expected);
 
+/**
+ * struct usb_query - asynchronous status query, switch or schedule transfer
+ * of an outlet
+ *
+ * @xfer:	control transfer
+ * @b1:		first byte of the request
+ * @b2:		second byte of the request
+ * @start:	time of submission in microseconds
+ */
+struct usb_query {
+  struct transport_xfer xfer;
+  int b1;
+  int b2;
+  long long start;
+};
+
+int usb_query_submit(struct usb_query *query, struct transport_handle *udev,
+                     int b1);
+int usb_switch_submit(struct usb_query *query, struct transport_handle *udev,
+                      int b1, int on);
+int usb_query_result(struct usb_query *query);
+int usb_schedule_submit(struct usb_query *query, struct transport_handle *udev,
+                        int socket, const struct plannif *plan);
+int usb_schedule_result(struct usb_query *query, struct plannif *plan);
+
 #define sispm_buzzer_on(udev)           usb_command(udev, 0x02, 0x00, 0)
 #define sispm_buzzer_off(udev)          usb_command(udev, 0x02, 0x04, 0)
 
-int get_id( struct usb_device* dev);
-char* get_serial(usb_dev_handle *udev);
-int sispm_switch_on(usb_dev_handle * udev,int id, int outlet);
-int sispm_switch_off(usb_dev_handle * udev,int id, int outlet);
-int sispm_switch_getstatus(usb_dev_handle * udev,int id, int outlet);
-int sispm_get_power_supply_status(usb_dev_handle * udev,int id, int outlet);
+int get_id( struct transport_dev *dev);
+char* get_serial(struct transport_handle *udev);
+int sispm_get_serial(struct transport_handle *udev, char *serial);
+int sispm_switch_on(struct transport_handle *udev,int id, int outlet);
+int sispm_switch_off(struct transport_handle *udev,int id, int outlet);
+int sispm_switch_getstatus(struct transport_handle *udev,int id, int outlet);
+int sispm_get_power_supply_status(struct transport_handle *udev,int id, int outlet);
 int check_outlet_number(int id, int outlet);
-int sispm_switch_toggle(usb_dev_handle * udev,int id, int outlet);
+int sispm_switch_toggle(struct transport_handle *udev,int id, int outlet);
 
 extern int debug;
 extern int verbose;
+extern int usb_exit_on_error;
 extern char *homedir;
-/* Base64 encoded user:password */
-extern char *secret;
 
 int pms2_schedule_to_buffer(const struct plannif *schedule,
 			    unsigned char *buffer);
 void pms2_buffer_to_schedule(const unsigned char *buffer,
 			     struct plannif *schedule);
+time_t plannif_next(const struct plannif *schedule, time_t after);
+bool plannif_equal(const struct plannif *a, const struct plannif *b,
+		   time_t now);
+time_t plannif_date(const char *date, time_t now);
+int plannif_loop(struct plannif *schedule, ulong loop);
+int plannif_format(const struct plannif *schedule, char *buf, size_t size);
+int plannif_parse(const char *text, struct plannif *schedule);
 
 #endif
@@ -16,13 +16,19 @@
     Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 */
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <syslog.h>
 #include <time.h>
 #include <sys/socket.h>
@@ -34,53 +40,413 @@
 #ifdef HAVE_NET_ETHERNET_H
 #include <net/ethernet.h>
 #endif
-#include <usb.h>
 #include "sispm_ctl.h"
+#include "gembird.h"
 #include "socket.h"
+#include "http.h"
+#include "metrics.h"
 #include "nethelp.h"
 
 #ifndef WEBLESS
 int listenport=LISTENPORT;
+int listen_backlog = LISTENBACKLOG;
+int listen_workers = LISTENWORKERS;
 
-void l_listen(int*sock, struct usb_device*dev, int devnum)
+/* Seconds a client may take to start and to complete a request */
+#define RECEIVE_TIMEOUT 10
+/* Accepted connections waiting for a worker */
+#define QUEUESIZE 64
+/*
+ * Connections waiting for a request or a postponed response. Connections
+ * handed back by the workers may exceed it until idle ones are closed.
+ */
+#define IDLE_MAX 128
+
+/* Connections handed from the listener to the workers */
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  struct http_conn *conn[QUEUESIZE];
+  int head;
+  int count;
+} queue = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .not_empty = PTHREAD_COND_INITIALIZER,
+  .not_full = PTHREAD_COND_INITIALIZER,
+};
+
+/* Waiting and postponed connections handed back to the listener */
+static struct {
+  pthread_mutex_t mutex;
+  struct http_conn *head;
+  int pipe[2];
+} idle = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void queue_put(struct http_conn *conn)
 {
-  int i;
+  pthread_mutex_lock(&queue.mutex);
+  while (queue.count == QUEUESIZE)
+    pthread_cond_wait(&queue.not_full, &queue.mutex);
+  queue.conn[(queue.head + queue.count) % QUEUESIZE] = conn;
+  ++queue.count;
+  pthread_cond_signal(&queue.not_empty);
+  pthread_mutex_unlock(&queue.mutex);
+}
+
+static struct http_conn *queue_get(void)
+{
+  struct http_conn *conn;
+
+  pthread_mutex_lock(&queue.mutex);
+  while (!queue.count)
+    pthread_cond_wait(&queue.not_empty, &queue.mutex);
+  conn = queue.conn[queue.head];
+  queue.head = (queue.head + 1) % QUEUESIZE;
+  --queue.count;
+  pthread_cond_signal(&queue.not_full);
+  pthread_mutex_unlock(&queue.mutex);
+  return conn;
+}
+
+/* let the listener wait for more bytes of a connection or its deadline */
+static void idle_put(struct http_conn *conn)
+{
+  pthread_mutex_lock(&idle.mutex);
+  conn->next = idle.head;
+  idle.head = conn;
+  pthread_mutex_unlock(&idle.mutex);
+  /* the pipe is non-blocking, if it is full the listener is awake anyway */
+  if (write(idle.pipe[1], "", 1) == -1 && errno != EAGAIN)
+    syslog(LOG_ERR, "Waking up listener failed: %s\n", strerror(errno));
+}
+
+static struct http_conn *idle_get_all(void)
+{
+  struct http_conn *conn;
+  char buf[64];
+
+  while (read(idle.pipe[0], buf, sizeof(buf)) > 0)
+    ;
+  pthread_mutex_lock(&idle.mutex);
+  conn = idle.head;
+  idle.head = NULL;
+  pthread_mutex_unlock(&idle.mutex);
+  return conn;
+}
+
+/* answer a request that cannot be processed and close the connection */
+static void reject(struct http_conn *conn, const char *status)
+{
+  conn->keep_alive = false;
+  conn->status = atoi(status);
+  output_printf(conn->out, "HTTP/1.1 %s\r\nServer: SisPM\r\n", status);
+  http_header_end(conn->out, conn, true, 0);
+  output_finish(conn->out);
+}
+
+/*
+ * Answer a request that cannot be processed for lack of memory. Without
+ * memory for the output a fixed response is sent directly.
+ */
+static void unavailable(struct http_conn *conn)
+{
+  static const char response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                 "Server: SisPM\r\n"
+                                 "Content-Length: 0\r\n"
+                                 "Connection: close\r\n\r\n";
+
+  syslog(LOG_ERR, "Out of memory\n");
+  if (conn->out || http_output(conn)) {
+    reject(conn, "503 Service Unavailable");
+  } else {
+    conn->status = 503;
+    sock_write_bytes(conn->fd, (const unsigned char *)response,
+                     sizeof(response) - 1);
+  }
+}
+
+/* What happens to a connection after serve() */
+enum serve_result {
+  SERVE_CLOSE,
+  SERVE_WAIT,
+  SERVE_DELAYED,
+};
+
+/*
+ * Serve requests until no more bytes are available, a response is
+ * postponed, or the connection has to be closed. Pipelined requests are
+ * processed in order without waiting. The socket is never waited for, a
+ * connection waiting for bytes goes back to the listener with the deadline
+ * of its request or of the idle connection.
+ */
+static enum serve_result serve(struct http_conn *conn, struct gembird *gb)
+{
+  enum http_result ret;
+  bool served = false;
+  int n;
+
+  for (;;) {
+    /* a postponed response continues the current request */
+    if (!conn->delayed) {
+      ret = http_parse(conn);
+      if (ret == HTTP_INCOMPLETE) {
+        if (served && !conn->len) {
+          conn->deadline = http_now() + HTTP_KEEPALIVE * 1000LL;
+          return SERVE_WAIT;
+        }
+        n = http_read(conn);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+          return SERVE_WAIT;
+        if (n < 0 && errno == ENOMEM) {
+          conn->start = metrics_now();
+          unavailable(conn);
+          metrics_http(conn->status, metrics_now() - conn->start);
+          return SERVE_CLOSE;
+        }
+        if (n < 0) {
+          perror("Lost provider connection");
+          syslog(LOG_ERR, "Lost provider connection: %s\n", strerror(errno));
+        }
+        if (n <= 0)
+          return SERVE_CLOSE;
+        /* the first bytes of a request start its deadline */
+        if (n == conn->len)
+          conn->deadline = http_now() + RECEIVE_TIMEOUT * 1000LL;
+        continue;
+      }
+      conn->start = metrics_now();
+      /* the request buffer and the output always fit into the minimum */
+      if (!http_output(conn)) {
+        unavailable(conn);
+        metrics_http(conn->status, metrics_now() - conn->start);
+        return SERVE_CLOSE;
+      }
+      if (ret == HTTP_MALFORMED || ret == HTTP_TOO_LARGE) {
+        reject(conn, ret == HTTP_MALFORMED ? "400 Bad Request" :
+                                             "413 Request Entity Too Large");
+        metrics_http(conn->status, metrics_now() - conn->start);
+        return SERVE_CLOSE;
+      }
+    }
+    process(conn, gb);
+    if (conn->delayed)
+      return SERVE_DELAYED;
+    metrics_http(conn->status, metrics_now() - conn->start);
+    /* a response that could not be sent leaves the stream undefined */
+    if (!conn->keep_alive || conn->out->error)
+      return SERVE_CLOSE;
+    http_consume(conn);
+    if (conn->len)
+      conn->deadline = http_now() + RECEIVE_TIMEOUT * 1000LL;
+    served = true;
+  }
+}
+
+static void *worker(void *arg)
+{
+  struct gembird *gb = arg;
+  struct http_conn *conn;
+
+  for (;;) {
+    conn = queue_get();
+    switch (serve(conn, gb)) {
+    case SERVE_WAIT:
+      /* without pending bytes the memory is not needed while waiting */
+      if (!conn->len)
+        http_release(conn);
+      /* fall through */
+    case SERVE_DELAYED:
+      idle_put(conn);
+      break;
+    default:
+      http_close(conn);
+      break;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Accept a new connection. It waits in the listener until its request
+ * arrives, so a client that does not send anything occupies no worker.
+ */
+static struct http_conn *accept_conn(int sock)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  struct timeval tv = { RECEIVE_TIMEOUT, 0 };
+  struct http_conn *conn;
+  int on = 1;
   int s;
-  char *buffer;
 
-  buffer = (char *)malloc(BUFFERSIZE + 4);
+  s = accept(sock, (struct sockaddr *)&addr, &len);
+  if (s == -1) {
+    if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED)
+      return NULL;
+    perror("Accepting connection failed");
+    syslog(LOG_ERR, "Accepting connection failed: %s\n", strerror(errno));
+    /* Retry after error. Really bad errors shouldn't happen. */
+    sleep(1);
+    return NULL;
+  }
+  if(debug)
+    fprintf(stderr, "Provider connected.\n");
+
+  /* responses are gathered, do not delay the last segment */
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  /* a client not reading its response must not block a worker forever */
+  setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  conn = http_open(s);
+  if (!conn) {
+    syslog(LOG_ERR, "Out of memory\n");
+    close(s);
+    return NULL;
+  }
+  conn->addr = addr.sin_addr;
+  conn->deadline = http_now() + RECEIVE_TIMEOUT * 1000LL;
+  return conn;
+}
+
+/* Make room for more waiting connections. Returns 0 on success. */
+static int waiting_grow(struct http_conn ***waiting, struct pollfd **fds,
+                        int *size)
+{
+  int n = *size ? 2 * *size : IDLE_MAX;
+  void *p;
+
+  p = realloc(*waiting, n * sizeof(**waiting));
+  if (!p)
+    return -1;
+  *waiting = p;
+  p = realloc(*fds, (2 + n) * sizeof(**fds));
+  if (!p)
+    return -1;
+  *fds = p;
+  *size = n;
+  return 0;
+}
+
+/*
+ * Find the connection idle for the longest time, i.e. waiting for a
+ * request without any bytes of it. Returns its index or -1.
+ */
+static int waiting_oldest(struct http_conn **waiting, int count)
+{
+  int i, oldest = -1;
+
+  for (i = 0; i < count; ++i)
+    if (!waiting[i]->delayed && !waiting[i]->len &&
+        (oldest < 0 || waiting[i]->deadline < waiting[oldest]->deadline))
+      oldest = i;
+  return oldest;
+}
+
+void l_listen(int*sock, struct gembird *gb)
+{
+  struct pollfd *fds = NULL;
+  struct http_conn **waiting = NULL;
+  struct http_conn *conn, *next;
+  pthread_t thread;
+  long long now;
+  int count = 0;
+  int size = 0;
+  int timeout;
+  int i;
+
+  if (waiting_grow(&waiting, &fds, &size)) {
+    fprintf(stderr, "Out of memory\n");
+    syslog(LOG_ERR, "Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (pipe(idle.pipe) ||
+      fcntl(idle.pipe[0], F_SETFL, O_NONBLOCK) ||
+      fcntl(idle.pipe[1], F_SETFL, O_NONBLOCK)) {
+    perror("Creating pipe failed");
+    syslog(LOG_ERR, "Creating pipe failed: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < listen_workers; ++i) {
+    if (pthread_create(&thread, NULL, worker, gb)) {
+      perror("Creating worker thread failed");
+      syslog(LOG_ERR, "Creating worker thread failed\n");
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+  }
 
   if(debug)
     fprintf(stderr, "Listening for local provider on port %d...\n", listenport);
-  syslog(LOG_INFO, "Listening on port %d...\n", listenport);
-  listen(*sock, 1); /* We only get one connection on this port.
-                       Everything else is refused. */
+  syslog(LOG_INFO, "Listening on port %d with %d workers...\n", listenport,
+         listen_workers);
+  listen(*sock, listen_backlog);
+
+  /* wait for new connections and for requests on waiting connections */
   for (;;) {
-    while((s = accept(*sock, NULL, NULL)) == -1) {
-      perror("Accepting connection failed");
-      syslog(LOG_ERR, "Accepting connection failed: %s\n", strerror(errno));
-      sleep(1);
-      /* Retry after error. Really bad errors shouldn't happen. */
+    /* new connections stay in the backlog while all slots are taken */
+    fds[0].fd = count < IDLE_MAX ? *sock : -1;
+    fds[0].events = POLLIN;
+    fds[1].fd = idle.pipe[0];
+    fds[1].events = POLLIN;
+    timeout = -1;
+    now = http_now();
+    for (i = 0; i < count; ++i) {
+      /* postponed responses only wait for their time */
+      fds[2 + i].fd = waiting[i]->delayed ? -1 : waiting[i]->fd;
+      fds[2 + i].events = POLLIN;
+      if (timeout < 0 || waiting[i]->deadline - now < timeout)
+        timeout = waiting[i]->deadline > now ? waiting[i]->deadline - now : 0;
+    }
+    if (poll(fds, 2 + count, timeout) == -1) {
+      if (errno != EINTR) {
+        perror("Polling failed");
+        syslog(LOG_ERR, "Polling failed: %s\n", strerror(errno));
+        sleep(1);
+      }
+      continue;
+    }
+    now = http_now();
+
+    /*
+     * Pass readable connections and due responses to the workers, close
+     * expired connections quietly.
+     */
+    for (i = count - 1; i >= 0; --i) {
+      conn = waiting[i];
+      if (fds[2 + i].revents || (conn->delayed && conn->deadline <= now))
+        queue_put(conn);
+      else if (conn->deadline <= now)
+        http_close(conn);
+      else
+        continue;
+      waiting[i] = waiting[--count];
     }
-    if(debug)
-      fprintf(stderr, "Provider connected.\n");
-
-    for (;;) {
-      memset(buffer, 0, BUFFERSIZE + 4);
-      i = recv(s, buffer, BUFFERSIZE, 0);
-      if (i == -1) {
-        if (errno == EINTR) {
+
+    /* requests in progress and postponed responses are never dropped */
+    if (fds[1].revents) {
+      for (conn = idle_get_all(); conn; conn = next) {
+        next = conn->next;
+        if (count == size && waiting_grow(&waiting, &fds, &size)) {
+          syslog(LOG_ERR, "Out of memory\n");
+          http_close(conn);
           continue;
         }
-        /* wait for a new connection */
-        perror("Lost provider connection");
-        syslog(LOG_ERR, "Lost provider connection: %s\n", strerror(errno));
-      } else if (i > 0) {
-        process(s,buffer,dev,devnum);
+        waiting[count++] = conn;
+      }
+      while (count > IDLE_MAX && (i = waiting_oldest(waiting, count)) >= 0) {
+        http_close(waiting[i]);
+        waiting[i] = waiting[--count];
       }
-      break;
     }
-    close(s);
+
+    if (fds[0].revents && count < IDLE_MAX &&
+        (conn = accept_conn(*sock)) != NULL)
+      waiting[count++] = conn;
   }
 }
 
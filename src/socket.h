@@ -2,8 +2,14 @@
 #define LOCAL_H
 
 #define LISTENPORT 2638
+#define LISTENBACKLOG 16
+#define LISTENWORKERS 4
 extern int listenport;
+extern int listen_backlog;
+extern int listen_workers;
+struct gembird;
+
 int*socket_init(char*bindaddr);
-void l_listen(int*sock,struct usb_device*,int devnum);
+void l_listen(int*sock,struct gembird *gb);
 
 #endif /* ! LOCAL_H */
@@ -0,0 +1,642 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Cache of parsed web templates
+ *
+ * A template is read and split into literal text and commands once. It is
+ * parsed again only when the file changes on disk. Templates contain the
+ * HTTP header and commands of the form
+ *
+ *	$$off(#)?.1.:.2.$$	to switch off(#)
+ *	$$on(#)?.1.:.2.$$	to switch on(#)
+ *	$$toggle(#)?.1.:.2.$$	to toggle(#)
+ *	$$status(#)?.1.:.2.$$	to evaluate status(#)
+ *	$$version()$$		to evaluate version
+ *
+ * A command does not span lines.
+ *
+ * The HTTP header of a file is kept apart from the body so that the lines
+ * concerning the connection can be added per request. Files without
+ * commands are static. They are served from memory with an entity tag so
+ * that clients can revalidate them cheaply.
+ *
+ * Where inotify is available the directory of the skin is watched and
+ * cached files are dropped when they change. Otherwise each request checks
+ * the file by stat().
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "config.h"
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#include "gembird.h"
+#include "http.h"
+#include "metrics.h"
+#include "nethelp.h"
+#include "template.h"
+
+static struct template *templates;
+static pthread_mutex_t template_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Watched directory, NULL if changes are not notified */
+static char *template_dir;
+/* Incremented for each notified change */
+static unsigned long template_changes;
+
+static const struct {
+	const char *name;
+	enum template_kind kind;
+} template_cmds[] = {
+	{"on(", TEMPLATE_ON},
+	{"off(", TEMPLATE_OFF},
+	{"toggle(", TEMPLATE_TOGGLE},
+	{"status(", TEMPLATE_STATUS},
+	{"version(", TEMPLATE_VERSION},
+};
+
+static void template_free(struct template *tpl)
+{
+	free(tpl->path);
+	free(tpl->data);
+	free(tpl->nodes);
+	free(tpl->head);
+	free(tpl);
+}
+
+static struct template_node *template_add(struct template *tpl,
+					  enum template_kind kind,
+					  const char *text, size_t len)
+{
+	struct template_node *node;
+
+	/* merge adjacent literals */
+	if (kind == TEMPLATE_LITERAL && tpl->count &&
+	    tpl->nodes[tpl->count - 1].kind == TEMPLATE_LITERAL &&
+	    tpl->nodes[tpl->count - 1].text +
+	    tpl->nodes[tpl->count - 1].len == text) {
+		tpl->nodes[tpl->count - 1].len += len;
+		return &tpl->nodes[tpl->count - 1];
+	}
+	node = &tpl->nodes[tpl->count++];
+	memset(node, 0, sizeof(*node));
+	node->kind = kind;
+	node->text = text;
+	node->len = len;
+	return node;
+}
+
+static void template_error(const char *path, const char *format,
+			   const char *name)
+{
+	char buf[80];
+
+	snprintf(buf, sizeof(buf), format, name);
+	fprintf(stderr, "%s: Command-Format: %s\n", path, buf);
+	syslog(LOG_ERR, "%s: Command-Format: %s\n", path, buf);
+}
+
+/**
+ * template_parse_line() - split a line into literals and commands
+ *
+ * @tpl:	template
+ * @ptr:	start of the line
+ * @eol:	end of the line
+ * Return:	0 on success, -1 on a malformed command
+ */
+static int template_parse_line(struct template *tpl, const char *ptr,
+			       const char *eol)
+{
+	const char *mrk, *cmd, *num, *pos, *neg, *trm;
+	struct template_node *node;
+	enum template_kind kind;
+	int i;
+
+	for (mrk = ptr; ptr + 1 < eol; ++ptr) {
+		if (ptr[0] != '$' || ptr[1] != '$')
+			continue;
+		/*
+		 * $$exec(1)?positive:negative$$
+		 *   ^cmd    ^pos             ^trm
+		 * ^ptr   ^num        ^neg
+		 */
+		cmd = ptr + 2;
+		num = memchr(cmd, '(', eol - cmd);
+		pos = num ? num : cmd;
+		pos = memchr(pos, '?', eol - pos);
+		neg = pos ? pos : cmd;
+		neg = memchr(neg, ':', eol - neg);
+		trm = neg ? neg : cmd;
+		trm = memchr(trm, '$', eol - trm);
+		if (!trm)
+			continue;
+		if (!num) {
+			template_error(tpl->path, "$$%s(#)?positive:negative$$"
+				       " - ERROR at #", "exec");
+			return -1;
+		}
+		if (ptr > mrk)
+			template_add(tpl, TEMPLATE_LITERAL, mrk, ptr - mrk);
+
+		for (i = 0; i < sizeof(template_cmds) / sizeof(template_cmds[0]);
+		     ++i)
+			if (!strncasecmp(cmd, template_cmds[i].name,
+					 strlen(template_cmds[i].name)))
+				break;
+		if (i == sizeof(template_cmds) / sizeof(template_cmds[0])) {
+			/* unknown commands are replaced by $$ */
+			template_add(tpl, TEMPLATE_LITERAL, ptr, 2);
+		} else if ((kind = template_cmds[i].kind) == TEMPLATE_VERSION) {
+			if (trm + 1 >= eol || trm[1] != '$') {
+				template_error(tpl->path, "$$%s)$$",
+					       template_cmds[i].name);
+				return -1;
+			}
+			template_add(tpl, kind, NULL, 0);
+		} else {
+			if (trm + 1 >= eol || trm[1] != '$' || !pos || !neg) {
+				template_error(tpl->path,
+					       "$$%s#)?positive:negative$$",
+					       template_cmds[i].name);
+				return -1;
+			}
+			node = template_add(tpl, kind, pos + 1, neg - pos - 1);
+			node->outlet = atoi(num + 1);
+			node->neg = neg + 1;
+			node->neglen = trm - neg - 1;
+		}
+		mrk = trm + 2;
+		ptr = trm + 1;
+	}
+	if (eol > mrk)
+		template_add(tpl, TEMPLATE_LITERAL, mrk, eol - mrk);
+	return 0;
+}
+
+/**
+ * template_header() - separate the HTTP header of the file
+ *
+ * The header lines are copied to @tpl->head without the lines concerning
+ * the connection, which depend on the client. Files without commands get
+ * an entity tag and the modification time.
+ *
+ * @tpl:	parsed template
+ * Return:	0 on success, -1 if out of memory
+ */
+static int template_header(struct template *tpl)
+{
+	static const char * const skip[] = {
+		"Connection:", "Content-Length:", "Transfer-Encoding:",
+		"Keep-Alive:",
+	};
+	const char *ptr, *eol, *body = NULL, *end = tpl->data + tpl->size;
+	const char *nl = "\n";
+	struct template_node *node = tpl->nodes;
+	char *head;
+	struct tm tm;
+	size_t len;
+	int i;
+
+	/* the header ends with an empty line */
+	for (ptr = tpl->data; ptr + 1 < end; ++ptr) {
+		if (*ptr != '\n')
+			continue;
+		if (ptr[1] == '\n') {
+			body = ptr + 2;
+			break;
+		}
+		if (ptr[1] == '\r' && ptr + 2 < end && ptr[2] == '\n') {
+			body = ptr + 3;
+			break;
+		}
+	}
+	/* commands within the header are left alone */
+	if (!body || !tpl->count || node->kind != TEMPLATE_LITERAL ||
+	    node->text + node->len < body)
+		return 0;
+	if (ptr > tpl->data && ptr[-1] == '\r') {
+		nl = "\r\n";
+		tpl->crlf = true;
+	}
+
+	if (tpl->count == 1) {
+		snprintf(tpl->etag, sizeof(tpl->etag), "\"%lx-%llx-%llx\"",
+			 (unsigned long)tpl->ino, (unsigned long long)tpl->size,
+			 (unsigned long long)tpl->mtime);
+		gmtime_r(&tpl->mtime, &tm);
+		strftime(tpl->modified, sizeof(tpl->modified),
+			 "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	}
+
+	len = ptr + 1 - tpl->data + strlen(tpl->etag) +
+	      strlen(tpl->modified) + 40;
+	head = malloc(len);
+	if (!head)
+		return -1;
+	tpl->head = head;
+	for (ptr = tpl->data; ptr < body - 1 && *ptr != '\r' && *ptr != '\n';
+	     ptr = eol + 1) {
+		eol = memchr(ptr, '\n', body - ptr);
+		for (i = 0; i < sizeof(skip) / sizeof(skip[0]); ++i)
+			if (!strncasecmp(ptr, skip[i], strlen(skip[i])))
+				break;
+		if (i < sizeof(skip) / sizeof(skip[0]))
+			continue;
+		/* the connection handling requires HTTP/1.1 */
+		if (ptr == tpl->data && !strncmp(ptr, "HTTP/1.0 ", 9)) {
+			memcpy(head, "HTTP/1.1", 8);
+			memcpy(head + 8, ptr + 8, eol + 1 - ptr - 8);
+		} else {
+			memcpy(head, ptr, eol + 1 - ptr);
+		}
+		head += eol + 1 - ptr;
+	}
+	*head = '\0';
+	if (*tpl->etag)
+		snprintf(head, len - (head - tpl->head),
+			 "ETag: %s%sLast-Modified: %s%s",
+			 tpl->etag, nl, tpl->modified, nl);
+
+	/* the nodes describe the body */
+	node->len -= body - node->text;
+	node->text = body;
+	if (!node->len) {
+		--tpl->count;
+		memmove(node, node + 1, tpl->count * sizeof(*node));
+	}
+	return 0;
+}
+
+/**
+ * template_load() - read and parse a template file
+ *
+ * @path:	path of the file
+ * @fd:		opened file
+ * @st:		status of the file
+ * Return:	template or NULL on error, errno is EINVAL for a malformed
+ *		command
+ */
+static struct template *template_load(const char *path, int fd,
+				      const struct stat *st)
+{
+	struct template *tpl;
+	const char *ptr, *eol, *end;
+	size_t len = 0, max = 3;
+	int i;
+	ssize_t n;
+
+	tpl = calloc(1, sizeof(struct template));
+	if (!tpl)
+		return NULL;
+	tpl->path = strdup(path);
+	tpl->data = malloc(st->st_size + 1);
+	if (!tpl->path || !tpl->data)
+		goto err;
+	while (len < st->st_size) {
+		n = read(fd, tpl->data + len, st->st_size - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			goto err;
+		len += n;
+	}
+	tpl->data[len] = '\0';
+	tpl->mtime = st->st_mtime;
+	tpl->size = st->st_size;
+	tpl->ino = st->st_ino;
+
+	/* each "$$" may separate two literals and a command */
+	end = tpl->data + len;
+	for (ptr = tpl->data; ptr + 1 < end; ++ptr)
+		if (ptr[0] == '$' && ptr[1] == '$')
+			max += 2;
+	tpl->nodes = calloc(max, sizeof(struct template_node));
+	if (!tpl->nodes)
+		goto err;
+
+	for (ptr = tpl->data; ptr < end; ptr = eol) {
+		eol = memchr(ptr, '\n', end - ptr);
+		eol = eol ? eol + 1 : end;
+		if (template_parse_line(tpl, ptr, eol)) {
+			template_free(tpl);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+	if (template_header(tpl))
+		goto err;
+	tpl->length = 0;
+	for (i = 0; i < tpl->count; ++i) {
+		if (tpl->nodes[i].kind == TEMPLATE_LITERAL)
+			tpl->length += tpl->nodes[i].len;
+		else if (tpl->nodes[i].kind == TEMPLATE_VERSION)
+			tpl->length += strlen(PACKAGE_VERSION);
+		else
+			tpl->usb = true;
+	}
+	/* the result of commands determines the length */
+	if (tpl->usb)
+		tpl->length = HTTP_UNKNOWN_LENGTH;
+	tpl->refs = 1;
+	return tpl;
+err:
+	template_free(tpl);
+	return NULL;
+}
+
+/**
+ * template_is_watched() - check if changes of a file are notified
+ *
+ * The caller holds template_mutex.
+ *
+ * @path:	path of the file
+ * Return:	true if the file is in the watched directory
+ */
+static bool template_is_watched(const char *path)
+{
+	size_t len;
+
+	if (!template_dir)
+		return false;
+	len = strlen(template_dir);
+	return !strncmp(path, template_dir, len) && path[len] == '/' &&
+	       !strchr(path + len + 1, '/');
+}
+
+/**
+ * template_flush() - drop cached templates
+ *
+ * The caller holds template_mutex.
+ *
+ * @path:	path of the file or NULL for all files
+ */
+static void template_flush(const char *path)
+{
+	struct template *tpl, **pos;
+
+	for (pos = &templates; *pos;) {
+		tpl = *pos;
+		if (path && strcmp(tpl->path, path)) {
+			pos = &tpl->next;
+			continue;
+		}
+		*pos = tpl->next;
+		/* requests still rendering the template keep their reference */
+		if (!--tpl->refs)
+			template_free(tpl);
+	}
+}
+
+/**
+ * template_lookup() - find cached template
+ *
+ * The caller holds template_mutex. A stale entry is dropped.
+ *
+ * @path:	path of the file
+ * @st:		status of the file or NULL if the file is watched
+ * Return:	template with an additional reference or NULL
+ */
+static struct template *template_lookup(const char *path,
+					const struct stat *st)
+{
+	struct template *tpl;
+
+	for (tpl = templates; tpl; tpl = tpl->next) {
+		if (strcmp(tpl->path, path))
+			continue;
+		if (st ? tpl->mtime == st->st_mtime &&
+			 tpl->size == st->st_size && tpl->ino == st->st_ino :
+			 tpl->watched) {
+			++tpl->refs;
+			return tpl;
+		}
+		if (st)
+			template_flush(path);
+		return NULL;
+	}
+	return NULL;
+}
+
+/**
+ * template_get() - get parsed template
+ *
+ * The template is parsed if it is not cached or if the file has changed.
+ * The reference must be released with template_put().
+ *
+ * @path:	path of the file
+ * Return:	template or NULL if the file cannot be read or is malformed,
+ *		errno is EINVAL in the latter case
+ */
+struct template *template_get(const char *path)
+{
+	struct template *tpl;
+	unsigned long changes;
+	struct stat st;
+	int fd;
+
+	/* watched files are valid until a change is notified */
+	pthread_mutex_lock(&template_mutex);
+	tpl = template_lookup(path, NULL);
+	changes = template_changes;
+	pthread_mutex_unlock(&template_mutex);
+	if (tpl) {
+		metrics_cache(METRICS_CACHE_TEMPLATE, true);
+		return tpl;
+	}
+
+	if (stat(path, &st) || !S_ISREG(st.st_mode))
+		return NULL;
+	pthread_mutex_lock(&template_mutex);
+	tpl = template_lookup(path, &st);
+	pthread_mutex_unlock(&template_mutex);
+	metrics_cache(METRICS_CACHE_TEMPLATE, tpl != NULL);
+	if (tpl)
+		return tpl;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
+	tpl = template_load(path, fd, &st);
+	close(fd);
+	if (!tpl)
+		return NULL;
+
+	pthread_mutex_lock(&template_mutex);
+	/* a concurrent request may have loaded the file, too */
+	template_flush(path);
+	/* a change notified while loading may not be reflected yet */
+	tpl->watched = changes == template_changes &&
+		       template_is_watched(path);
+	tpl->next = templates;
+	templates = tpl;
+	++tpl->refs;
+	pthread_mutex_unlock(&template_mutex);
+	return tpl;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static void *template_notify(void *arg)
+{
+	int fd = (int)(long)arg;
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	char path[2048];
+	ssize_t len;
+	char *ptr;
+
+	for (;;) {
+		len = read(fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+		pthread_mutex_lock(&template_mutex);
+		++template_changes;
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)ptr;
+			if (event->mask & (IN_IGNORED | IN_DELETE_SELF |
+					   IN_MOVE_SELF)) {
+				/* the directory is gone, check files by stat() */
+				free(template_dir);
+				template_dir = NULL;
+				template_flush(NULL);
+			} else if (event->mask & IN_Q_OVERFLOW) {
+				template_flush(NULL);
+			} else if (event->len && template_dir) {
+				snprintf(path, sizeof(path), "%s/%s",
+					 template_dir, event->name);
+				template_flush(path);
+			}
+		}
+		pthread_mutex_unlock(&template_mutex);
+	}
+	pthread_mutex_lock(&template_mutex);
+	free(template_dir);
+	template_dir = NULL;
+	template_flush(NULL);
+	pthread_mutex_unlock(&template_mutex);
+	close(fd);
+	return NULL;
+}
+#endif
+
+/**
+ * template_watch() - watch directory for changed files
+ *
+ * Cached files from the directory are used without checking them on each
+ * request.
+ *
+ * @dir:	directory
+ * Return:	0 on success, -1 if changes cannot be watched
+ */
+int template_watch(const char *dir)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	pthread_t thread;
+	int fd;
+
+	fd = inotify_init();
+	if (fd < 0)
+		return -1;
+	if (inotify_add_watch(fd, dir, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+			      IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+			      IN_MOVED_TO | IN_DELETE_SELF |
+			      IN_MOVE_SELF) < 0) {
+		close(fd);
+		return -1;
+	}
+	pthread_mutex_lock(&template_mutex);
+	free(template_dir);
+	template_dir = strdup(dir);
+	/* drop files cached before the watch was set */
+	template_flush(NULL);
+	pthread_mutex_unlock(&template_mutex);
+	if (!template_dir ||
+	    pthread_create(&thread, NULL, template_notify, (void *)(long)fd)) {
+		pthread_mutex_lock(&template_mutex);
+		free(template_dir);
+		template_dir = NULL;
+		pthread_mutex_unlock(&template_mutex);
+		close(fd);
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * template_put() - release template
+ *
+ * @tpl:	template
+ */
+void template_put(struct template *tpl)
+{
+	pthread_mutex_lock(&template_mutex);
+	if (!--tpl->refs)
+		template_free(tpl);
+	pthread_mutex_unlock(&template_mutex);
+}
+
+/**
+ * template_render() - gather template executing its commands
+ *
+ * The output references the template. It must be flushed before the
+ * template is released.
+ *
+ * @out:	output
+ * @tpl:	template
+ * @gb:		device addressed by the commands
+ */
+void template_render(struct output *out, const struct template *tpl,
+		     struct gembird *gb)
+{
+	const struct template_node *node;
+	int result;
+	int i;
+
+	for (i = 0; i < tpl->count; ++i) {
+		node = &tpl->nodes[i];
+		switch (node->kind) {
+		case TEMPLATE_LITERAL:
+			output_add(out, node->text, node->len);
+			continue;
+		case TEMPLATE_VERSION:
+			output_add(out, PACKAGE_VERSION, strlen(PACKAGE_VERSION));
+			continue;
+		case TEMPLATE_ON:
+			result = gembird_command(gb, GEMBIRD_ON, node->outlet);
+			break;
+		case TEMPLATE_OFF:
+			result = gembird_command(gb, GEMBIRD_OFF, node->outlet);
+			break;
+		case TEMPLATE_TOGGLE:
+			result = gembird_command(gb, GEMBIRD_TOGGLE,
+						 node->outlet);
+			break;
+		default:
+			result = gembird_command(gb, GEMBIRD_STATUS,
+						 node->outlet);
+			break;
+		}
+		if (result > 0)
+			output_add(out, node->text, node->len);
+		else
+			output_add(out, node->neg, node->neglen);
+	}
+}
@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Cache of parsed web templates
+ */
+
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct gembird;
+struct output;
+
+/* Kinds of template segments */
+enum template_kind {
+	TEMPLATE_LITERAL,
+	TEMPLATE_ON,
+	TEMPLATE_OFF,
+	TEMPLATE_TOGGLE,
+	TEMPLATE_STATUS,
+	TEMPLATE_VERSION,
+};
+
+/**
+ * struct template_node - segment of a template
+ *
+ * Texts point into the file content held by the template.
+ *
+ * @kind:	literal text or command
+ * @outlet:	outlet of a command
+ * @text:	literal text or text if the command succeeds
+ * @len:	length of @text
+ * @neg:	text if the command fails
+ * @neglen:	length of @neg
+ */
+struct template_node {
+	enum template_kind kind;
+	int outlet;
+	const char *text;
+	size_t len;
+	const char *neg;
+	size_t neglen;
+};
+
+/**
+ * struct template - parsed template file
+ *
+ * The nodes describe the body. A file without commands is static. Its
+ * header is extended by an entity tag and the modification time.
+ *
+ * @path:	path of the file
+ * @mtime:	modification time of the file when parsed
+ * @size:	size of the file when parsed
+ * @ino:	inode of the file when parsed
+ * @data:	content of the file
+ * @nodes:	segments
+ * @count:	number of segments
+ * @usb:	commands access the device
+ * @watched:	changes of the file are notified, no need to check it
+ * @etag:	entity tag of a static file, empty otherwise
+ * @modified:	modification time as HTTP date
+ * @head:	header lines without the empty line, NULL if the file has
+ *		no header separable from the body
+ * @crlf:	the header uses CR LF as line end
+ * @length:	length of the body, HTTP_UNKNOWN_LENGTH if commands access
+ *		the device
+ * @refs:	number of references, one held by the cache
+ * @next:	next template in the cache
+ */
+struct template {
+	char *path;
+	time_t mtime;
+	off_t size;
+	ino_t ino;
+	char *data;
+	struct template_node *nodes;
+	int count;
+	bool usb;
+	bool watched;
+	char etag[64];
+	char modified[32];
+	char *head;
+	bool crlf;
+	long length;
+	int refs;
+	struct template *next;
+};
+
+int template_watch(const char *dir);
+struct template *template_get(const char *path);
+void template_put(struct template *tpl);
+void template_render(struct output *out, const struct template *tpl,
+		     struct gembird *gb);
+
+#endif /* TEMPLATE_H */
@@ -0,0 +1,308 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * USB transport
+ *
+ * The transport passes control transfers to a backend: libusb-1.0 for real
+ * devices or a simulator selected by the environment variable SISPMCTL_SIM.
+ *
+ * Control transfers are submitted asynchronously. The synchronous wrapper
+ * transport_control() submits a transfer and handles events until it has
+ * completed.
+ *
+ * Errors are reported as negative error numbers, e.g. -ETIMEDOUT for a
+ * timeout, -EPIPE for a stall, and -ENODEV for a device that is gone.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "metrics.h"
+#include "transport.h"
+
+static const struct transport_ops *ops = &transport_usb_ops;
+/* Error of the last failed call in the current thread */
+static __thread int last_error;
+
+static int transport_fail(int err)
+{
+	last_error = err;
+	return err;
+}
+
+/**
+ * transport_strerror() - describe the last error of the current thread
+ *
+ * Return:	error message
+ */
+const char *transport_strerror(void)
+{
+	return last_error ? strerror(-last_error) : "no error";
+}
+
+/**
+ * transport_init() - select and initialize the backend
+ *
+ * Return:	0 on success, negative error number otherwise
+ */
+int transport_init(void)
+{
+	const char *spec = getenv("SISPMCTL_SIM");
+	int ret;
+
+	if (spec && *spec)
+		ops = &transport_sim_ops;
+	ret = ops->init(spec);
+	return ret ? transport_fail(ret) : 0;
+}
+
+/**
+ * transport_name() - get name of the backend
+ *
+ * Return:	name
+ */
+const char *transport_name(void)
+{
+	return ops->name;
+}
+
+/**
+ * transport_scan() - find devices
+ *
+ * The devices found stay allocated for the lifetime of the process. The
+ * array is allocated with malloc(), the caller frees it.
+ *
+ * @match:	function selecting the devices of interest
+ * @devs:	set to the array of the devices found, NULL if none
+ * Return:	number of devices found
+ */
+int transport_scan(int (*match)(const struct transport_dev *dev),
+		   struct transport_dev ***devs)
+{
+	int ret;
+
+	*devs = NULL;
+	ret = ops->scan(match, devs);
+	if (ret < 0) {
+		transport_fail(ret);
+		return 0;
+	}
+	return ret;
+}
+
+/**
+ * transport_open() - open device
+ *
+ * @dev:	device
+ * Return:	handle or NULL on error
+ */
+struct transport_handle *transport_open(struct transport_dev *dev)
+{
+	struct transport_handle *th;
+	int ret;
+
+	th = calloc(1, sizeof(struct transport_handle));
+	if (!th) {
+		transport_fail(-ENOMEM);
+		return NULL;
+	}
+	th->dev = dev;
+	ret = ops->open(th);
+	if (ret) {
+		free(th);
+		transport_fail(ret);
+		return NULL;
+	}
+	metrics_handle(1);
+	return th;
+}
+
+/**
+ * transport_set_configuration() - select configuration
+ *
+ * @th:		handle
+ * @config:	configuration value
+ * Return:	0 on success, negative error number otherwise
+ */
+int transport_set_configuration(struct transport_handle *th, int config)
+{
+	int ret;
+
+	ret = ops->set_configuration(th, config);
+	return ret ? transport_fail(ret) : 0;
+}
+
+/**
+ * transport_claim_interface() - claim interface
+ *
+ * @th:		handle
+ * @interface:	interface number
+ * Return:	0 on success, negative error number otherwise
+ */
+int transport_claim_interface(struct transport_handle *th, int interface)
+{
+	int ret;
+
+	ret = ops->claim_interface(th, interface);
+	if (ret)
+		return transport_fail(ret);
+	th->claimed = 1;
+	return 0;
+}
+
+/**
+ * transport_set_altinterface() - select alternate setting of interface 0
+ *
+ * @th:		handle
+ * @alternate:	alternate setting
+ * Return:	0 on success, negative error number otherwise
+ */
+int transport_set_altinterface(struct transport_handle *th, int alternate)
+{
+	int ret;
+
+	ret = ops->set_altinterface(th, alternate);
+	return ret ? transport_fail(ret) : 0;
+}
+
+/**
+ * transport_close() - release interface and close handle
+ *
+ * @th:		handle, may be NULL
+ */
+void transport_close(struct transport_handle *th)
+{
+	if (!th)
+		return;
+	ops->close(th);
+	free(th);
+	metrics_handle(-1);
+}
+
+/**
+ * transport_submit() - start a control transfer
+ *
+ * On completion @xfer->result and @xfer->data are set and the callback is
+ * invoked. The transfer must stay allocated until then.
+ *
+ * @xfer:	transfer
+ * Return:	0 on success, negative error number otherwise
+ */
+int transport_submit(struct transport_xfer *xfer)
+{
+	int ret;
+
+	if (xfer->size > TRANSPORT_MAXDATA)
+		return transport_fail(-EINVAL);
+	xfer->result = 0;
+	xfer->done = 0;
+	ret = ops->submit(xfer);
+	return ret ? transport_fail(ret) : 0;
+}
+
+/**
+ * transport_events() - handle events until a condition is met
+ *
+ * Completion callbacks are invoked from this function.
+ *
+ * @completed:	handling stops when this is set to non-zero
+ */
+void transport_events(int *completed)
+{
+	ops->events(completed);
+}
+
+/**
+ * transport_hotplug() - report arriving and leaving devices
+ *
+ * Devices present when the function is called are reported as arriving.
+ * An arriving device stays allocated for the lifetime of the process unless
+ * it is passed to transport_release(). A
+ * leaving device is described by a temporary copy with the bus and device
+ * number under which it arrived, valid only during the callback.
+ *
+ * The callback must not wait for transfers. It is called from a thread of
+ * the backend.
+ *
+ * @match:	function selecting the devices of interest
+ * @callback:	called for each arriving or leaving device
+ * Return:	0 on success, -ENOSYS if the backend cannot detect devices
+ *		arriving or leaving, other negative error number on error
+ */
+int transport_hotplug(int (*match)(const struct transport_dev *dev),
+		      transport_hotplug_cb callback)
+{
+	int ret;
+
+	if (!ops->hotplug)
+		return transport_fail(-ENOSYS);
+	ret = ops->hotplug(match, callback);
+	return ret ? transport_fail(ret) : 0;
+}
+
+/**
+ * transport_release() - free an arriving device that is not used
+ *
+ * E.g. the devices present when transport_hotplug() is called are already
+ * known from transport_scan().
+ *
+ * @dev:	device reported as arriving by transport_hotplug()
+ */
+void transport_release(struct transport_dev *dev)
+{
+	ops->release(dev);
+}
+
+/**
+ * transport_wait() - wait for a submitted transfer to complete
+ *
+ * @xfer:	transfer
+ */
+void transport_wait(struct transport_xfer *xfer)
+{
+	transport_events(&xfer->done);
+	/* pairs with the release store of the completing thread */
+	if (__atomic_load_n(&xfer->done, __ATOMIC_ACQUIRE) && xfer->result < 0)
+		transport_fail(xfer->result);
+}
+
+/**
+ * transport_control() - synchronous control transfer
+ *
+ * @th:		handle
+ * @requesttype:	request type, bit 7 set for device to host
+ * @request:	request
+ * @value:	value
+ * @index:	index
+ * @data:	data to send or buffer for the data received
+ * @size:	size of the data stage
+ * @timeout:	timeout in milliseconds
+ * Return:	number of bytes transferred or negative error number
+ */
+int transport_control(struct transport_handle *th, int requesttype,
+		      int request, int value, int index, unsigned char *data,
+		      size_t size, unsigned int timeout)
+{
+	struct transport_xfer xfer = {
+		.th = th,
+		.requesttype = requesttype,
+		.request = request,
+		.value = value,
+		.index = index,
+		.size = size,
+		.timeout = timeout,
+	};
+	int ret;
+
+	if (size > TRANSPORT_MAXDATA)
+		return transport_fail(-EINVAL);
+	memcpy(xfer.data, data, size);
+	ret = transport_submit(&xfer);
+	if (ret)
+		return ret;
+	transport_wait(&xfer);
+	if (xfer.result > 0)
+		memcpy(data, xfer.data, xfer.result);
+	return xfer.result;
+}
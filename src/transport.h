@@ -0,0 +1,162 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * USB transport
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Maximum size of the data stage of a control transfer */
+#define TRANSPORT_MAXDATA 64
+/* Size of the setup packet of a control transfer */
+#define TRANSPORT_SETUP_SIZE 8
+/* Bit of the request type indicating a transfer from device to host */
+#define TRANSPORT_DIR_IN 0x80
+
+struct usb_latency;
+
+/**
+ * struct transport_dev - detected device
+ *
+ * @priv:	device of the backend
+ * @bus:	bus number, e.g. 001
+ * @filename:	device number on the bus, e.g. 004
+ * @devnum:	device number on the bus
+ * @vendor:	vendor id
+ * @product:	product id
+ * @release:	device release number
+ * @latency:	latency statistics, managed by the protocol layer
+ */
+struct transport_dev {
+	void *priv;
+	char bus[8];
+	char filename[8];
+	int devnum;
+	uint16_t vendor;
+	uint16_t product;
+	uint16_t release;
+	struct usb_latency *latency;
+};
+
+/**
+ * struct transport_handle - opened device
+ *
+ * @dev:	device
+ * @priv:	handle of the backend
+ * @claimed:	the interface has been claimed
+ */
+struct transport_handle {
+	struct transport_dev *dev;
+	void *priv;
+	int claimed;
+};
+
+struct transport_xfer;
+
+/* Completion callback, called from the thread handling events */
+typedef void (*transport_cb)(struct transport_xfer *xfer);
+
+/* Hotplug callback, called from the thread handling events */
+typedef void (*transport_hotplug_cb)(struct transport_dev *dev, int arrived);
+
+/**
+ * struct transport_xfer - asynchronous control transfer
+ *
+ * The caller fills in the fields up to @priv before calling
+ * transport_submit().
+ *
+ * @th:		handle
+ * @requesttype:	request type, bit 7 set for device to host
+ * @request:	request
+ * @value:	value
+ * @index:	index
+ * @size:	size of the data stage
+ * @timeout:	timeout in milliseconds
+ * @callback:	called on completion, may be NULL
+ * @priv:	for use by the caller
+ * @data:	data to send or data received
+ * @result:	number of bytes transferred or negative error number
+ * @done:	set last with a release store when the transfer has completed,
+ *		the owner may free the transfer as soon as it is set
+ * @buf:	setup packet and data stage, used by the backend
+ */
+struct transport_xfer {
+	struct transport_handle *th;
+	int requesttype;
+	int request;
+	int value;
+	int index;
+	size_t size;
+	unsigned int timeout;
+	transport_cb callback;
+	void *priv;
+	unsigned char data[TRANSPORT_MAXDATA];
+	int result;
+	int done;
+	unsigned char buf[TRANSPORT_SETUP_SIZE + TRANSPORT_MAXDATA];
+};
+
+/**
+ * struct transport_ops - backend of the transport
+ *
+ * Functions returning int return 0 or a negative error number.
+ *
+ * @name:	name of the backend
+ * @init:	initialize the backend, @spec is backend specific
+ * @scan:	find devices, see transport_scan()
+ * @open:	open device, set @th->priv
+ * @close:	close device, release the interface if claimed
+ * @set_configuration:	select configuration
+ * @claim_interface:	claim interface
+ * @set_altinterface:	select alternate setting of interface 0
+ * @submit:	start a control transfer, see transport_submit()
+ * @events:	handle events until *completed is set
+ * @hotplug:	report arriving and leaving devices, see transport_hotplug(),
+ *		NULL if not supported
+ * @release:	free an arriving device that is not used, see
+ *		transport_release()
+ */
+struct transport_ops {
+	const char *name;
+	int (*init)(const char *spec);
+	int (*scan)(int (*match)(const struct transport_dev *dev),
+		    struct transport_dev ***devs);
+	int (*open)(struct transport_handle *th);
+	void (*close)(struct transport_handle *th);
+	int (*set_configuration)(struct transport_handle *th, int config);
+	int (*claim_interface)(struct transport_handle *th, int interface);
+	int (*set_altinterface)(struct transport_handle *th, int alternate);
+	int (*submit)(struct transport_xfer *xfer);
+	void (*events)(int *completed);
+	int (*hotplug)(int (*match)(const struct transport_dev *dev),
+		       transport_hotplug_cb callback);
+	void (*release)(struct transport_dev *dev);
+};
+
+extern const struct transport_ops transport_usb_ops;
+extern const struct transport_ops transport_sim_ops;
+
+int transport_init(void);
+const char *transport_name(void);
+int transport_scan(int (*match)(const struct transport_dev *dev),
+		   struct transport_dev ***devs);
+struct transport_handle *transport_open(struct transport_dev *dev);
+int transport_set_configuration(struct transport_handle *th, int config);
+int transport_claim_interface(struct transport_handle *th, int interface);
+int transport_set_altinterface(struct transport_handle *th, int alternate);
+void transport_close(struct transport_handle *th);
+int transport_submit(struct transport_xfer *xfer);
+void transport_events(int *completed);
+int transport_hotplug(int (*match)(const struct transport_dev *dev),
+		      transport_hotplug_cb callback);
+void transport_release(struct transport_dev *dev);
+void transport_wait(struct transport_xfer *xfer);
+int transport_control(struct transport_handle *th, int requesttype,
+		      int request, int value, int index, unsigned char *data,
+		      size_t size, unsigned int timeout);
+const char *transport_strerror(void);
+
+#endif /* TRANSPORT_H */
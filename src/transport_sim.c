@@ -0,0 +1,564 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Simulated backend of the transport
+ *
+ * The simulator emulates Gembird power strips in process. It is selected by
+ * setting the environment variable SISPMCTL_SIM to a comma separated list of
+ * devices and parameters, e.g.
+ *
+ *	SISPMCTL_SIM=2*pms2,msispm,latency=20,timeout=5
+ *
+ * Devices:	sispm, sispm-flash, msispm, msispm-flash, pms2, each optionally
+ *		preceded by a count and an asterisk
+ * latency=ms:	time each device needs to process a request
+ * timeout=%:	percentage of requests that are never answered
+ * stall=%:	percentage of requests that are stalled
+ * short=%:	percentage of requests with a short answer
+ * seed=n:	seed of the random number generator
+ * replug=ms:	interval in which the last device is unplugged and plugged
+ *		in again with a new device number
+ * nopower=n:	outlet n of each device reports no power supply, may be
+ *		given for several outlets
+ *
+ * Each device processes one request at a time. Requests to different
+ * devices are processed concurrently.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "config.h"
+#include "sispm_ctl.h"
+#include "transport.h"
+
+#define SIM_SCHEDULE_SIZE 0x28
+
+/**
+ * struct sim_device - simulated power strip
+ *
+ * @product:	product id
+ * @index:	position in the device list
+ * @state:	relay states indexed by outlet
+ * @schedule:	schedule buffers indexed by outlet
+ * @busy_until:	time in microseconds when the last request is processed
+ * @address:	device number on the bus
+ * @present:	the device is plugged in
+ */
+struct sim_device {
+	uint16_t product;
+	int index;
+	int address;
+	int present;
+	int state[5];
+	unsigned char schedule[5][SIM_SCHEDULE_SIZE];
+	long long busy_until;
+};
+
+/**
+ * struct sim_xfer - pending transfer
+ *
+ * @xfer:	transfer
+ * @due:	time in microseconds when the transfer completes
+ * @next:	next pending transfer
+ */
+struct sim_xfer {
+	struct transport_xfer *xfer;
+	long long due;
+	struct sim_xfer *next;
+};
+
+static const struct {
+	const char *name;
+	uint16_t product;
+} sim_types[] = {
+	{"sispm", PRODUCT_ID_SISPM},
+	{"sispm-flash", PRODUCT_ID_SISPM_FLASH_NEW},
+	{"msispm", PRODUCT_ID_MSISPM_OLD},
+	{"msispm-flash", PRODUCT_ID_MSISPM_FLASH},
+	{"pms2", PRODUCT_ID_SISPM_EG_PMS2},
+};
+
+static struct sim_device *sim_devices;
+static int sim_count;
+static long long sim_latency;
+static int sim_timeout, sim_stall, sim_short;
+static unsigned int sim_seed = 1;
+static int sim_replug;
+/* bit n set if outlet n reports no power supply */
+static unsigned int sim_nopower;
+static transport_hotplug_cb sim_hotplug_callback;
+static int sim_address;
+static struct sim_xfer *sim_pending;
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sim_cond;
+
+static long long sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * sim_chance() - decide if a failure is injected
+ *
+ * The caller holds sim_mutex.
+ *
+ * @percent:	probability in percent
+ * Return:	non-zero if the failure shall be injected
+ */
+static int sim_chance(int percent)
+{
+	return percent && rand_r(&sim_seed) % 100 < percent;
+}
+
+static int sim_add(uint16_t product, int n)
+{
+	struct sim_device *devices, *dev;
+	struct plannif plan;
+	int outlet;
+
+	devices = realloc(sim_devices, (sim_count + n) * sizeof(*devices));
+	if (!devices)
+		return -ENOMEM;
+	sim_devices = devices;
+	for (; n; --n) {
+		dev = &sim_devices[sim_count];
+		memset(dev, 0, sizeof(*dev));
+		dev->product = product;
+		dev->index = sim_count++;
+		dev->address = ++sim_address;
+		dev->present = 1;
+		for (outlet = 0; outlet < 5; ++outlet) {
+			plannif_reset(&plan);
+			plan.socket = outlet;
+			if (product == PRODUCT_ID_SISPM_EG_PMS2)
+				pms2_schedule_to_buffer(&plan,
+							dev->schedule[outlet]);
+			else
+				plannif_printf(&plan, dev->schedule[outlet]);
+		}
+	}
+	return 0;
+}
+
+static int sim_parse(char *item)
+{
+	char *value;
+	int i, n = 1;
+
+	value = strchr(item, '=');
+	if (value) {
+		*value++ = '\0';
+		if (!strcmp(item, "latency"))
+			sim_latency = 1000LL * atoi(value);
+		else if (!strcmp(item, "timeout"))
+			sim_timeout = atoi(value);
+		else if (!strcmp(item, "stall"))
+			sim_stall = atoi(value);
+		else if (!strcmp(item, "short"))
+			sim_short = atoi(value);
+		else if (!strcmp(item, "seed"))
+			sim_seed = strtoul(value, NULL, 0);
+		else if (!strcmp(item, "replug"))
+			sim_replug = atoi(value);
+		else if (!strcmp(item, "nopower") && atoi(value) >= 1 &&
+			 atoi(value) <= 4)
+			sim_nopower |= 1U << atoi(value);
+		else
+			return -EINVAL;
+		return 0;
+	}
+	value = strchr(item, '*');
+	if (value) {
+		n = atoi(item);
+		item = value + 1;
+		if (n < 1)
+			return -EINVAL;
+	}
+	for (i = 0; i < sizeof(sim_types) / sizeof(sim_types[0]); ++i)
+		if (!strcmp(item, sim_types[i].name))
+			return sim_add(sim_types[i].product, n);
+	return -EINVAL;
+}
+
+static int sim_init(const char *spec)
+{
+	pthread_condattr_t attr;
+	char *buf, *item, *save;
+	int ret = 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sim_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	buf = strdup(spec);
+	if (!buf)
+		return -ENOMEM;
+	for (item = strtok_r(buf, ",", &save); item;
+	     item = strtok_r(NULL, ",", &save)) {
+		ret = sim_parse(item);
+		if (ret) {
+			fprintf(stderr, "Invalid SISPMCTL_SIM item '%s'\n",
+				item);
+			break;
+		}
+	}
+	free(buf);
+	if (ret)
+		return ret;
+	if (!sim_count)
+		return sim_add(PRODUCT_ID_SISPM_EG_PMS2, 1);
+	return 0;
+}
+
+/**
+ * sim_dev_new() - describe a device
+ *
+ * @dev:	simulated device
+ * Return:	device or NULL if out of memory
+ */
+static struct transport_dev *sim_dev_new(struct sim_device *dev)
+{
+	struct transport_dev *tdev;
+
+	tdev = calloc(1, sizeof(struct transport_dev));
+	if (!tdev)
+		return NULL;
+	tdev->priv = dev;
+	tdev->devnum = dev->address;
+	snprintf(tdev->bus, sizeof(tdev->bus), "000");
+	snprintf(tdev->filename, sizeof(tdev->filename), "%03d",
+		 dev->address % 1000);
+	tdev->vendor = VENDOR_ID;
+	tdev->product = dev->product;
+	tdev->release = 0x0100;
+	return tdev;
+}
+
+static int sim_scan(int (*match)(const struct transport_dev *dev),
+		    struct transport_dev ***devs)
+{
+	struct transport_dev *tdev;
+	int i, count = 0;
+
+	*devs = calloc(sim_count + 1, sizeof(struct transport_dev *));
+	if (!*devs)
+		return -ENOMEM;
+	for (i = 0; i < sim_count; ++i) {
+		if (!sim_devices[i].present)
+			continue;
+		tdev = sim_dev_new(&sim_devices[i]);
+		if (!tdev)
+			break;
+		if (!match(tdev)) {
+			free(tdev);
+			continue;
+		}
+		(*devs)[count++] = tdev;
+	}
+	return count;
+}
+
+/* a handle of a device that was unplugged stays unusable */
+static int sim_gone(struct transport_dev *tdev)
+{
+	struct sim_device *dev = tdev->priv;
+
+	return !dev->present || dev->address != tdev->devnum;
+}
+
+static int sim_open(struct transport_handle *th)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&sim_mutex);
+	if (sim_gone(th->dev))
+		ret = -ENODEV;
+	else
+		th->priv = th->dev->priv;
+	pthread_mutex_unlock(&sim_mutex);
+	return ret;
+}
+
+static void sim_close(struct transport_handle *th)
+{
+}
+
+static int sim_nop(struct transport_handle *th, int value)
+{
+	return 0;
+}
+
+/**
+ * sim_outlet() - get outlet addressed by the first byte of a request
+ *
+ * @dev:	device
+ * @b1:		first byte of the request, 3 * outlet
+ * Return:	outlet or -1 if the device has no such outlet
+ */
+static int sim_outlet(struct sim_device *dev, int b1)
+{
+	int outlet = b1 / 3;
+
+	switch (dev->product) {
+	case PRODUCT_ID_MSISPM_OLD:
+		return outlet == 0 ? 0 : -1;
+	case PRODUCT_ID_MSISPM_FLASH:
+		return outlet == 1 ? 1 : -1;
+	default:
+		return outlet >= 1 && outlet <= 4 ? outlet : -1;
+	}
+}
+
+/**
+ * sim_process() - process a request as the device would
+ *
+ * The caller holds sim_mutex.
+ *
+ * @dev:	device
+ * @xfer:	transfer
+ * Return:	number of bytes transferred or negative error number
+ */
+static int sim_process(struct sim_device *dev, struct transport_xfer *xfer)
+{
+	int in = xfer->requesttype & TRANSPORT_DIR_IN;
+	int b1 = xfer->value & 0xff;
+	int outlet;
+
+	if ((xfer->value >> 8) != 0x03 || xfer->request != (in ? 0x01 : 0x09))
+		return -EPIPE;
+
+	/* serial number */
+	if (in && b1 == 1 && xfer->size == 5) {
+		xfer->data[0] = 0x53;
+		xfer->data[1] = 0x49;
+		xfer->data[2] = 0x4d;
+		xfer->data[3] = 0x00;
+		xfer->data[4] = dev->index + 1;
+		return 5;
+	}
+
+	/* buzzer */
+	if (b1 == 2 && !in)
+		return xfer->size;
+
+	outlet = sim_outlet(dev, b1 - b1 % 3);
+	if (outlet < 0)
+		return -EPIPE;
+
+	/* schedule */
+	if (b1 % 3 == 1) {
+		if (xfer->size < SIM_SCHEDULE_SIZE - 1 ||
+		    xfer->size > SIM_SCHEDULE_SIZE)
+			return -EPIPE;
+		if (in)
+			memcpy(xfer->data, dev->schedule[outlet], xfer->size);
+		else
+			memcpy(dev->schedule[outlet], xfer->data, xfer->size);
+		return xfer->size;
+	}
+	if (b1 % 3 || xfer->size < 2)
+		return -EPIPE;
+
+	/* relay, bit 1 of the status indicates the power supply */
+	if (in)
+		xfer->data[1] = dev->state[outlet] |
+				(sim_nopower & 1U << (outlet ? outlet : 1) ?
+				 0 : 2);
+	else
+		dev->state[outlet] = xfer->data[1] & 1;
+	return xfer->size;
+}
+
+static int sim_submit(struct transport_xfer *xfer)
+{
+	struct sim_device *dev = xfer->th->priv;
+	struct sim_xfer *sx, **pos;
+	long long now = sim_now();
+
+	sx = calloc(1, sizeof(*sx));
+	if (!sx)
+		return -ENOMEM;
+	sx->xfer = xfer;
+
+	pthread_mutex_lock(&sim_mutex);
+	if (sim_gone(xfer->th->dev)) {
+		pthread_mutex_unlock(&sim_mutex);
+		free(sx);
+		return -ENODEV;
+	}
+	if (sim_chance(sim_timeout)) {
+		/* the device never answers */
+		xfer->result = -ETIMEDOUT;
+		sx->due = now + 1000LL * xfer->timeout;
+	} else {
+		if (dev->busy_until < now)
+			dev->busy_until = now;
+		dev->busy_until += sim_latency;
+		sx->due = dev->busy_until;
+		if (sim_chance(sim_stall)) {
+			xfer->result = -EPIPE;
+		} else {
+			xfer->result = sim_process(dev, xfer);
+			if (xfer->result > 1 && sim_chance(sim_short))
+				xfer->result = 1;
+		}
+	}
+	/* keep the queue sorted by due time */
+	for (pos = &sim_pending; *pos && (*pos)->due <= sx->due;
+	     pos = &(*pos)->next)
+		;
+	sx->next = *pos;
+	*pos = sx;
+	pthread_cond_broadcast(&sim_cond);
+	pthread_mutex_unlock(&sim_mutex);
+	return 0;
+}
+
+static void sim_events(int *completed)
+{
+	struct sim_xfer *due, *sx;
+	struct timespec ts;
+	transport_cb callback;
+	long long now;
+
+	pthread_mutex_lock(&sim_mutex);
+	while (!__atomic_load_n(completed, __ATOMIC_ACQUIRE)) {
+		now = sim_now();
+		if (!sim_pending) {
+			pthread_cond_wait(&sim_cond, &sim_mutex);
+			continue;
+		}
+		if (sim_pending->due > now) {
+			ts.tv_sec = sim_pending->due / 1000000;
+			ts.tv_nsec = sim_pending->due % 1000000 * 1000;
+			pthread_cond_timedwait(&sim_cond, &sim_mutex, &ts);
+			continue;
+		}
+
+		/* take all due transfers and complete them without the lock */
+		due = sim_pending;
+		for (sx = due; sx->next && sx->next->due <= now; sx = sx->next)
+			;
+		sim_pending = sx->next;
+		sx->next = NULL;
+		pthread_mutex_unlock(&sim_mutex);
+		while (due) {
+			sx = due;
+			due = sx->next;
+			/* the owner may free the transfer once it is done */
+			callback = sx->xfer->callback;
+			__atomic_store_n(&sx->xfer->done, 1, __ATOMIC_RELEASE);
+			if (callback)
+				callback(sx->xfer);
+			free(sx);
+		}
+		pthread_mutex_lock(&sim_mutex);
+		pthread_cond_broadcast(&sim_cond);
+	}
+	pthread_mutex_unlock(&sim_mutex);
+}
+
+/**
+ * sim_unplug() - remove a device from the bus
+ *
+ * Pending transfers of the device fail. The caller holds sim_mutex.
+ *
+ * @dev:	device
+ */
+static void sim_unplug(struct sim_device *dev)
+{
+	struct sim_xfer *sx;
+
+	dev->present = 0;
+	for (sx = sim_pending; sx; sx = sx->next)
+		if (sx->xfer->th->priv == dev)
+			sx->xfer->result = -ENODEV;
+}
+
+static void *sim_replug_thread(void *arg)
+{
+	struct sim_device *dev = &sim_devices[sim_count - 1];
+	struct transport_dev *tdev;
+	int arrived;
+
+	for (;;) {
+		usleep(1000 * sim_replug);
+		pthread_mutex_lock(&sim_mutex);
+		tdev = sim_dev_new(dev);
+		if (!tdev) {
+			pthread_mutex_unlock(&sim_mutex);
+			continue;
+		}
+		arrived = !dev->present;
+		if (arrived) {
+			dev->address = ++sim_address;
+			dev->present = 1;
+			tdev->devnum = dev->address;
+			snprintf(tdev->filename, sizeof(tdev->filename),
+				 "%03d", dev->address % 1000);
+		} else {
+			sim_unplug(dev);
+		}
+		pthread_cond_broadcast(&sim_cond);
+		pthread_mutex_unlock(&sim_mutex);
+		sim_hotplug_callback(tdev, arrived);
+		if (!arrived)
+			free(tdev);
+	}
+	return NULL;
+}
+
+static void sim_release(struct transport_dev *dev)
+{
+	free(dev);
+}
+
+static int sim_hotplug(int (*match)(const struct transport_dev *dev),
+		       transport_hotplug_cb callback)
+{
+	struct transport_dev *tdev;
+	pthread_t thread;
+	int i;
+
+	for (i = 0; i < sim_count; ++i) {
+		if (!sim_devices[i].present)
+			continue;
+		tdev = sim_dev_new(&sim_devices[i]);
+		if (!tdev)
+			return -ENOMEM;
+		if (match(tdev))
+			callback(tdev, 1);
+		else
+			free(tdev);
+	}
+	if (!sim_replug)
+		return 0;
+	sim_hotplug_callback = callback;
+	if (pthread_create(&thread, NULL, sim_replug_thread, NULL))
+		return -EAGAIN;
+	pthread_detach(thread);
+	return 0;
+}
+
+const struct transport_ops transport_sim_ops = {
+	.name = "sim",
+	.init = sim_init,
+	.scan = sim_scan,
+	.open = sim_open,
+	.close = sim_close,
+	.set_configuration = sim_nop,
+	.claim_interface = sim_nop,
+	.set_altinterface = sim_nop,
+	.submit = sim_submit,
+	.events = sim_events,
+	.hotplug = sim_hotplug,
+	.release = sim_release,
+};
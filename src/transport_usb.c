@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * USB backend of the transport based on libusb-1.0
+ *
+ * Control transfers are submitted asynchronously. Their completion callbacks
+ * run in whichever thread handles libusb events, so several threads may wait
+ * for transfers on different devices at the same time.
+ *
+ * Hotplug notifications also arrive while libusb events are handled. Once
+ * they are requested a thread handles events permanently.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb.h>
+#include "config.h"
+#include "transport.h"
+
+static libusb_context *ctx;
+static int (*usb_hotplug_match)(const struct transport_dev *dev);
+static transport_hotplug_cb usb_hotplug_callback;
+
+/**
+ * usb_errno() - convert libusb error code to error number
+ *
+ * @err:	libusb error code
+ * Return:	negative error number
+ */
+static int usb_errno(int err)
+{
+	switch (err) {
+	case LIBUSB_ERROR_TIMEOUT:
+		return -ETIMEDOUT;
+	case LIBUSB_ERROR_PIPE:
+		return -EPIPE;
+	case LIBUSB_ERROR_NO_DEVICE:
+		return -ENODEV;
+	case LIBUSB_ERROR_NOT_FOUND:
+		return -ENOENT;
+	case LIBUSB_ERROR_BUSY:
+		return -EBUSY;
+	case LIBUSB_ERROR_ACCESS:
+		return -EACCES;
+	case LIBUSB_ERROR_NO_MEM:
+		return -ENOMEM;
+	case LIBUSB_ERROR_INTERRUPTED:
+		return -EINTR;
+	case LIBUSB_ERROR_OVERFLOW:
+		return -EOVERFLOW;
+	case LIBUSB_ERROR_INVALID_PARAM:
+		return -EINVAL;
+	case LIBUSB_ERROR_NOT_SUPPORTED:
+		return -ENOSYS;
+	default:
+		return -EIO;
+	}
+}
+
+static int usb_init(const char *spec)
+{
+	int ret;
+
+	ret = libusb_init(&ctx);
+	return ret ? usb_errno(ret) : 0;
+}
+
+/**
+ * usb_dev_new() - describe a device
+ *
+ * @device:	libusb device
+ * Return:	device or NULL on error
+ */
+static struct transport_dev *usb_dev_new(libusb_device *device)
+{
+	struct libusb_device_descriptor desc;
+	struct transport_dev *tdev;
+
+	if (libusb_get_device_descriptor(device, &desc))
+		return NULL;
+	tdev = calloc(1, sizeof(struct transport_dev));
+	if (!tdev)
+		return NULL;
+	tdev->priv = device;
+	tdev->devnum = libusb_get_device_address(device);
+	snprintf(tdev->bus, sizeof(tdev->bus), "%03d",
+		 libusb_get_bus_number(device));
+	snprintf(tdev->filename, sizeof(tdev->filename), "%03d", tdev->devnum);
+	tdev->vendor = desc.idVendor;
+	tdev->product = desc.idProduct;
+	tdev->release = desc.bcdDevice;
+	return tdev;
+}
+
+static int usb_scan(int (*match)(const struct transport_dev *dev),
+		    struct transport_dev ***devs)
+{
+	struct transport_dev *tdev;
+	libusb_device **list;
+	ssize_t i, n;
+	int count = 0;
+
+	n = libusb_get_device_list(ctx, &list);
+	if (n < 0)
+		return usb_errno(n);
+	*devs = calloc(n + 1, sizeof(struct transport_dev *));
+	if (!*devs) {
+		libusb_free_device_list(list, 1);
+		return -ENOMEM;
+	}
+	for (i = 0; i < n; ++i) {
+		tdev = usb_dev_new(list[i]);
+		if (!tdev)
+			continue;
+		if (!match(tdev)) {
+			free(tdev);
+			continue;
+		}
+		libusb_ref_device(list[i]);
+		(*devs)[count++] = tdev;
+	}
+	libusb_free_device_list(list, 1);
+	return count;
+}
+
+static int usb_open(struct transport_handle *th)
+{
+	libusb_device_handle *handle;
+	int ret;
+
+	ret = libusb_open(th->dev->priv, &handle);
+	if (ret)
+		return usb_errno(ret);
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+	/* the HID driver may have bound the interface */
+	libusb_set_auto_detach_kernel_driver(handle, 1);
+#endif
+	th->priv = handle;
+	return 0;
+}
+
+static void usb_close(struct transport_handle *th)
+{
+	if (th->claimed)
+		libusb_release_interface(th->priv, 0);
+	libusb_close(th->priv);
+}
+
+static int usb_set_configuration(struct transport_handle *th, int config)
+{
+	int ret, current;
+
+	/* setting the active configuration again would reset the device */
+	if (!libusb_get_configuration(th->priv, &current) && current == config)
+		return 0;
+	ret = libusb_set_configuration(th->priv, config);
+	return ret ? usb_errno(ret) : 0;
+}
+
+static int usb_claim_interface(struct transport_handle *th, int interface)
+{
+	int ret;
+
+	ret = libusb_claim_interface(th->priv, interface);
+	return ret ? usb_errno(ret) : 0;
+}
+
+static int usb_set_altinterface(struct transport_handle *th, int alternate)
+{
+	int ret;
+
+	ret = libusb_set_interface_alt_setting(th->priv, 0, alternate);
+	return ret ? usb_errno(ret) : 0;
+}
+
+static void LIBUSB_CALL usb_complete(struct libusb_transfer *transfer)
+{
+	struct transport_xfer *xfer = transfer->user_data;
+	transport_cb callback;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		xfer->result = transfer->actual_length;
+		if (xfer->requesttype & TRANSPORT_DIR_IN)
+			memcpy(xfer->data,
+			       libusb_control_transfer_get_data(transfer),
+			       transfer->actual_length);
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		xfer->result = -ETIMEDOUT;
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		xfer->result = -EPIPE;
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		xfer->result = -ENODEV;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		xfer->result = -ECANCELED;
+		break;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		xfer->result = -EOVERFLOW;
+		break;
+	default:
+		xfer->result = -EIO;
+	}
+	libusb_free_transfer(transfer);
+	/* the owner may free the transfer once it is done */
+	callback = xfer->callback;
+	__atomic_store_n(&xfer->done, 1, __ATOMIC_RELEASE);
+	if (callback)
+		callback(xfer);
+}
+
+static int usb_submit(struct transport_xfer *xfer)
+{
+	struct libusb_transfer *transfer;
+	int ret;
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer)
+		return -ENOMEM;
+	libusb_fill_control_setup(xfer->buf, xfer->requesttype,
+				  xfer->request, xfer->value, xfer->index,
+				  xfer->size);
+	if (!(xfer->requesttype & TRANSPORT_DIR_IN))
+		memcpy(xfer->buf + LIBUSB_CONTROL_SETUP_SIZE, xfer->data,
+		       xfer->size);
+	libusb_fill_control_transfer(transfer, xfer->th->priv, xfer->buf,
+				     usb_complete, xfer, xfer->timeout);
+	ret = libusb_submit_transfer(transfer);
+	if (ret) {
+		libusb_free_transfer(transfer);
+		return usb_errno(ret);
+	}
+	return 0;
+}
+
+static void usb_events(int *completed)
+{
+	while (!__atomic_load_n(completed, __ATOMIC_ACQUIRE))
+		libusb_handle_events_completed(ctx, completed);
+}
+
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+static int LIBUSB_CALL usb_hotplug_event(libusb_context *context,
+					 libusb_device *device,
+					 libusb_hotplug_event event,
+					 void *user_data)
+{
+	struct transport_dev *tdev;
+
+	tdev = usb_dev_new(device);
+	if (!tdev)
+		return 0;
+	if (!usb_hotplug_match(tdev)) {
+		free(tdev);
+		return 0;
+	}
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		libusb_ref_device(device);
+		usb_hotplug_callback(tdev, 1);
+	} else {
+		usb_hotplug_callback(tdev, 0);
+		free(tdev);
+	}
+	return 0;
+}
+
+static void *usb_hotplug_thread(void *arg)
+{
+	for (;;)
+		libusb_handle_events(ctx);
+	return NULL;
+}
+
+static void usb_release(struct transport_dev *dev)
+{
+	libusb_unref_device(dev->priv);
+	free(dev);
+}
+
+static int usb_hotplug(int (*match)(const struct transport_dev *dev),
+		       transport_hotplug_cb callback)
+{
+	pthread_t thread;
+	int ret;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return -ENOSYS;
+	usb_hotplug_match = match;
+	usb_hotplug_callback = callback;
+	ret = libusb_hotplug_register_callback(ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+			LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			usb_hotplug_event, NULL, NULL);
+	if (ret)
+		return usb_errno(ret);
+	if (pthread_create(&thread, NULL, usb_hotplug_thread, NULL))
+		return -EAGAIN;
+	pthread_detach(thread);
+	return 0;
+}
+#endif
+
+const struct transport_ops transport_usb_ops = {
+	.name = "usb",
+	.init = usb_init,
+	.scan = usb_scan,
+	.open = usb_open,
+	.close = usb_close,
+	.set_configuration = usb_set_configuration,
+	.claim_interface = usb_claim_interface,
+	.set_altinterface = usb_set_altinterface,
+	.submit = usb_submit,
+	.events = usb_events,
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+	.hotplug = usb_hotplug,
+	.release = usb_release,
+#endif
+};